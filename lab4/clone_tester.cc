@@ -0,0 +1,118 @@
+//
+// Clone (copy-on-write) tester
+//
+
+#include <list>
+#include <map>
+#include <string>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inode_manager.h"
+
+// past NDIRECT, so the indirect block is cloned too
+#define NBLOCKS 150
+int size = NBLOCKS * BLOCK_SIZE - 100;
+
+inode_manager *im;
+std::string data;
+
+// free data blocks, counted in the block bitmap
+int
+free_blocks(void)
+{
+  char buf[BLOCK_SIZE];
+  int n = 0;
+  im->read_block(BBLOCK(1), buf);
+  for (int i = 0; i < BLOCK_NUM; i++) {
+    if ((buf[i / 8] & ((char)1 << (7 - i % 8))) == 0)
+      n++;
+  }
+  return n;
+}
+
+std::string
+contents(uint32_t inum)
+{
+  char *buf = NULL;
+  int n = 0;
+  im->read_file(inum, &buf, &n);
+  std::string s(buf ? buf : "", n);
+  free(buf);
+  return s;
+}
+
+void
+check(bool ok, const char *what)
+{
+  if (!ok) {
+    fprintf(stderr, "error: %s\n", what);
+    fprintf(stdout, "error: %s\n", what);
+    exit(1);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  im = new inode_manager();
+  for (int i = 0; i < size; i++)
+    data += (char)('a' + (i / BLOCK_SIZE + i) % 26);
+  int free0 = free_blocks();
+
+  printf ("test1: clone a file of %d blocks\n", NBLOCKS);
+  uint32_t a = im->alloc_inode(extent_protocol::T_FILE);
+  im->write_file(a, data.data(), data.size());
+  check(free0 - free_blocks() == NBLOCKS + 1, "file does not use its blocks");
+  uint32_t b = im->clone_inode(a);
+  check(b != 0, "clone failed");
+  // only the indirect block is copied
+  check(free0 - free_blocks() == NBLOCKS + 2, "clone copied data blocks");
+  check(contents(b) == data, "clone differs");
+
+  printf ("test2: write to the clone, the original stays\n");
+  std::string a_data = data, b_data = data;
+  std::string patch(BLOCK_SIZE, 'X');
+  uint32_t offs[] = { 3 * BLOCK_SIZE + 10, 120 * BLOCK_SIZE };
+  for (int i = 0; i < 2; i++) {
+    im->write_range(b, offs[i], patch.data(), 200);
+    b_data.replace(offs[i], 200, patch, 0, 200);
+  }
+  check(contents(b) == b_data, "clone lost its write");
+  check(contents(a) == a_data, "write to clone changed the original");
+  check(free0 - free_blocks() == NBLOCKS + 4, "write copied more than it wrote");
+
+  printf ("test3: rewrite the original, the clone stays\n");
+  a_data = std::string(2 * BLOCK_SIZE, 'Y');
+  im->write_file(a, a_data.data(), a_data.size());
+  check(contents(a) == a_data, "original lost its rewrite");
+  check(contents(b) == b_data, "rewrite of original changed the clone");
+
+  printf ("test4: block-level writes and appends leave the other copy\n");
+  uint32_t c = im->clone_inode(b);
+  std::list<blockid_t> b_ids, c_ids;
+  im->get_block_ids(b, b_ids);
+  check(!im->write_block(b_ids.front(), patch.data()), "shared block written in place");
+  check(contents(c) == b_data, "write_block changed a clone");
+  blockid_t bid;
+  im->append_block(c, bid);
+  im->get_block_ids(c, c_ids);
+  b_ids.clear();
+  im->get_block_ids(b, b_ids);
+  check(c_ids.size() == b_ids.size() + 1 && c_ids.back() == bid, "append lost");
+  check(im->write_block(bid, patch.data()), "appended block not writable");
+  check(contents(b) == b_data, "append to clone changed the original");
+
+  printf ("test5: free all copies, every block comes back\n");
+  im->remove_file(a);
+  im->remove_file(c);
+  check(contents(b) == b_data, "removing clones changed the last copy");
+  im->remove_file(b);
+  check(free_blocks() == free0, "blocks leaked");
+
+  printf ("%s: passed all tests successfully\n", argv[0]);
+}
@@ -0,0 +1,447 @@
+// extendible-hashing directory format
+
+#include "dir_index.h"
+#include <set>
+#include <stdio.h>
+#include <string.h>
+
+#define DIR_MAGIC 0x52494459 // "YDIR"
+#define DIR_HEADER_SIZE 20
+#define DIR_BUCKET_SIZE 4096
+#define DIR_BUCKET_HEADER 8
+// inum, hash and name length
+#define DIR_ENTRY_HEADER 14
+// the table may grow to 1 << DIR_MAX_DEPTH slots
+#define DIR_MAX_DEPTH 16
+
+static void
+put32(std::string &s, uint32_t v)
+{
+  s.append((const char *)&v, sizeof(v));
+}
+
+static uint32_t
+get32(const std::string &s, size_t off)
+{
+  uint32_t v;
+  memcpy(&v, s.data() + off, sizeof(v));
+  return v;
+}
+
+// FNV-1a with a final mix, since the low bits pick the bucket
+static uint32_t
+name_hash(const std::string &s)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < s.size(); i++)
+  {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+extent_protocol::status
+string_dir_io::read(uint32_t off, uint32_t size, std::string &buf)
+{
+  if (off >= data.size())
+    buf = "";
+  else
+    buf = data.substr(off, size);
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+string_dir_io::write(uint32_t off, const std::string &buf)
+{
+  if (data.size() < off + buf.size())
+    data.resize(off + buf.size(), '\0');
+  data.replace(off, buf.size(), buf);
+  return extent_protocol::OK;
+}
+
+dir_index::dir_index(dir_io *_io) : io(_io)
+{
+}
+
+extent_protocol::status
+dir_index::read_header(header &h, bool &empty)
+{
+  extent_protocol::status ret;
+  std::string buf;
+
+  if ((ret = io->read(0, DIR_HEADER_SIZE, buf)) != extent_protocol::OK)
+    return ret;
+  empty = buf.empty();
+  if (empty)
+    return extent_protocol::OK;
+  if (buf.size() < DIR_HEADER_SIZE || get32(buf, 0) != DIR_MAGIC)
+  {
+    printf("dir_index: bad directory header\n");
+    return extent_protocol::IOERR;
+  }
+  h.depth = get32(buf, 4);
+  h.table_off = get32(buf, 8);
+  h.end = get32(buf, 12);
+  h.count = get32(buf, 16);
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+dir_index::write_header(const header &h)
+{
+  std::string buf;
+  put32(buf, DIR_MAGIC);
+  put32(buf, h.depth);
+  put32(buf, h.table_off);
+  put32(buf, h.end);
+  put32(buf, h.count);
+  return io->write(0, buf);
+}
+
+extent_protocol::status
+dir_index::read_table(const header &h, std::vector<uint32_t> &table)
+{
+  extent_protocol::status ret;
+  std::string buf;
+  uint32_t n = 1u << h.depth;
+
+  if ((ret = io->read(h.table_off, n * 4, buf)) != extent_protocol::OK)
+    return ret;
+  if (buf.size() != n * 4)
+    return extent_protocol::IOERR;
+  table.resize(n);
+  memcpy(&table[0], buf.data(), n * 4);
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+dir_index::write_table(const header &h, const std::vector<uint32_t> &table)
+{
+  return io->write(h.table_off,
+                   std::string((const char *)&table[0], table.size() * 4));
+}
+
+extent_protocol::status
+dir_index::read_bucket(uint32_t off, bucket &b)
+{
+  extent_protocol::status ret;
+  std::string buf;
+
+  if ((ret = io->read(off, DIR_BUCKET_SIZE, buf)) != extent_protocol::OK)
+    return ret;
+  if (buf.size() != DIR_BUCKET_SIZE)
+    return extent_protocol::IOERR;
+
+  b.off = off;
+  b.depth = get32(buf, 0);
+  uint32_t n = get32(buf, 4);
+  b.records.resize(n);
+  size_t pos = DIR_BUCKET_HEADER;
+  for (uint32_t i = 0; i < n; i++)
+  {
+    record &r = b.records[i];
+    uint16_t len;
+    if (pos + DIR_ENTRY_HEADER > buf.size())
+      return extent_protocol::IOERR;
+    memcpy(&r.e.inum, buf.data() + pos, 8);
+    r.hash = get32(buf, pos + 8);
+    memcpy(&len, buf.data() + pos + 12, 2);
+    pos += DIR_ENTRY_HEADER;
+    if (pos + len > buf.size())
+      return extent_protocol::IOERR;
+    r.e.name.assign(buf, pos, len);
+    pos += len;
+  }
+  b.bytes = pos;
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+dir_index::write_bucket(const bucket &b)
+{
+  std::string buf;
+  buf.reserve(DIR_BUCKET_SIZE);
+  put32(buf, b.depth);
+  put32(buf, b.records.size());
+  for (size_t i = 0; i < b.records.size(); i++)
+  {
+    const record &r = b.records[i];
+    uint16_t len = r.e.name.size();
+    buf.append((const char *)&r.e.inum, 8);
+    put32(buf, r.hash);
+    buf.append((const char *)&len, 2);
+    buf.append(r.e.name);
+  }
+  buf.resize(DIR_BUCKET_SIZE, '\0');
+  return io->write(b.off, buf);
+}
+
+extent_protocol::status
+dir_index::find_bucket(const header &h, uint32_t hash, bucket &b)
+{
+  extent_protocol::status ret;
+  std::string buf;
+  uint32_t slot = hash & ((1u << h.depth) - 1);
+
+  if ((ret = io->read(h.table_off + slot * 4, 4, buf)) != extent_protocol::OK)
+    return ret;
+  if (buf.size() != 4)
+    return extent_protocol::IOERR;
+  return read_bucket(get32(buf, 0), b);
+}
+
+// Lay out an empty table: the header page with a one-slot table,
+// followed by a single empty bucket.
+extent_protocol::status
+dir_index::init(header &h)
+{
+  extent_protocol::status ret;
+  bucket b;
+
+  h.depth = 0;
+  h.table_off = DIR_HEADER_SIZE;
+  h.end = 2 * DIR_BUCKET_SIZE;
+  h.count = 0;
+  b.off = DIR_BUCKET_SIZE;
+  b.depth = 0;
+
+  std::vector<uint32_t> table(1, b.off);
+  if ((ret = write_bucket(b)) != extent_protocol::OK ||
+      (ret = write_table(h, table)) != extent_protocol::OK)
+    return ret;
+  return write_header(h);
+}
+
+// Split the full bucket b in two on its next hash bit, doubling the
+// table first if b is already as deep as the table.
+extent_protocol::status
+dir_index::split(header &h, bucket &b)
+{
+  extent_protocol::status ret;
+  std::vector<uint32_t> table;
+
+  if ((ret = read_table(h, table)) != extent_protocol::OK)
+    return ret;
+
+  if (b.depth == h.depth)
+  {
+    if (h.depth == DIR_MAX_DEPTH)
+    {
+      printf("dir_index: directory is full\n");
+      return extent_protocol::IOERR;
+    }
+    table.insert(table.end(), table.begin(), table.end());
+    h.depth++;
+    // the old table space is not reused; it is at most as large
+    // as the new one
+    if (h.table_off != DIR_HEADER_SIZE ||
+        DIR_HEADER_SIZE + table.size() * 4 > DIR_BUCKET_SIZE)
+    {
+      h.table_off = h.end;
+      h.end += (table.size() * 4 + DIR_BUCKET_SIZE - 1) /
+               DIR_BUCKET_SIZE * DIR_BUCKET_SIZE;
+    }
+  }
+
+  bucket nb;
+  uint32_t bit = 1u << b.depth;
+  nb.off = h.end;
+  h.end += DIR_BUCKET_SIZE;
+  b.depth++;
+  nb.depth = b.depth;
+
+  std::vector<record> keep;
+  for (size_t i = 0; i < b.records.size(); i++)
+  {
+    if (b.records[i].hash & bit)
+      nb.records.push_back(b.records[i]);
+    else
+      keep.push_back(b.records[i]);
+  }
+  b.records.swap(keep);
+
+  for (uint32_t slot = 0; slot < table.size(); slot++)
+  {
+    if (table[slot] == b.off && (slot & bit))
+      table[slot] = nb.off;
+  }
+
+  if ((ret = write_bucket(nb)) != extent_protocol::OK ||
+      (ret = write_bucket(b)) != extent_protocol::OK ||
+      (ret = write_table(h, table)) != extent_protocol::OK)
+    return ret;
+  return write_header(h);
+}
+
+extent_protocol::status
+dir_index::lookup(const std::string &name, bool &found,
+                  unsigned long long &inum)
+{
+  extent_protocol::status ret;
+  header h;
+  bool empty;
+  bucket b;
+
+  found = false;
+  if ((ret = read_header(h, empty)) != extent_protocol::OK || empty)
+    return ret;
+
+  uint32_t hash = name_hash(name);
+  if ((ret = find_bucket(h, hash, b)) != extent_protocol::OK)
+    return ret;
+  for (size_t i = 0; i < b.records.size(); i++)
+  {
+    if (b.records[i].hash == hash && b.records[i].e.name == name)
+    {
+      found = true;
+      inum = b.records[i].e.inum;
+      break;
+    }
+  }
+  return extent_protocol::OK;
+}
+
+extent_protocol::status
+dir_index::insert(const std::string &name, unsigned long long inum)
+{
+  extent_protocol::status ret;
+  header h;
+  bool empty;
+  uint32_t hash = name_hash(name);
+  uint32_t need = DIR_ENTRY_HEADER + name.size();
+
+  if (DIR_BUCKET_HEADER + need > DIR_BUCKET_SIZE)
+  {
+    printf("dir_index: name too long\n");
+    return extent_protocol::IOERR;
+  }
+
+  if ((ret = read_header(h, empty)) != extent_protocol::OK)
+    return ret;
+  if (empty && (ret = init(h)) != extent_protocol::OK)
+    return ret;
+
+  for (;;)
+  {
+    bucket b;
+    if ((ret = find_bucket(h, hash, b)) != extent_protocol::OK)
+      return ret;
+    for (size_t i = 0; i < b.records.size(); i++)
+    {
+      if (b.records[i].hash == hash && b.records[i].e.name == name)
+        return extent_protocol::EXIST;
+    }
+
+    if (b.bytes + need <= DIR_BUCKET_SIZE)
+    {
+      record r;
+      r.hash = hash;
+      r.e.name = name;
+      r.e.inum = inum;
+      b.records.push_back(r);
+      if ((ret = write_bucket(b)) != extent_protocol::OK)
+        return ret;
+      h.count++;
+      return write_header(h);
+    }
+
+    if ((ret = split(h, b)) != extent_protocol::OK)
+      return ret;
+  }
+}
+
+extent_protocol::status
+dir_index::remove(const std::string &name, unsigned long long &inum)
+{
+  extent_protocol::status ret;
+  header h;
+  bool empty;
+  bucket b;
+
+  if ((ret = read_header(h, empty)) != extent_protocol::OK)
+    return ret;
+  if (empty)
+    return extent_protocol::NOENT;
+
+  uint32_t hash = name_hash(name);
+  if ((ret = find_bucket(h, hash, b)) != extent_protocol::OK)
+    return ret;
+  for (size_t i = 0; i < b.records.size(); i++)
+  {
+    if (b.records[i].hash == hash && b.records[i].e.name == name)
+    {
+      inum = b.records[i].e.inum;
+      b.records.erase(b.records.begin() + i);
+      if ((ret = write_bucket(b)) != extent_protocol::OK)
+        return ret;
+      h.count--;
+      return write_header(h);
+    }
+  }
+  return extent_protocol::NOENT;
+}
+
+// The entry keeps its name, and so its hash and size: only its
+// bucket is rewritten.
+extent_protocol::status
+dir_index::replace(const std::string &name, unsigned long long inum,
+                   unsigned long long &old)
+{
+  extent_protocol::status ret;
+  header h;
+  bool empty;
+  bucket b;
+
+  if ((ret = read_header(h, empty)) != extent_protocol::OK)
+    return ret;
+  if (empty)
+    return extent_protocol::NOENT;
+
+  uint32_t hash = name_hash(name);
+  if ((ret = find_bucket(h, hash, b)) != extent_protocol::OK)
+    return ret;
+  for (size_t i = 0; i < b.records.size(); i++)
+  {
+    if (b.records[i].hash == hash && b.records[i].e.name == name)
+    {
+      old = b.records[i].e.inum;
+      b.records[i].e.inum = inum;
+      return write_bucket(b);
+    }
+  }
+  return extent_protocol::NOENT;
+}
+
+extent_protocol::status
+dir_index::list(std::list<entry> &entries)
+{
+  extent_protocol::status ret;
+  header h;
+  bool empty;
+  std::vector<uint32_t> table;
+  std::set<uint32_t> seen;
+
+  entries.clear();
+  if ((ret = read_header(h, empty)) != extent_protocol::OK || empty)
+    return ret;
+  if ((ret = read_table(h, table)) != extent_protocol::OK)
+    return ret;
+
+  for (size_t slot = 0; slot < table.size(); slot++)
+  {
+    if (!seen.insert(table[slot]).second)
+      continue;
+    bucket b;
+    if ((ret = read_bucket(table[slot], b)) != extent_protocol::OK)
+      return ret;
+    for (size_t i = 0; i < b.records.size(); i++)
+      entries.push_back(b.records[i].e);
+  }
+  return extent_protocol::OK;
+}
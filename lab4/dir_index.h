@@ -0,0 +1,99 @@
+// directory format, shared by yfs_client and extent_server
+
+#ifndef dir_index_h
+#define dir_index_h
+
+#include <string>
+#include <list>
+#include <vector>
+#include "extent_protocol.h"
+
+// Byte-level access to one directory extent.
+class dir_io {
+ public:
+  virtual ~dir_io() {}
+  // read at most size bytes at off; fewer at the end of the extent
+  virtual extent_protocol::status read(uint32_t off, uint32_t size,
+                                       std::string &buf) = 0;
+  virtual extent_protocol::status write(uint32_t off,
+                                        const std::string &buf) = 0;
+};
+
+// A directory held in memory, e.g. a whole extent from get().
+class string_dir_io : public dir_io {
+ public:
+  std::string data;
+
+  string_dir_io() {}
+  string_dir_io(const std::string &d) : data(d) {}
+  extent_protocol::status read(uint32_t off, uint32_t size, std::string &buf);
+  extent_protocol::status write(uint32_t off, const std::string &buf);
+};
+
+// A directory is an extendible hash table. The extent starts with a
+// header page holding the global depth and, while it is small, the
+// bucket table; a larger table moves to the end of the extent. Each
+// bucket is one DIR_BUCKET_SIZE page of length-prefixed entries,
+// found by the low depth bits of the name's hash. A lookup therefore
+// reads the header, one table slot and one bucket, and an insert or
+// remove rewrites only its bucket and the header, whatever the size
+// of the directory. Buckets are split when full and never merged.
+// An empty extent is an empty directory.
+class dir_index {
+ public:
+  struct entry {
+    std::string name;
+    unsigned long long inum;
+  };
+
+  dir_index(dir_io *io);
+
+  extent_protocol::status lookup(const std::string &name, bool &found,
+                                 unsigned long long &inum);
+  // EXIST if name is already there
+  extent_protocol::status insert(const std::string &name,
+                                 unsigned long long inum);
+  // NOENT if name is not there
+  extent_protocol::status remove(const std::string &name,
+                                 unsigned long long &inum);
+  // point name at inum instead of old; NOENT if name is not there
+  extent_protocol::status replace(const std::string &name,
+                                  unsigned long long inum,
+                                  unsigned long long &old);
+  extent_protocol::status list(std::list<entry> &entries);
+
+ private:
+  struct header {
+    uint32_t depth;
+    uint32_t table_off;
+    uint32_t end;
+    uint32_t count;
+  };
+  struct record {
+    uint32_t hash;
+    entry e;
+  };
+  struct bucket {
+    uint32_t off;
+    uint32_t depth;
+    uint32_t bytes;
+    std::vector<record> records;
+  };
+
+  dir_io *io;
+
+  extent_protocol::status read_header(header &h, bool &empty);
+  extent_protocol::status write_header(const header &h);
+  extent_protocol::status read_table(const header &h,
+                                     std::vector<uint32_t> &table);
+  extent_protocol::status write_table(const header &h,
+                                      const std::vector<uint32_t> &table);
+  extent_protocol::status find_bucket(const header &h, uint32_t hash,
+                                      bucket &b);
+  extent_protocol::status read_bucket(uint32_t off, bucket &b);
+  extent_protocol::status write_bucket(const bucket &b);
+  extent_protocol::status init(header &h);
+  extent_protocol::status split(header &h, bucket &b);
+};
+
+#endif
@@ -0,0 +1,169 @@
+//
+// Directory index tester
+//
+
+#include "dir_index.h"
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// names this long fill a bucket with about 19 entries, so a few
+// thousand of them split buckets and double the table many times
+#define NAME_LEN 200
+const int n = 20000;
+
+string_dir_io io;
+dir_index idx(&io);
+std::map<std::string, unsigned long long> model;
+
+std::string
+name_of(int i)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "f%d-", i);
+  std::string name(buf);
+  name.resize(NAME_LEN, 'a' + i % 26);
+  return name;
+}
+
+// the global depth, from the directory header
+uint32_t
+depth(void)
+{
+  uint32_t d;
+  if (io.data.size() < 8)
+    return 0;
+  memcpy(&d, io.data.data() + 4, sizeof(d));
+  return d;
+}
+
+void
+fail(const char *what, const std::string &name)
+{
+  fprintf(stderr, "error: %s %.20s...\n", what, name.c_str());
+  fprintf(stdout, "error: %s %.20s...\n", what, name.c_str());
+  exit(1);
+}
+
+// check that every name of the model is found with its inum, and
+// that list returns the model and nothing else
+void
+check_all(dir_index &d)
+{
+  std::map<std::string, unsigned long long>::iterator it;
+  for (it = model.begin(); it != model.end(); it++) {
+    bool found = false;
+    unsigned long long inum = 0;
+    if (d.lookup(it->first, found, inum) != extent_protocol::OK)
+      fail("lookup failed for", it->first);
+    if (!found || inum != it->second)
+      fail("lookup lost", it->first);
+  }
+
+  std::list<dir_index::entry> entries;
+  if (d.list(entries) != extent_protocol::OK)
+    fail("list failed", "");
+  if (entries.size() != model.size()) {
+    fprintf(stderr, "error: list has %lu entries, not %lu\n",
+            (unsigned long)entries.size(), (unsigned long)model.size());
+    exit(1);
+  }
+  std::list<dir_index::entry>::iterator e;
+  for (e = entries.begin(); e != entries.end(); e++) {
+    it = model.find(e->name);
+    if (it == model.end() || it->second != e->inum)
+      fail("list has", e->name);
+  }
+}
+
+void
+test1(void)
+{
+  printf ("test1: insert %d names, look each up as the table grows\n", n);
+  uint32_t last = 0;
+  for (int i = 0; i < n; i++) {
+    std::string name = name_of(i);
+    if (idx.insert(name, 1000 + i) != extent_protocol::OK)
+      fail("insert failed for", name);
+    model[name] = 1000 + i;
+    if (depth() != last) {
+      // everything inserted so far survives each doubling
+      last = depth();
+      printf ("test1: depth %u after %d names\n", last, i + 1);
+      check_all(idx);
+    }
+  }
+  // the table left the header page at depth 10, and moved on since
+  if (depth() < 11) {
+    fprintf(stderr, "error: only reached depth %u\n", depth());
+    exit(1);
+  }
+  check_all(idx);
+
+  bool found = true;
+  unsigned long long inum;
+  if (idx.lookup("no-such-name", found, inum) != extent_protocol::OK || found)
+    fail("lookup found", "no-such-name");
+}
+
+void
+test2(void)
+{
+  printf ("test2: insert names already there\n");
+  for (int i = 0; i < n; i += 97) {
+    std::string name = name_of(i);
+    if (idx.insert(name, 7) != extent_protocol::EXIST)
+      fail("duplicate insert not EXIST for", name);
+  }
+  check_all(idx);
+}
+
+void
+test3(void)
+{
+  printf ("test3: remove every third name, then remove it again\n");
+  for (int i = 0; i < n; i += 3) {
+    std::string name = name_of(i);
+    unsigned long long inum = 0;
+    if (idx.remove(name, inum) != extent_protocol::OK || inum != model[name])
+      fail("remove failed for", name);
+    model.erase(name);
+    if (idx.remove(name, inum) != extent_protocol::NOENT)
+      fail("second remove not NOENT for", name);
+  }
+  check_all(idx);
+
+  printf ("test3: insert the removed names back with new inums\n");
+  for (int i = 0; i < n; i += 3) {
+    std::string name = name_of(i);
+    if (idx.insert(name, 5000000 + i) != extent_protocol::OK)
+      fail("insert after remove failed for", name);
+    model[name] = 5000000 + i;
+  }
+  check_all(idx);
+}
+
+void
+test4(void)
+{
+  printf ("test4: read the grown directory from a copy\n");
+  // as a client does with the whole extent from get()
+  string_dir_io copy(io.data);
+  dir_index d(&copy);
+  check_all(d);
+}
+
+int
+main(int argc, char *argv[])
+{
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  test1();
+  test2();
+  test3();
+  test4();
+
+  printf ("%s: passed all tests successfully\n", argv[0]);
+}
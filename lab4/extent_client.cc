@@ -1,39 +1,521 @@
 // RPC stubs for clients to talk to extent_server
 
 #include "extent_client.h"
+#include "op_stats.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <string.h>
+#include <algorithm>
 
-extent_client::extent_client(std::string dst)
+// once this much is buffered, write back the largest dirty extents
+// until no more than DIRTY_TARGET is
+#define DIRTY_LIMIT (8 * 1024 * 1024)
+#define DIRTY_TARGET (DIRTY_LIMIT / 2)
+
+// ranged reads are cached in chunks of this size
+#define READ_CHUNK (64 * 1024)
+// at most this many chunks are kept or in flight per extent
+#define MAX_CHUNKS 128
+// threads that fetch chunks ahead of the reader
+#define READAHEAD_THREADS 4
+
+#define SHARD_SHIFT 32
+#define BLOCK_SHARD_SHIFT 24
+#define BLOCK_MASK ((1u << BLOCK_SHARD_SHIFT) - 1)
+// points each server gets on the placement ring
+#define RING_VNODES 64
+
+// FNV-1a, with a final mix so that keys differing only in their
+// last characters still land far apart on the ring
+static uint32_t
+ring_hash(const std::string &s)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < s.size(); i++)
+  {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+extent_client::extent_client(std::string dst, extent_lock_user *_lu)
+    : next_key(0), lu(_lu), flush_gen(0), dirty_bytes(0), next_token(0)
+{
+  std::stringstream ss(dst);
+  std::string addr;
+  while (getline(ss, addr, ','))
+  {
+    if (addr.empty())
+      continue;
+    sockaddr_in dstsock;
+    make_sockaddr(addr.c_str(), &dstsock);
+    rpcc *cl = new rpcc(dstsock);
+    if (cl->bind() != 0)
+    {
+      printf("extent_client: bind %s failed\n", addr.c_str());
+    }
+    for (int i = 0; i < RING_VNODES; i++)
+    {
+      std::ostringstream vnode;
+      vnode << addr << "#" << i;
+      ring[ring_hash(vnode.str())] = shards.size();
+    }
+    shards.push_back(cl);
+  }
+  VERIFY(!shards.empty());
+  readahead_pool = new ThrPool(READAHEAD_THREADS);
+  pthread_mutex_init(&cache_mutex, NULL);
+  pthread_cond_init(&chunk_cond, NULL);
+  pthread_cond_init(&push_cond, NULL);
+}
+
+// The server of eid in cl; NOENT if its tag names no shard we know,
+// as an id from a damaged directory entry may.
+extent_protocol::status
+extent_client::route(extent_protocol::extentid_t eid, rpcc *&cl)
+{
+  unsigned int shard = eid >> SHARD_SHIFT;
+  if (shard >= shards.size())
+    return extent_protocol::NOENT;
+  cl = shards[shard];
+  return extent_protocol::OK;
+}
+
+// The server of block bid in cl; IOERR if its tag names no shard we
+// know, since block ids come from the servers themselves.
+extent_protocol::status
+extent_client::route_block(blockid_t bid, rpcc *&cl)
+{
+  unsigned int shard = bid >> BLOCK_SHARD_SHIFT;
+  if (shard >= shards.size())
+    return extent_protocol::IOERR;
+  cl = shards[shard];
+  return extent_protocol::OK;
+}
+
+// The shard that owns the first ring point at or after hash(key).
+unsigned int
+extent_client::place(const std::string &key)
+{
+  std::map<uint32_t, unsigned int>::iterator it = ring.lower_bound(ring_hash(key));
+  if (it == ring.end())
+    it = ring.begin();
+  return it->second;
+}
+
+// Correct a size from the server for data cached here.
+void
+extent_client::local_size(cached_extent &ce, extent_protocol::attr &a)
+{
+  if (ce.data_valid)
+    a.size = ce.data.size();
+  else if (!ce.writes.empty())
+  {
+    // a buffered write may extend the extent
+    std::map<uint32_t, std::string>::reverse_iterator last = ce.writes.rbegin();
+    if (last->first + last->second.size() > a.size)
+      a.size = last->first + last->second.size();
+  }
+}
+
+bool
+extent_client::cacheable(extent_protocol::extentid_t eid)
+{
+  return lu != NULL && lu->is_cached(eid);
+}
+
+// Whether eid may not be written: its lock is ours only under a
+// lease that has run out, so another client may hold it by now. The
+// cached state of eid is then dropped instead of written back.
+bool
+extent_client::fenced(extent_protocol::extentid_t eid)
 {
-  sockaddr_in dstsock;
-  make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
-  if (cl->bind() != 0)
+  if (lu == NULL || !lu->lapsed(eid))
+    return false;
+  printf("extent_client: lease on %llu has run out, not writing\n", eid);
+  return true;
+}
+
+// The token to send with writes to eid: that of the grant of its lock
+// if we hold it, 0 otherwise.
+extent_protocol::fence_t
+extent_client::fence_of(extent_protocol::extentid_t eid)
+{
+  return lu != NULL ? lu->fence(eid) : 0;
+}
+
+void
+extent_client::invalidate(extent_protocol::extentid_t eid)
+{
+  pthread_mutex_lock(&cache_mutex);
+  if (cache.count(eid))
+  {
+    clean(cache[eid]);
+    cache.erase(eid);
+  }
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+// Drop the cached content and attributes of eid, which the server
+// has changed under a lock we still hold, and cancel their fetches.
+// The entry itself stays. Its dirty state must have been written
+// back.
+void
+extent_client::forget(extent_protocol::extentid_t eid)
+{
+  pthread_mutex_lock(&cache_mutex);
+  if (cache.count(eid))
+  {
+    cached_extent &ce = cache[eid];
+    ce.data.clear();
+    ce.data_valid = false;
+    ce.attr_valid = false;
+    ce.chunks.clear();
+    if (!ce.inflight.empty())
+    {
+      ce.inflight.clear();
+      pthread_cond_broadcast(&chunk_cond);
+    }
+  }
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+// Forget the dirty state of ce. Called with cache_mutex held.
+void
+extent_client::clean(cached_extent &ce)
+{
+  dirty_bytes -= ce.dirty_bytes;
+  ce.dirty_bytes = 0;
+  ce.dirty = false;
+  ce.writes.clear();
+}
+
+// Forget the chunks overlapping [off, off+len) and cancel their
+// fetches. Called with cache_mutex held.
+void
+extent_client::drop_chunks(cached_extent &ce, uint32_t off, uint32_t len)
+{
+  uint32_t first = off / READ_CHUNK;
+  uint32_t last = len == 0 ? first : (off + len - 1) / READ_CHUNK;
+  if (ce.chunks.empty() && ce.inflight.empty())
+    return;
+  ce.chunks.erase(ce.chunks.lower_bound(first), ce.chunks.upper_bound(last));
+  ce.inflight.erase(ce.inflight.lower_bound(first), ce.inflight.upper_bound(last));
+  pthread_cond_broadcast(&chunk_cond);
+}
+
+// Apply a write to the cached chunks it overlaps and cancel the
+// fetches of those chunks. Called with cache_mutex held.
+void
+extent_client::patch_chunks(cached_extent &ce, uint32_t off, const std::string &buf)
+{
+  if (buf.empty() || (ce.chunks.empty() && ce.inflight.empty()))
+    return;
+  uint32_t first = off / READ_CHUNK, last = (off + buf.size() - 1) / READ_CHUNK;
+  std::map<uint32_t, chunk_t>::iterator it = ce.chunks.lower_bound(first);
+  for (; it != ce.chunks.end() && it->first <= last; it++)
   {
-    printf("extent_client: bind failed\n");
+    uint32_t base = it->first * READ_CHUNK;
+    uint32_t s = std::max(off, base);
+    uint32_t e = std::min((uint32_t)(off + buf.size()), base + READ_CHUNK);
+    // a reader still holds the old content
+    if (!it->second.unique())
+      it->second = std::make_shared<std::string>(*it->second);
+    std::string &chunk = *it->second;
+    if (chunk.size() < e - base)
+      chunk.resize(e - base, '\0');
+    chunk.replace(s - base, e - s, buf, s - off, e - s);
   }
+  ce.inflight.erase(ce.inflight.lower_bound(first), ce.inflight.upper_bound(last));
+  pthread_cond_broadcast(&chunk_cond);
+}
+
+// Record a write of buf at off, merging it with the ranges it
+// overlaps or touches. A write that continues a buffered range is
+// appended to it in place, so streaming writes are not copied over
+// and over. Called with cache_mutex held.
+void
+extent_client::buffer_write(cached_extent &ce, uint32_t off, const std::string &buf)
+{
+  uint32_t end = off + buf.size();
+  std::map<uint32_t, std::string>::iterator it = ce.writes.upper_bound(off), at;
+
+  if (it != ce.writes.begin() && (--it)->first + it->second.size() >= off)
+  {
+    at = it;
+    if (at->first + at->second.size() >= end)
+    {
+      // overwrites part of a buffered range
+      at->second.replace(off - at->first, buf.size(), buf);
+      return;
+    }
+    ce.dirty_bytes -= at->second.size();
+    dirty_bytes -= at->second.size();
+    at->second.resize(off - at->first);
+    at->second.append(buf);
+  }
+  else
+  {
+    at = ce.writes.insert(std::make_pair(off, buf)).first;
+  }
+
+  // swallow the ranges buf reaches into; the new data wins where
+  // they overlap
+  it = at;
+  for (it++; it != ce.writes.end() && it->first <= end; ce.writes.erase(it++))
+  {
+    uint32_t e = it->first + it->second.size();
+    if (e > end)
+      at->second.append(it->second, end - it->first, e - end);
+    ce.dirty_bytes -= it->second.size();
+    dirty_bytes -= it->second.size();
+  }
+
+  ce.dirty_bytes += at->second.size();
+  dirty_bytes += at->second.size();
+}
+
+// Send the dirty state taken out of the cache to the server.
+extent_protocol::status
+extent_client::push(extent_protocol::extentid_t eid, cached_extent &ce)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  rpcc *cl;
+
+  if (!ce.dirty && ce.writes.empty())
+    return ret;
+  if (fenced(eid))
+    return extent_protocol::IOERR;
+  if ((ret = route(eid, cl)) != extent_protocol::OK)
+    return ret;
+  if (ce.dirty)
+    return cl->call(extent_protocol::put, eid, ce.data, fence_of(eid), r);
+
+  extent_protocol::fence_t fence = fence_of(eid);
+  std::map<uint32_t, std::string>::iterator it;
+  for (it = ce.writes.begin(); it != ce.writes.end(); it++)
+  {
+    ret = cl->call(extent_protocol::write, eid, it->first, it->second, fence,
+                   r);
+    if (ret != extent_protocol::OK)
+      break;
+  }
+  return ret;
+}
+
+// Wait for the push of eid in flight, if any, and claim the next.
+// Called with cache_mutex held.
+void
+extent_client::start_push(extent_protocol::extentid_t eid)
+{
+  while (pushing.count(eid))
+    pthread_cond_wait(&push_cond, &cache_mutex);
+  pushing.insert(eid);
+}
+
+void
+extent_client::end_push(extent_protocol::extentid_t eid)
+{
+  pthread_mutex_lock(&cache_mutex);
+  pushing.erase(eid);
+  pthread_cond_broadcast(&push_cond);
+  pthread_cond_broadcast(&chunk_cond);
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+// Write back the extents holding the most dirty bytes until no more
+// than DIRTY_TARGET are left, whichever extent the caller is writing
+// to. Their locks need not be held here: a revoke of one of them
+// waits in flush() for the push to finish. Only a failure to write
+// eid itself is returned; the others' cannot be reported to anyone.
+extent_protocol::status
+extent_client::relieve(extent_protocol::extentid_t eid)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  std::vector<std::pair<size_t, extent_protocol::extentid_t> > dirty;
+
+  pthread_mutex_lock(&cache_mutex);
+  std::map<extent_protocol::extentid_t, cached_extent>::iterator it;
+  for (it = cache.begin(); it != cache.end(); it++)
+  {
+    if (it->second.dirty_bytes > 0)
+      dirty.push_back(std::make_pair(it->second.dirty_bytes, it->first));
+  }
+  size_t left = dirty_bytes;
+  pthread_mutex_unlock(&cache_mutex);
+
+  std::sort(dirty.rbegin(), dirty.rend());
+  for (size_t i = 0; i < dirty.size() && left > DIRTY_TARGET; i++)
+  {
+    left -= std::min(left, dirty[i].first);
+    extent_protocol::status r = writeback(dirty[i].second);
+    if (r != extent_protocol::OK)
+    {
+      printf("extent_client: writeback of %llu failed\n", dirty[i].second);
+      if (dirty[i].second == eid)
+        ret = r;
+    }
+  }
+  return ret;
 }
 
 // a demo to show how to use RPC
 extent_protocol::status
-extent_client::create(uint32_t type, extent_protocol::extentid_t &id)
+extent_client::create(uint32_t type, extent_protocol::extentid_t &id,
+                      const std::string &key)
 {
+  op_stats::scope s(op_stats::EXTENT);
   extent_protocol::status ret = extent_protocol::OK;
+  unsigned int shard = 0;
   // Your lab2 part1 code goes here
-  ret = cl->call(extent_protocol::create, type, id);
+  if (shards.size() > 1)
+  {
+    if (key.empty())
+    {
+      // spread anonymous extents over the ring
+      std::ostringstream anon;
+      pthread_mutex_lock(&cache_mutex);
+      anon << shards[0]->id() << ":" << next_key++;
+      pthread_mutex_unlock(&cache_mutex);
+      shard = place(anon.str());
+    }
+    else
+    {
+      shard = place(key);
+    }
+  }
+  ret = shards[shard]->call(extent_protocol::create, type, id);
+  if (ret == extent_protocol::OK)
+    id |= (extent_protocol::extentid_t)shard << SHARD_SHIFT;
+  return ret;
+}
+
+extent_protocol::status
+extent_client::create_in_dir(extent_protocol::extentid_t parent,
+                             const std::string &name, uint32_t type,
+                             const std::string &data,
+                             extent_protocol::extentid_t &eid,
+                             extent_protocol::attr &a)
+{
+  op_stats::scope s(op_stats::EXTENT);
+  extent_protocol::status ret = extent_protocol::OK;
+  extent_protocol::create_result res;
+  rpcc *cl;
+  if (fenced(parent))
+    return extent_protocol::IOERR;
+  if ((ret = route(parent, cl)) != extent_protocol::OK)
+    return ret;
+  // the server edits the directory itself, so it must see our writes,
+  // and the old content and attributes must go; the lock stays cached
+  if ((ret = writeback(parent)) != extent_protocol::OK)
+    return ret;
+  ret = cl->call(extent_protocol::create_in_dir, parent, name, type, data,
+                 fence_of(parent), res);
+  forget(parent);
+  if (ret == extent_protocol::OK)
+  {
+    eid = res.id;
+    a = res.a;
+  }
   return ret;
 }
 
+extent_protocol::status
+extent_client::rename(extent_protocol::extentid_t src_dir,
+                      const std::string &src_name,
+                      extent_protocol::extentid_t dst_dir,
+                      const std::string &dst_name,
+                      bool replace,
+                      extent_protocol::extentid_t &eid,
+                      extent_protocol::extentid_t &replaced)
+{
+  op_stats::scope s(op_stats::EXTENT);
+  extent_protocol::status ret = extent_protocol::OK;
+  rpcc *cl;
+  VERIFY(same_shard(src_dir, dst_dir));
+  if (fenced(src_dir) || fenced(dst_dir))
+    return extent_protocol::IOERR;
+  if ((ret = route(src_dir, cl)) != extent_protocol::OK)
+    return ret;
+  if ((ret = flush(src_dir)) != extent_protocol::OK ||
+      (ret = flush(dst_dir)) != extent_protocol::OK)
+    return ret;
+  extent_protocol::rename_result res;
+  ret = cl->call(extent_protocol::rename, src_dir, src_name, dst_dir,
+                 dst_name, (int)replace, fence_of(src_dir), fence_of(dst_dir),
+                 res);
+  if (ret == extent_protocol::OK)
+  {
+    eid = res.id;
+    replaced = res.replaced;
+  }
+  return ret;
+}
+
+bool
+extent_client::same_shard(extent_protocol::extentid_t a, extent_protocol::extentid_t b)
+{
+  return (a >> SHARD_SHIFT) == (b >> SHARD_SHIFT);
+}
+
+bool
+extent_client::colocated(extent_protocol::extentid_t eid, const std::string &key)
+{
+  return shards.size() == 1 || place(key) == (eid >> SHARD_SHIFT);
+}
+
 extent_protocol::status
 extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
 {
+  op_stats::scope s(op_stats::EXTENT);
   extent_protocol::status ret = extent_protocol::OK;
-  // Your lab2 part1 code goes here
+  bool cached = cacheable(eid);
+  unsigned int gen;
+
+  pthread_mutex_lock(&cache_mutex);
+  if (cached && cache.count(eid) && cache[eid].data_valid)
+  {
+    buf = cache[eid].data;
+    pthread_mutex_unlock(&cache_mutex);
+    return ret;
+  }
+  gen = flush_gen;
+  pthread_mutex_unlock(&cache_mutex);
+
+  rpcc *cl;
+  if ((ret = route(eid, cl)) != extent_protocol::OK)
+    return ret;
   ret = cl->call(extent_protocol::get, eid, buf);
+
+  // a flush in the meantime may mean we no longer own the extent
+  pthread_mutex_lock(&cache_mutex);
+  if (ret == extent_protocol::OK && cached && gen == flush_gen)
+  {
+    cached_extent &ce = cache[eid];
+    // the server has not seen the buffered writes yet
+    std::map<uint32_t, std::string>::iterator it;
+    for (it = ce.writes.begin(); it != ce.writes.end(); it++)
+    {
+      if (buf.size() < it->first)
+        buf.resize(it->first, '\0');
+      buf.replace(it->first, it->second.size(), it->second);
+    }
+    ce.data = buf;
+    ce.data_valid = true;
+    ce.attr.size = buf.size();
+    ce.chunks.clear();
+  }
+  pthread_mutex_unlock(&cache_mutex);
   return ret;
 }
 
@@ -41,70 +523,625 @@ extent_protocol::status
 extent_client::getattr(extent_protocol::extentid_t eid,
                        extent_protocol::attr &attr)
 {
+  op_stats::scope s(op_stats::EXTENT);
   extent_protocol::status ret = extent_protocol::OK;
+  bool cached = cacheable(eid);
+  unsigned int gen;
+
+  pthread_mutex_lock(&cache_mutex);
+  if (cached && cache.count(eid) && cache[eid].attr_valid)
+  {
+    attr = cache[eid].attr;
+    pthread_mutex_unlock(&cache_mutex);
+    return ret;
+  }
+  gen = flush_gen;
+  pthread_mutex_unlock(&cache_mutex);
+
+  rpcc *cl;
+  if ((ret = route(eid, cl)) != extent_protocol::OK)
+    return ret;
   ret = cl->call(extent_protocol::getattr, eid, attr);
+
+  pthread_mutex_lock(&cache_mutex);
+  if (ret == extent_protocol::OK && cached && gen == flush_gen)
+  {
+    cached_extent &ce = cache[eid];
+    local_size(ce, attr);
+    ce.attr = attr;
+    ce.attr_valid = true;
+  }
+  pthread_mutex_unlock(&cache_mutex);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::getattr_multi(const std::vector<extent_protocol::extentid_t> &eids,
+                             std::vector<extent_protocol::attr> &attrs)
+{
+  op_stats::scope s(op_stats::EXTENT);
+  extent_protocol::status ret = extent_protocol::OK;
+  std::map<unsigned int, std::vector<extent_protocol::extentid_t> > ids;
+  std::map<unsigned int, std::vector<size_t> > pos;
+  std::map<unsigned int, rpc_future<std::vector<extent_protocol::attr> > > replies;
+  unsigned int gen;
+
+  extent_protocol::attr none;
+  memset(&none, 0, sizeof(none));
+  attrs.assign(eids.size(), none);
+
+  pthread_mutex_lock(&cache_mutex);
+  for (size_t i = 0; i < eids.size(); i++)
+  {
+    if (cacheable(eids[i]) && cache.count(eids[i]) && cache[eids[i]].attr_valid)
+    {
+      attrs[i] = cache[eids[i]].attr;
+      continue;
+    }
+    // an id that names no shard names no extent
+    unsigned int shard = eids[i] >> SHARD_SHIFT;
+    if (shard >= shards.size())
+      continue;
+    ids[shard].push_back(eids[i]);
+    pos[shard].push_back(i);
+  }
+  gen = flush_gen;
+  pthread_mutex_unlock(&cache_mutex);
+
+  // the shards are asked in parallel
+  std::map<unsigned int, std::vector<extent_protocol::extentid_t> >::iterator it;
+  for (it = ids.begin(); it != ids.end(); it++)
+    replies[it->first] = shards[it->first]->async_call<std::vector<extent_protocol::attr> >(
+        extent_protocol::getattr_multi, it->second);
+
+  for (it = ids.begin(); it != ids.end(); it++)
+  {
+    std::vector<extent_protocol::attr> reply;
+    int r = replies[it->first].wait(reply);
+    if (r == extent_protocol::OK && reply.size() != it->second.size())
+      r = extent_protocol::IOERR;
+    if (r != extent_protocol::OK)
+    {
+      ret = r;
+      continue;
+    }
+    std::vector<size_t> &p = pos[it->first];
+    for (size_t i = 0; i < p.size(); i++)
+      attrs[p[i]] = reply[i];
+  }
+  if (ret != extent_protocol::OK)
+    return ret;
+
+  // our own buffered writes are newer than what the servers have
+  pthread_mutex_lock(&cache_mutex);
+  if (gen == flush_gen)
+  {
+    for (size_t i = 0; i < eids.size(); i++)
+    {
+      if (attrs[i].type != 0 && cacheable(eids[i]) && cache.count(eids[i]))
+        local_size(cache[eids[i]], attrs[i]);
+    }
+  }
+  pthread_mutex_unlock(&cache_mutex);
   return ret;
 }
 
 extent_protocol::status
 extent_client::put(extent_protocol::extentid_t eid, std::string buf)
 {
+  op_stats::scope s(op_stats::EXTENT);
   extent_protocol::status ret = extent_protocol::OK;
-  // Your lab2 part1 code goes here
   int i;
-  ret = cl->call(extent_protocol::put, eid, buf, i);
+
+  if (fenced(eid))
+    return extent_protocol::IOERR;
+  if (!cacheable(eid))
+  {
+    // not protected by a lock we own, write through
+    invalidate(eid);
+    rpcc *cl;
+    if ((ret = route(eid, cl)) != extent_protocol::OK)
+      return ret;
+    ret = cl->call(extent_protocol::put, eid, buf, fence_of(eid), i);
+    return ret;
+  }
+
+  // the type is only known to the server; fetch it once so that
+  // later getattr calls can be answered locally
+  extent_protocol::attr a;
+  if ((ret = getattr(eid, a)) != extent_protocol::OK)
+    return ret;
+
+  pthread_mutex_lock(&cache_mutex);
+  cached_extent &ce = cache[eid];
+  // the new content supersedes any buffered writes
+  clean(ce);
+  drop_chunks(ce, 0, std::max((size_t)ce.attr.size, buf.size()));
+  ce.data = buf;
+  ce.data_valid = true;
+  ce.dirty = true;
+  ce.dirty_bytes = buf.size();
+  dirty_bytes += buf.size();
+  ce.attr.size = buf.size();
+  ce.attr.mtime = ce.attr.ctime = (unsigned int)time(NULL);
+  bool pressure = dirty_bytes > DIRTY_LIMIT;
+  pthread_mutex_unlock(&cache_mutex);
+
+  if (pressure)
+    ret = relieve(eid);
+  return ret;
+}
+
+// Write buf at offset off. Under a lock we own the write is only
+// buffered, and sent on writeback() or flush(); otherwise it goes
+// to the server right away as a ranged write.
+extent_protocol::status
+extent_client::write(extent_protocol::extentid_t eid, uint32_t off,
+                     const std::string &buf)
+{
+  op_stats::scope s(op_stats::EXTENT);
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+
+  if (fenced(eid))
+    return extent_protocol::IOERR;
+  if (!cacheable(eid))
+  {
+    invalidate(eid);
+    rpcc *cl;
+    if ((ret = route(eid, cl)) != extent_protocol::OK)
+      return ret;
+    ret = cl->call(extent_protocol::write, eid, off, buf, fence_of(eid), r);
+    return ret;
+  }
+
+  extent_protocol::attr a;
+  if ((ret = getattr(eid, a)) != extent_protocol::OK)
+    return ret;
+
+  pthread_mutex_lock(&cache_mutex);
+  cached_extent &ce = cache[eid];
+  patch_chunks(ce, off, buf);
+  if (ce.data_valid)
+  {
+    if (ce.data.size() < off)
+      ce.data.resize(off, '\0');
+    ce.data.replace(off, buf.size(), buf);
+  }
+  if (ce.dirty)
+  {
+    // the whole extent goes out anyway, data already has the write
+    ce.dirty_bytes += buf.size();
+    dirty_bytes += buf.size();
+  }
+  else
+  {
+    buffer_write(ce, off, buf);
+  }
+  if (buf.size() > 0 && off + buf.size() > ce.attr.size)
+    ce.attr.size = off + buf.size();
+  ce.attr.mtime = ce.attr.ctime = (unsigned int)time(NULL);
+  bool pressure = dirty_bytes > DIRTY_LIMIT;
+  pthread_mutex_unlock(&cache_mutex);
+
+  if (pressure)
+    ret = relieve(eid);
+  return ret;
+}
+
+// Store the reply of a chunk fetch unless it was cancelled, with
+// the writes the server has not seen yet applied on top.
+void
+extent_client::install_chunk(extent_protocol::extentid_t eid, uint32_t chunk,
+                             unsigned int token, int ret, std::string &buf)
+{
+  pthread_mutex_lock(&cache_mutex);
+  if (cache.count(eid))
+  {
+    cached_extent &ce = cache[eid];
+    std::map<uint32_t, unsigned int>::iterator in = ce.inflight.find(chunk);
+    if (in != ce.inflight.end() && in->second == token)
+    {
+      ce.inflight.erase(in);
+      if (ret == extent_protocol::OK && !ce.data_valid)
+      {
+        uint32_t base = chunk * READ_CHUNK;
+        std::map<uint32_t, std::string>::iterator it;
+        for (it = ce.writes.begin(); it != ce.writes.end(); it++)
+        {
+          uint32_t s = std::max(it->first, base);
+          uint32_t e = std::min((uint32_t)(it->first + it->second.size()),
+                                base + READ_CHUNK);
+          if (s >= e)
+            continue;
+          if (buf.size() < e - base)
+            buf.resize(e - base, '\0');
+          buf.replace(s - base, e - s, it->second, s - it->first, e - s);
+        }
+        chunk_t c = std::make_shared<std::string>();
+        c->swap(buf);
+        ce.chunks[chunk] = c;
+      }
+    }
+  }
+  pthread_cond_broadcast(&chunk_cond);
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+void
+extent_client::chunk_done(void *arg, int ret, std::string &buf)
+{
+  chunk_req *req = (chunk_req *)arg;
+  req->ec->install_chunk(req->eid, req->chunk, req->token, ret, buf);
+  delete req;
+}
+
+// Read at most size bytes at off. Under a lock we own the range is
+// served from, and kept in, the chunk cache.
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, uint32_t off,
+                    uint32_t size, std::string &buf)
+{
+  std::vector<piece> pieces;
+  extent_protocol::status ret = read(eid, off, size, pieces);
+  buf = "";
+  if (ret != extent_protocol::OK)
+    return ret;
+  for (size_t i = 0; i < pieces.size(); i++)
+    buf.append(*pieces[i].data, pieces[i].off, pieces[i].len);
   return ret;
 }
 
+// Hand all of s to a single piece.
+static void
+whole_piece(std::string &s, std::vector<extent_client::piece> &pieces)
+{
+  std::shared_ptr<std::string> data = std::make_shared<std::string>();
+  data->swap(s);
+  extent_client::piece p = { data, 0, (uint32_t)data->size() };
+  pieces.push_back(p);
+}
+
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, uint32_t off,
+                    uint32_t size, std::vector<piece> &pieces)
+{
+  op_stats::scope s(op_stats::EXTENT);
+  extent_protocol::status ret = extent_protocol::OK;
+  // what a chunk shorter than the extent reads as past its end
+  static std::shared_ptr<const std::string> zeros =
+      std::make_shared<const std::string>(READ_CHUNK, '\0');
+  rpcc *cl;
+  std::string buf;
+
+  pieces.clear();
+  if ((ret = route(eid, cl)) != extent_protocol::OK)
+    return ret;
+  if (!cacheable(eid))
+  {
+    invalidate(eid);
+    ret = cl->call(extent_protocol::read, eid, off, size, buf);
+    if (ret == extent_protocol::OK)
+      whole_piece(buf, pieces);
+    return ret;
+  }
+
+  extent_protocol::attr a;
+  if ((ret = getattr(eid, a)) != extent_protocol::OK)
+    return ret;
+  if (off >= a.size || size == 0)
+    return ret;
+  size = std::min(size, a.size - off);
+  uint32_t first = off / READ_CHUNK, last = (off + size - 1) / READ_CHUNK;
+
+  // fetch all missing chunks of the range in parallel
+  prefetch(eid, off, size);
+
+  pthread_mutex_lock(&cache_mutex);
+  for (;;)
+  {
+    if (cache.count(eid) == 0)
+    {
+      // flushed under us, we no longer own the extent
+      pthread_mutex_unlock(&cache_mutex);
+      ret = cl->call(extent_protocol::read, eid, off, size, buf);
+      if (ret == extent_protocol::OK)
+        whole_piece(buf, pieces);
+      return ret;
+    }
+    cached_extent &ce = cache[eid];
+    if (ce.data_valid)
+    {
+      if (off < ce.data.size())
+      {
+        buf = ce.data.substr(off, size);
+        whole_piece(buf, pieces);
+      }
+      break;
+    }
+
+    uint32_t c = first;
+    while (c <= last && ce.chunks.count(c))
+      c++;
+    if (c > last)
+    {
+      for (c = first; c <= last; c++)
+      {
+        uint32_t base = c * READ_CHUNK;
+        uint32_t s = std::max(off, base), e = std::min(off + size, base + READ_CHUNK);
+        chunk_t &chunk = ce.chunks[c];
+        if (s - base < chunk->size())
+        {
+          piece p = { chunk, s - base,
+                      std::min(e, (uint32_t)(base + chunk->size())) - s };
+          pieces.push_back(p);
+          s += p.len;
+        }
+        if (s < e)
+        {
+          piece p = { zeros, 0, e - s };
+          pieces.push_back(p);
+        }
+      }
+      break;
+    }
+    // a fetch must not overtake writes being pushed
+    if (ce.inflight.count(c) || pushing.count(eid))
+    {
+      pthread_cond_wait(&chunk_cond, &cache_mutex);
+      continue;
+    }
+
+    // the prefetch failed or was cancelled, fetch it ourselves
+    unsigned int token = ++next_token;
+    ce.inflight[c] = token;
+    pthread_mutex_unlock(&cache_mutex);
+    std::string data;
+    ret = cl->call(extent_protocol::read, eid, c * READ_CHUNK,
+                   (uint32_t)READ_CHUNK, data);
+    install_chunk(eid, c, token, ret, data);
+    if (ret != extent_protocol::OK)
+      return ret;
+    pthread_mutex_lock(&cache_mutex);
+  }
+  pthread_mutex_unlock(&cache_mutex);
+  return ret;
+}
+
+// Start fetching the chunks of [off, off+size) in the background.
+// Does nothing unless the extent is cached with a known size and
+// none of its writes are on their way to the server.
+void
+extent_client::prefetch(extent_protocol::extentid_t eid, uint32_t off,
+                        uint32_t size)
+{
+  std::list<chunk_req *> reqs;
+  rpcc *cl;
+
+  if (route(eid, cl) != extent_protocol::OK || !cacheable(eid))
+    return;
+
+  pthread_mutex_lock(&cache_mutex);
+  if (cache.count(eid) == 0 || !cache[eid].attr_valid ||
+      cache[eid].data_valid || pushing.count(eid))
+  {
+    pthread_mutex_unlock(&cache_mutex);
+    return;
+  }
+  cached_extent &ce = cache[eid];
+  if (off >= ce.attr.size || size == 0)
+  {
+    pthread_mutex_unlock(&cache_mutex);
+    return;
+  }
+  size = std::min(size, ce.attr.size - off);
+  uint32_t first = off / READ_CHUNK, last = (off + size - 1) / READ_CHUNK;
+
+  // make room by forgetting what lies behind the range
+  while (ce.chunks.size() + ce.inflight.size() + (last - first + 1) > MAX_CHUNKS &&
+         !ce.chunks.empty() && ce.chunks.begin()->first < first)
+    ce.chunks.erase(ce.chunks.begin());
+
+  for (uint32_t c = first; c <= last; c++)
+  {
+    if (ce.chunks.count(c) || ce.inflight.count(c))
+      continue;
+    if (ce.chunks.size() + ce.inflight.size() >= MAX_CHUNKS)
+      break;
+    chunk_req *req = new chunk_req;
+    req->ec = this;
+    req->eid = eid;
+    req->chunk = c;
+    req->token = ++next_token;
+    ce.inflight[c] = req->token;
+    reqs.push_back(req);
+  }
+  pthread_mutex_unlock(&cache_mutex);
+
+  // the reply may be in before then() is called, in which case
+  // chunk_done runs right here, so cache_mutex must not be held
+  std::list<chunk_req *>::iterator it;
+  for (it = reqs.begin(); it != reqs.end(); it++)
+  {
+    rpc_future<std::string> f = cl->async_call<std::string>(
+        extent_protocol::read, eid, (*it)->chunk * READ_CHUNK,
+        (uint32_t)READ_CHUNK, rpcc::to_max, readahead_pool);
+    f.then(chunk_done, *it);
+  }
+}
+
 extent_protocol::status
 extent_client::remove(extent_protocol::extentid_t eid)
 {
+  op_stats::scope s(op_stats::EXTENT);
   extent_protocol::status ret = extent_protocol::OK;
-  // Your lab2 part1 code goes here
   int i;
-  ret = cl->call(extent_protocol::remove, eid, i);
+  rpcc *cl;
+  if (fenced(eid))
+    return extent_protocol::IOERR;
+  if ((ret = route(eid, cl)) != extent_protocol::OK)
+    return ret;
+  invalidate(eid);
+  ret = cl->call(extent_protocol::remove, eid, fence_of(eid), i);
+  return ret;
+}
+
+// Send the dirty state of eid to the server but keep it cached.
+// The lock of eid cannot be handed to another client while the
+// writes are still in flight, since flush() waits for them.
+extent_protocol::status
+extent_client::writeback(extent_protocol::extentid_t eid)
+{
+  op_stats::scope s(op_stats::EXTENT);
+  cached_extent ce;
+
+  pthread_mutex_lock(&cache_mutex);
+  start_push(eid);
+  if (cache.count(eid) == 0)
+  {
+    pthread_mutex_unlock(&cache_mutex);
+    end_push(eid);
+    return extent_protocol::OK;
+  }
+  cached_extent &cur = cache[eid];
+  ce.dirty = cur.dirty;
+  if (ce.dirty)
+    ce.data = cur.data;
+  ce.writes.swap(cur.writes);
+  clean(cur);
+  // a fetch in flight may be served before these writes land
+  if (!cur.inflight.empty())
+  {
+    cur.inflight.clear();
+    pthread_cond_broadcast(&chunk_cond);
+  }
+  pthread_mutex_unlock(&cache_mutex);
+
+  extent_protocol::status ret = push(eid, ce);
+  end_push(eid);
+  return ret;
+}
+
+// Write back eid if it is dirty and drop it from the cache.
+// Called when the lock protecting eid is about to be released.
+extent_protocol::status
+extent_client::flush(extent_protocol::extentid_t eid)
+{
+  op_stats::scope s(op_stats::EXTENT);
+  cached_extent ce;
+
+  pthread_mutex_lock(&cache_mutex);
+  flush_gen++;
+  if (cache.count(eid) == 0 && pushing.count(eid) == 0)
+  {
+    pthread_mutex_unlock(&cache_mutex);
+    return extent_protocol::OK;
+  }
+  start_push(eid);
+  if (cache.count(eid))
+  {
+    ce = cache[eid];
+    clean(cache[eid]);
+    cache.erase(eid);
+  }
+  pthread_mutex_unlock(&cache_mutex);
+
+  extent_protocol::status ret = push(eid, ce);
+  end_push(eid);
   return ret;
 }
 
 extent_protocol::status
 extent_client::get_block_ids(extent_protocol::extentid_t eid, std::list<blockid_t> &block_ids)
 {
+  op_stats::scope s(op_stats::EXTENT);
   extent_protocol::status ret = extent_protocol::OK;
+  rpcc *cl;
+  if ((ret = route(eid, cl)) != extent_protocol::OK)
+    return ret;
+  // the server must see our writes before it lays out the blocks
+  if ((ret = flush(eid)) != extent_protocol::OK)
+    return ret;
   ret = cl->call(extent_protocol::get_block_ids, eid, block_ids);
+  blockid_t tag = (eid >> SHARD_SHIFT) << BLOCK_SHARD_SHIFT;
+  for (std::list<blockid_t>::iterator it = block_ids.begin(); it != block_ids.end(); it++)
+    *it |= tag;
   return ret;
 }
 
 extent_protocol::status
 extent_client::read_block(blockid_t bid, std::string &buf)
 {
+  op_stats::scope s(op_stats::EXTENT);
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::read_block, bid, buf);
+  rpcc *cl;
+  if ((ret = route_block(bid, cl)) != extent_protocol::OK)
+    return ret;
+  ret = cl->call(extent_protocol::read_block, (blockid_t)(bid & BLOCK_MASK),
+                 buf);
   return ret;
 }
 
 extent_protocol::status
 extent_client::write_block(blockid_t bid, const std::string &buf)
 {
+  op_stats::scope s(op_stats::EXTENT);
   extent_protocol::status ret = extent_protocol::OK;
   int r;
-  ret = cl->call(extent_protocol::write_block, bid, buf, r);
+  rpcc *cl;
+  if ((ret = route_block(bid, cl)) != extent_protocol::OK)
+    return ret;
+  ret = cl->call(extent_protocol::write_block, (blockid_t)(bid & BLOCK_MASK),
+                 buf, r);
   return ret;
 }
 
 extent_protocol::status
 extent_client::append_block(extent_protocol::extentid_t eid, blockid_t &bid)
 {
+  op_stats::scope s(op_stats::EXTENT);
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::append_block, eid, bid);
+  rpcc *cl;
+  if (fenced(eid))
+    return extent_protocol::IOERR;
+  if ((ret = route(eid, cl)) != extent_protocol::OK ||
+      (ret = flush(eid)) != extent_protocol::OK)
+    return ret;
+  ret = cl->call(extent_protocol::append_block, eid, fence_of(eid), bid);
+  if (ret == extent_protocol::OK)
+    bid |= (eid >> SHARD_SHIFT) << BLOCK_SHARD_SHIFT;
   return ret;
 }
 
 extent_protocol::status
 extent_client::complete(extent_protocol::extentid_t eid, uint32_t size)
 {
+  op_stats::scope s(op_stats::EXTENT);
   extent_protocol::status ret = extent_protocol::OK;
   int r;
-  ret = cl->call(extent_protocol::complete, eid, size, r);
+  rpcc *cl;
+  if (fenced(eid))
+    return extent_protocol::IOERR;
+  if ((ret = route(eid, cl)) != extent_protocol::OK ||
+      (ret = flush(eid)) != extent_protocol::OK)
+    return ret;
+  ret = cl->call(extent_protocol::complete, eid, size, fence_of(eid), r);
   return ret;
 }
 
+extent_protocol::status
+extent_client::clone(extent_protocol::extentid_t eid,
+                     extent_protocol::extentid_t &new_eid)
+{
+  op_stats::scope s(op_stats::EXTENT);
+  extent_protocol::status ret = extent_protocol::OK;
+  rpcc *cl;
+  if ((ret = route(eid, cl)) != extent_protocol::OK ||
+      (ret = flush(eid)) != extent_protocol::OK)
+    return ret;
+  // the clone shares its blocks, so it stays on the same shard
+  ret = cl->call(extent_protocol::clone, eid, new_eid);
+  if (ret == extent_protocol::OK)
+    new_eid |= (eid >> SHARD_SHIFT) << SHARD_SHIFT;
+  return ret;
+}
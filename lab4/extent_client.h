@@ -4,21 +4,166 @@
 #define extent_client_h
 
 #include <string>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
 #include "extent_protocol.h"
 #include "extent_server.h"
 
+// Classes that inherit extent_lock_user tell extent_client about the
+// locks that guard extents, each named by its extent id: whether the
+// lock is cached here, so the extent may be, whether the lease under
+// which it is held has run out, so the extent must not be written
+// any more, and the fencing token of the grant, which goes with the
+// writes. yfs_client answers from its lock_client_cache.
+class extent_lock_user {
+ public:
+  virtual bool is_cached(extent_protocol::extentid_t) = 0;
+  virtual bool lapsed(extent_protocol::extentid_t) = 0;
+  virtual extent_protocol::fence_t fence(extent_protocol::extentid_t) = 0;
+  virtual ~extent_lock_user() {};
+};
+
 class extent_client {
  private:
-  rpcc *cl;
+  // One rpcc per extent server (shard), in the order given to the
+  // constructor. An extent lives on the shard stored in the bits of
+  // its id above SHARD_SHIFT, a block on the one in its top bits
+  // from BLOCK_SHARD_SHIFT; shard 0 ids carry no tag. New extents
+  // are placed by a consistent-hash ring over the server addresses.
+  std::vector<rpcc *> shards;
+  std::map<uint32_t, unsigned int> ring;
+  unsigned int next_key;
+
+  extent_protocol::status route(extent_protocol::extentid_t eid, rpcc *&cl);
+  extent_protocol::status route_block(blockid_t bid, rpcc *&cl);
+  unsigned int place(const std::string &key);
+
+  // Extents are cached while lu says this client owns the lock named
+  // by the extent id; nobody else can read or modify them until the
+  // lock is revoked, at which point flush() must be called. Once our
+  // lease on the lock runs out nothing is written under it any more,
+  // and writes carry the token of the grant, so that the server too
+  // refuses them once the lock has moved on.
+  //
+  // Dirty data is kept in one of two forms: after a put the whole
+  // extent is dirty; after writes only the written byte ranges are,
+  // coalesced by offset so that adjacent writes go out as one RPC.
+  //
+  // Ranged reads fill chunks of READ_CHUNK bytes, keyed by chunk
+  // index, instead of the whole data. A chunk being fetched is
+  // listed in inflight with a token; the reply is only installed if
+  // the token still matches, so writes can cancel stale fetches;
+  // chunks already cached are patched by writes. A chunk may be
+  // shared with the pieces handed out by read(), so a write to one
+  // that is replaces it with a patched copy instead.
+  typedef std::shared_ptr<std::string> chunk_t;
+  struct cached_extent {
+    std::string data;
+    extent_protocol::attr attr;
+    bool data_valid;
+    bool attr_valid;
+    bool dirty;
+    std::map<uint32_t, std::string> writes;
+    size_t dirty_bytes;
+    std::map<uint32_t, chunk_t> chunks;
+    std::map<uint32_t, unsigned int> inflight;
+    cached_extent() : data_valid(false), attr_valid(false), dirty(false),
+                      dirty_bytes(0) {}
+  };
+  extent_lock_user *lu;
+  pthread_mutex_t cache_mutex;
+  std::map<extent_protocol::extentid_t, cached_extent> cache;
+  unsigned int flush_gen;
+  size_t dirty_bytes;
+  unsigned int next_token;
+  pthread_cond_t chunk_cond;
+  // Extents whose dirty state is on its way to the server. Only one
+  // push per extent is in flight at a time, so that a later state
+  // cannot be overtaken by an earlier one; push_cond is signalled
+  // when one is done.
+  std::set<extent_protocol::extentid_t> pushing;
+  pthread_cond_t push_cond;
+  // Prefetches are sent from a pool of their own, so that read-ahead
+  // cannot keep getattr_multi and the like waiting for a thread of
+  // the shared one, and so that at most READAHEAD_THREADS of them
+  // are on the wire at once.
+  ThrPool *readahead_pool;
+
+  struct chunk_req {
+    extent_client *ec;
+    extent_protocol::extentid_t eid;
+    uint32_t chunk;
+    unsigned int token;
+  };
+
+  bool cacheable(extent_protocol::extentid_t eid);
+  bool fenced(extent_protocol::extentid_t eid);
+  extent_protocol::fence_t fence_of(extent_protocol::extentid_t eid);
+  void invalidate(extent_protocol::extentid_t eid);
+  void forget(extent_protocol::extentid_t eid);
+  void clean(cached_extent &ce);
+  void local_size(cached_extent &ce, extent_protocol::attr &a);
+  void buffer_write(cached_extent &ce, uint32_t off, const std::string &buf);
+  extent_protocol::status push(extent_protocol::extentid_t eid,
+                               cached_extent &ce);
+  void start_push(extent_protocol::extentid_t eid);
+  void end_push(extent_protocol::extentid_t eid);
+  extent_protocol::status relieve(extent_protocol::extentid_t eid);
+  void drop_chunks(cached_extent &ce, uint32_t off, uint32_t len);
+  void patch_chunks(cached_extent &ce, uint32_t off, const std::string &buf);
+  void install_chunk(extent_protocol::extentid_t eid, uint32_t chunk,
+                     unsigned int token, int ret, std::string &buf);
+  static void chunk_done(void *arg, int ret, std::string &buf);
 
  public:
-  extent_client(std::string dst);
+  // A stretch of what read() returns: len bytes at off in *data,
+  // which nobody changes while the piece holds it.
+  struct piece {
+    std::shared_ptr<const std::string> data;
+    uint32_t off;
+    uint32_t len;
+  };
+
+  // dst is a comma separated list of extent servers. Servers may
+  // only be appended to it, since ids refer to shards by position.
+  extent_client(std::string dst, extent_lock_user *lu = NULL);
 
-  extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
+  // key, e.g. the path of the new extent, chooses its shard
+  extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid,
+                                 const std::string &key = "");
+  // Create an extent holding data and link it into directory parent
+  // as name in one RPC; EXIST if name is taken. The new extent lives
+  // on the shard of parent.
+  extent_protocol::status create_in_dir(extent_protocol::extentid_t parent,
+                                        const std::string &name, uint32_t type,
+                                        const std::string &data,
+                                        extent_protocol::extentid_t &eid,
+                                        extent_protocol::attr &a);
+  // Move an entry between two directories on the same shard in one
+  // RPC and return the inum it names. If dst_name is taken, it is
+  // EXIST unless replace is set, in which case the entry is replaced
+  // in the same RPC and the inum it named returned in replaced, 0
+  // otherwise; the caller frees it.
+  extent_protocol::status rename(extent_protocol::extentid_t src_dir,
+                                 const std::string &src_name,
+                                 extent_protocol::extentid_t dst_dir,
+                                 const std::string &dst_name,
+                                 bool replace,
+                                 extent_protocol::extentid_t &eid,
+                                 extent_protocol::extentid_t &replaced);
+  bool same_shard(extent_protocol::extentid_t a, extent_protocol::extentid_t b);
+  // whether create(..., key) would place the extent with eid
+  bool colocated(extent_protocol::extentid_t eid, const std::string &key);
   extent_protocol::status get(extent_protocol::extentid_t eid, 
 			                        std::string &buf);
   extent_protocol::status getattr(extent_protocol::extentid_t eid, 
 				                          extent_protocol::attr &a);
+  // attrs of many extents, one RPC per shard involved; type is 0
+  // for an extent that does not exist
+  extent_protocol::status getattr_multi(const std::vector<extent_protocol::extentid_t> &eids,
+                                        std::vector<extent_protocol::attr> &attrs);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
   extent_protocol::status get_block_ids(extent_protocol::extentid_t eid, std::list<blockid_t> &block_ids);
@@ -26,6 +171,19 @@ class extent_client {
   extent_protocol::status write_block(blockid_t bid, const std::string &buf);
   extent_protocol::status append_block(extent_protocol::extentid_t eid, blockid_t &bid);
   extent_protocol::status complete(extent_protocol::extentid_t eid, uint32_t size);
+  extent_protocol::status clone(extent_protocol::extentid_t eid,
+                                extent_protocol::extentid_t &new_eid);
+  extent_protocol::status write(extent_protocol::extentid_t eid, uint32_t off,
+                                const std::string &buf);
+  extent_protocol::status read(extent_protocol::extentid_t eid, uint32_t off,
+                               uint32_t size, std::string &buf);
+  // read() without copying out of the chunk cache: the pieces, in
+  // order, make up the data
+  extent_protocol::status read(extent_protocol::extentid_t eid, uint32_t off,
+                               uint32_t size, std::vector<piece> &pieces);
+  void prefetch(extent_protocol::extentid_t eid, uint32_t off, uint32_t size);
+  extent_protocol::status writeback(extent_protocol::extentid_t eid);
+  extent_protocol::status flush(extent_protocol::extentid_t eid);
 };
 
 #endif 
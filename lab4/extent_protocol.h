@@ -11,7 +11,10 @@ class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR };
+  // fencing token of the lock grant a write is made under, see
+  // lock_protocol.h; 0 for a write under no lock
+  typedef unsigned long long fence_t;
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST };
   enum rpc_numbers {
     put = 0x6001,
     get,
@@ -22,7 +25,13 @@ class extent_protocol {
     read_block,
     write_block,
     append_block,
-    complete
+    complete,
+    clone,
+    write,
+    read,
+    create_in_dir,
+    rename,
+    getattr_multi
   };
 
   enum types {
@@ -38,6 +47,19 @@ class extent_protocol {
     unsigned int ctime;
     unsigned int size;
   };
+
+  // reply of create_in_dir: the new extent and its attributes
+  struct create_result {
+    extentid_t id;
+    attr a;
+  };
+
+  // reply of rename: the inum moved, and the one it replaced at the
+  // destination, 0 if none
+  struct rename_result {
+    extentid_t id;
+    extentid_t replaced;
+  };
 };
 
 inline unmarshall &
@@ -62,5 +84,37 @@ operator<<(marshall &m, extent_protocol::attr a)
   return m;
 }
 
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::create_result &r)
+{
+  u >> r.id;
+  u >> r.a;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::create_result r)
+{
+  m << r.id;
+  m << r.a;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::rename_result &r)
+{
+  u >> r.id;
+  u >> r.replaced;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::rename_result r)
+{
+  m << r.id;
+  m << r.replaced;
+  return m;
+}
+
 #endif 
 
@@ -1,19 +1,79 @@
 // the extent server implementation
 
 #include "extent_server.h"
+#include "dir_index.h"
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <algorithm>
 
 extent_server::extent_server() 
 {
   im = new inode_manager();
+  for (int i = 0; i < FENCE_LOCKS; i++)
+    pthread_mutex_init(&fence_locks[i], NULL);
+  fences.assign(INODE_NUM, 0);
 }
 
+// Whether a write to inum with token fence may go ahead; it then
+// becomes the largest seen. Writes under no lock are not checked.
+// Called with the fence lock of inum held.
+bool extent_server::admit(uint32_t inum, extent_protocol::fence_t fence)
+{
+  if (fence == 0 || inum >= fences.size())
+    return true;
+  if (fence < fences[inum])
+  {
+    printf("extent_server: stale write to %u, token %llu < %llu\n",
+           inum, fence, fences[inum]);
+    return false;
+  }
+  fences[inum] = fence;
+  return true;
+}
+
+// Take the fence locks of inodes a and b, b 0 for none, and tell
+// whether writes with tokens fa and fb may go to them.
+bool extent_server::fence_enter(uint32_t a, extent_protocol::fence_t fa,
+                                uint32_t b, extent_protocol::fence_t fb)
+{
+  int i = a % FENCE_LOCKS, j = b == 0 ? i : b % FENCE_LOCKS;
+  pthread_mutex_lock(&fence_locks[std::min(i, j)]);
+  if (i != j)
+    pthread_mutex_lock(&fence_locks[std::max(i, j)]);
+  return admit(a, fa) && (b == 0 || admit(b, fb));
+}
+
+void extent_server::fence_leave(uint32_t a, uint32_t b)
+{
+  int i = a % FENCE_LOCKS, j = b == 0 ? i : b % FENCE_LOCKS;
+  if (i != j)
+    pthread_mutex_unlock(&fence_locks[std::max(i, j)]);
+  pthread_mutex_unlock(&fence_locks[std::min(i, j)]);
+}
+
+// Holds the fence locks of the inodes a write goes to, one or two,
+// while it is in scope; ok tells whether the write may go ahead.
+class fence_guard {
+  extent_server *es;
+  uint32_t a, b;
+
+ public:
+  bool ok;
+  fence_guard(extent_server *_es, uint32_t _a, extent_protocol::fence_t fa,
+              uint32_t _b = 0, extent_protocol::fence_t fb = 0)
+      : es(_es), a(_a), b(_b)
+  {
+    ok = es->fence_enter(a, fa, b, fb);
+  }
+  ~fence_guard() { es->fence_leave(a, b); }
+};
+
 int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
 {
   // alloc a new inode and return inum
@@ -23,9 +83,13 @@ int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
   return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+int extent_server::put(extent_protocol::extentid_t id, std::string buf,
+                       extent_protocol::fence_t fence, int &)
 {
   id &= 0x7fffffff;
+  fence_guard fg(this, id, fence);
+  if (!fg.ok)
+    return extent_protocol::IOERR;
   
   const char * cbuf = buf.c_str();
   int size = buf.size();
@@ -34,6 +98,19 @@ int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
   return extent_protocol::OK;
 }
 
+int extent_server::write(extent_protocol::extentid_t id, uint32_t off, std::string buf,
+                         extent_protocol::fence_t fence, int &)
+{
+  id &= 0x7fffffff;
+  fence_guard fg(this, id, fence);
+  if (!fg.ok)
+    return extent_protocol::IOERR;
+
+  im->write_range(id, off, buf.data(), buf.size());
+
+  return extent_protocol::OK;
+}
+
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
 {
   printf("extent_server: get %lld\n", id);
@@ -54,6 +131,144 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
   return extent_protocol::OK;
 }
 
+int extent_server::read(extent_protocol::extentid_t id, uint32_t off, uint32_t size, std::string &buf)
+{
+  id &= 0x7fffffff;
+
+  int n = 0;
+  char *cbuf = NULL;
+
+  im->read_range(id, off, size, &cbuf, &n);
+  if (n == 0)
+    buf = "";
+  else {
+    buf.assign(cbuf, n);
+    free(cbuf);
+  }
+
+  return extent_protocol::OK;
+}
+
+// Directory pages of one inode, read and written in place.
+class im_dir_io : public dir_io {
+  inode_manager *im;
+  uint32_t inum;
+
+ public:
+  im_dir_io(inode_manager *_im, uint32_t _inum) : im(_im), inum(_inum) {}
+  extent_protocol::status read(uint32_t off, uint32_t size, std::string &buf)
+  {
+    int n = 0;
+    char *cbuf = NULL;
+    im->read_range(inum, off, size, &cbuf, &n);
+    if (n == 0)
+      buf = "";
+    else {
+      buf.assign(cbuf, n);
+      free(cbuf);
+    }
+    return extent_protocol::OK;
+  }
+  extent_protocol::status write(uint32_t off, const std::string &buf)
+  {
+    im->write_range(inum, off, buf.data(), buf.size());
+    return extent_protocol::OK;
+  }
+};
+
+// Create an inode of the given type holding data and link it into
+// directory parent as name, unless name is already there. The new
+// inode is on this server, so its id carries the shard of parent.
+// The client must hold the lock of parent.
+int extent_server::create_in_dir(extent_protocol::extentid_t parent, std::string name,
+                                 uint32_t type, std::string data,
+                                 extent_protocol::fence_t fence,
+                                 extent_protocol::create_result &res)
+{
+  printf("extent_server: create_in_dir %lld %s\n", parent, name.c_str());
+
+  extent_protocol::extentid_t shard = parent & ~0xffffffffULL;
+  parent &= 0x7fffffff;
+  fence_guard fg(this, parent, fence);
+  if (!fg.ok)
+    return extent_protocol::IOERR;
+
+  im_dir_io io(im, parent);
+  dir_index index(&io);
+  bool found = false;
+  unsigned long long existing;
+  extent_protocol::status ret = index.lookup(name, found, existing);
+  if (ret != extent_protocol::OK)
+    return ret;
+  if (found)
+    return extent_protocol::EXIST;
+
+  uint32_t inum = im->alloc_inode(type);
+  if (data.size() > 0)
+    im->write_file(inum, data.data(), data.size());
+  res.id = shard | inum;
+  if ((ret = index.insert(name, res.id)) != extent_protocol::OK)
+  {
+    im->remove_file(inum);
+    return ret;
+  }
+
+  memset(&res.a, 0, sizeof(res.a));
+  im->getattr(inum, res.a);
+  return extent_protocol::OK;
+}
+
+// Move the entry src_name of src_dir to dst_name in dst_dir and
+// return the inum it names. Both directories must be on this server
+// and locked by the client. EXIST if dst_name names another inode,
+// unless replace is set: the entry then names the moved inode
+// instead, and the one it named is returned for the client to free.
+// The client checks that it is not a directory, which may live on
+// another shard.
+int extent_server::rename(extent_protocol::extentid_t src_dir, std::string src_name,
+                          extent_protocol::extentid_t dst_dir, std::string dst_name,
+                          int replace, extent_protocol::fence_t src_fence,
+                          extent_protocol::fence_t dst_fence,
+                          extent_protocol::rename_result &res)
+{
+  printf("extent_server: rename %lld/%s %lld/%s\n", src_dir, src_name.c_str(),
+         dst_dir, dst_name.c_str());
+
+  src_dir &= 0x7fffffff;
+  dst_dir &= 0x7fffffff;
+  res.id = res.replaced = 0;
+  fence_guard fg(this, src_dir, src_fence, dst_dir, dst_fence);
+  if (!fg.ok)
+    return extent_protocol::IOERR;
+
+  im_dir_io src_io(im, src_dir), dst_io(im, dst_dir);
+  dir_index src(&src_io), dst(&dst_io);
+  bool found = false;
+  unsigned long long ino, existing;
+  extent_protocol::status ret = src.lookup(src_name, found, ino);
+  if (ret != extent_protocol::OK)
+    return ret;
+  if (!found)
+    return extent_protocol::NOENT;
+  res.id = ino;
+  if ((ret = dst.lookup(dst_name, found, existing)) != extent_protocol::OK)
+    return ret;
+  if (found && existing == ino)
+    return extent_protocol::OK;
+  if (found)
+  {
+    if (!replace)
+      return extent_protocol::EXIST;
+    if ((ret = dst.replace(dst_name, ino, existing)) != extent_protocol::OK)
+      return ret;
+    res.replaced = existing;
+  }
+  // add before removing, so a failure never loses the entry
+  else if ((ret = dst.insert(dst_name, ino)) != extent_protocol::OK)
+    return ret;
+  return src.remove(src_name, existing);
+}
+
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
   printf("extent_server: getattr %lld\n", id);
@@ -68,19 +283,42 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
   return extent_protocol::OK;
 }
 
-int extent_server::remove(extent_protocol::extentid_t id, int &)
+// Attributes of each of ids, in order; type 0 for a free inode.
+int extent_server::getattr_multi(std::vector<extent_protocol::extentid_t> ids,
+                                 std::vector<extent_protocol::attr> &as)
+{
+  printf("extent_server: getattr_multi %lu\n", (unsigned long)ids.size());
+
+  extent_protocol::attr attr;
+  memset(&attr, 0, sizeof(attr));
+  as.assign(ids.size(), attr);
+  for (size_t i = 0; i < ids.size(); i++)
+    im->getattr(ids[i] & 0x7fffffff, as[i]);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::remove(extent_protocol::extentid_t id,
+                          extent_protocol::fence_t fence, int &)
 {
   printf("extent_server: write %lld\n", id);
 
   id &= 0x7fffffff;
+  fence_guard fg(this, id, fence);
+  if (!fg.ok)
+    return extent_protocol::IOERR;
   im->remove_file(id);
  
   return extent_protocol::OK;
 }
 
-int extent_server::append_block(extent_protocol::extentid_t id, blockid_t &bid)
+int extent_server::append_block(extent_protocol::extentid_t id,
+                                extent_protocol::fence_t fence, blockid_t &bid)
 {
   id &= 0x7fffffff;
+  fence_guard fg(this, id, fence);
+  if (!fg.ok)
+    return extent_protocol::IOERR;
 
   im->append_block(id, bid);
 
@@ -111,14 +349,32 @@ int extent_server::write_block(blockid_t id, std::string buf, int &)
   if (buf.size() != BLOCK_SIZE)
     return extent_protocol::IOERR;
 
-  im->write_block(id, (const char *) buf.data());
+  if (!im->write_block(id, (const char *) buf.data()))
+    return extent_protocol::IOERR;
 
   return extent_protocol::OK;
 }
 
-int extent_server::complete(extent_protocol::extentid_t eid, uint32_t size, int &)
+int extent_server::complete(extent_protocol::extentid_t eid, uint32_t size,
+                            extent_protocol::fence_t fence, int &)
 {
+  eid &= 0x7fffffff;
+  fence_guard fg(this, eid, fence);
+  if (!fg.ok)
+    return extent_protocol::IOERR;
+
   im->complete(eid, size);
   return extent_protocol::OK;
 }
 
+int extent_server::clone(extent_protocol::extentid_t id, extent_protocol::extentid_t &new_id)
+{
+  printf("extent_server: clone %lld\n", id);
+
+  id &= 0x7fffffff;
+  new_id = im->clone_inode(id);
+  if (new_id == 0)
+    return extent_protocol::NOENT;
+
+  return extent_protocol::OK;
+}
@@ -6,9 +6,13 @@
 #include <string>
 #include <map>
 #include <list>
+#include <vector>
 #include "extent_protocol.h"
 #include "inode_manager.h"
 
+// locks that fenced writes take, by inode
+#define FENCE_LOCKS 64
+
 class extent_server {
  protected:
 #if 0
@@ -19,20 +23,50 @@ class extent_server {
   std::map <extent_protocol::extentid_t, extent_t> extents;
 #endif
   inode_manager *im;
+  // The largest fencing token a write has come with, by inode; a
+  // write with a smaller one comes from a client that has lost its
+  // lock and is refused. A write is checked and done under the fence
+  // lock of its inode, so that a refused writer cannot slip in after
+  // its successor.
+  pthread_mutex_t fence_locks[FENCE_LOCKS];
+  std::vector<extent_protocol::fence_t> fences;
+  bool admit(uint32_t inum, extent_protocol::fence_t);
+  bool fence_enter(uint32_t a, extent_protocol::fence_t fa,
+                   uint32_t b, extent_protocol::fence_t fb);
+  void fence_leave(uint32_t a, uint32_t b);
+  friend class fence_guard;
 
  public:
   extent_server();
 
   int create(uint32_t type, extent_protocol::extentid_t &id);
-  int put(extent_protocol::extentid_t id, std::string, int &);
+  int put(extent_protocol::extentid_t id, std::string, extent_protocol::fence_t,
+          int &);
   int get(extent_protocol::extentid_t id, std::string &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
-  int remove(extent_protocol::extentid_t id, int &);
+  int getattr_multi(std::vector<extent_protocol::extentid_t> ids,
+                    std::vector<extent_protocol::attr> &);
+  int remove(extent_protocol::extentid_t id, extent_protocol::fence_t, int &);
   int get_block_ids(extent_protocol::extentid_t id, std::list<blockid_t> &);
   int read_block(blockid_t id, std::string &buf);
   int write_block(blockid_t id, std::string buf, int &);
-  int append_block(extent_protocol::extentid_t eid, blockid_t &bid);
-  int complete(extent_protocol::extentid_t eid, uint32_t size, int &);
+  int append_block(extent_protocol::extentid_t eid, extent_protocol::fence_t,
+                   blockid_t &bid);
+  int complete(extent_protocol::extentid_t eid, uint32_t size,
+               extent_protocol::fence_t, int &);
+  int clone(extent_protocol::extentid_t id, extent_protocol::extentid_t &new_id);
+  int write(extent_protocol::extentid_t id, uint32_t off, std::string buf,
+            extent_protocol::fence_t, int &);
+  int read(extent_protocol::extentid_t id, uint32_t off, uint32_t size, std::string &);
+  int create_in_dir(extent_protocol::extentid_t parent, std::string name,
+                    uint32_t type, std::string data,
+                    extent_protocol::fence_t,
+                    extent_protocol::create_result &);
+  int rename(extent_protocol::extentid_t src_dir, std::string src_name,
+             extent_protocol::extentid_t dst_dir, std::string dst_name,
+             int replace, extent_protocol::fence_t src_fence,
+             extent_protocol::fence_t dst_fence,
+             extent_protocol::rename_result &);
 };
 
 #endif 
@@ -36,6 +36,12 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::write_block, &ls, &extent_server::write_block);
   server.reg(extent_protocol::append_block, &ls, &extent_server::append_block);
   server.reg(extent_protocol::complete, &ls, &extent_server::complete);
+  server.reg(extent_protocol::clone, &ls, &extent_server::clone);
+  server.reg(extent_protocol::write, &ls, &extent_server::write);
+  server.reg(extent_protocol::read, &ls, &extent_server::read);
+  server.reg(extent_protocol::create_in_dir, &ls, &extent_server::create_in_dir);
+  server.reg(extent_protocol::rename, &ls, &extent_server::rename);
+  server.reg(extent_protocol::getattr_multi, &ls, &extent_server::getattr_multi);
 
   while(1)
     sleep(1000);
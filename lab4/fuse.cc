@@ -15,8 +15,18 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
 #include "lang/verify.h"
 #include "yfs_client.h"
+#include "yfs_ioctl.h"
+#include "op_stats.h"
 
 int myid;
 yfs_client *yfs;
@@ -90,6 +100,158 @@ getattr(yfs_client::inum inum, struct stat &st)
     return yfs_client::OK;
 }
 
+// Fill in st from attributes the extent server already returned,
+// as getattr() would.
+void
+attr2stat(yfs_client::inum inum, const extent_protocol::attr &a, struct stat &st)
+{
+    bzero(&st, sizeof(st));
+
+    st.st_ino = inum;
+    if (a.type == extent_protocol::T_DIR)
+    {
+        st.st_mode = S_IFDIR | 0777;
+        st.st_nlink = 2;
+    }
+    else
+    {
+        st.st_mode = (a.type == extent_protocol::T_FILE ? S_IFREG | 0666 : S_IFLNK | 0777);
+        st.st_nlink = 1;
+        st.st_size = a.size;
+    }
+    st.st_atime = a.atime;
+    st.st_mtime = a.mtime;
+    st.st_ctime = a.ctime;
+}
+
+//
+// The kernel may cache attributes and directory entries for as long
+// as this client holds the lock of the inode they describe, since no
+// other client can change the inode meanwhile. A revoke drops them
+// through the invalidation thread below, before the lock goes back
+// to the server; the timeout only bounds how long a reply that raced
+// with a revoke can stay stale.
+//
+#define KCACHE_TIMEOUT 1.0
+// names recorded at most; past this, entries are not cached at all
+#define KENTRIES_MAX 65536
+
+struct fuse_chan *kchan;
+// names the kernel may have cached, per directory
+std::map<yfs_client::inum, std::set<std::string> > kentries;
+size_t nkentries;
+// inodes whose kernel state must be dropped; inval_queued counts
+// those ever queued, inval_issued those the kernel has been told
+// about, and inval_done is signalled as the latter grows
+std::list<yfs_client::inum> inval_q;
+unsigned long long inval_queued, inval_issued;
+pthread_mutex_t kcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t inval_done = PTHREAD_COND_INITIALIZER;
+// set in the threads that serve FUSE requests
+__thread bool serving_request;
+
+double
+kcache_timeout(yfs_client::inum inum)
+{
+    return yfs->get_lock_client()->is_cached(inum) ? KCACHE_TIMEOUT : 0.0;
+}
+
+// Set the timeouts of an entry reply for @name in @parent, and
+// remember the name if the kernel is allowed to keep it.
+void
+kcache_entry(fuse_ino_t parent, const char *name, struct fuse_entry_param *e)
+{
+    e->attr_timeout = kcache_timeout(e->ino);
+    e->entry_timeout = kcache_timeout(parent);
+    if (e->entry_timeout == 0.0)
+        return;
+    pthread_mutex_lock(&kcache_mutex);
+    std::set<std::string> &names = kentries[parent];
+    if (names.count(name) == 0)
+    {
+        if (nkentries >= KENTRIES_MAX)
+        {
+            // a name we could not invalidate must not be kept; the
+            // record drains as locks are revoked or trimmed
+            e->entry_timeout = 0.0;
+            if (names.empty())
+                kentries.erase(parent);
+        }
+        else
+        {
+            names.insert(name);
+            nkentries++;
+        }
+    }
+    pthread_mutex_unlock(&kcache_mutex);
+}
+
+// Called by yfs_client when it drops @inum, before the lock goes
+// back to the server. A thread that serves a FUSE request must not
+// notify the kernel, which may hold locks that a notification waits
+// for, so the work is queued. Other threads, such as the releaser
+// of the lock client, then wait for it to be issued, for at most
+// KCACHE_TIMEOUT: the kernel has let go of whatever it cached by
+// then anyway, which also bounds the wait if the notification is
+// held up by a request that waits for this very release.
+void
+kcache_invalidate(yfs_client::inum inum)
+{
+    pthread_mutex_lock(&kcache_mutex);
+    inval_q.push_back(inum);
+    unsigned long long ticket = ++inval_queued;
+    pthread_cond_signal(&inval_cond);
+    if (!serving_request)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)KCACHE_TIMEOUT;
+        deadline.tv_nsec += (long)((KCACHE_TIMEOUT - (time_t)KCACHE_TIMEOUT) * 1e9);
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (inval_issued < ticket &&
+               pthread_cond_timedwait(&inval_done, &kcache_mutex, &deadline) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&kcache_mutex);
+}
+
+void *
+kcache_inval_thread(void *)
+{
+    pthread_mutex_lock(&kcache_mutex);
+    for (;;)
+    {
+        while (inval_q.empty())
+            pthread_cond_wait(&inval_cond, &kcache_mutex);
+        yfs_client::inum inum = inval_q.front();
+        inval_q.pop_front();
+        std::set<std::string> names;
+        std::map<yfs_client::inum, std::set<std::string> >::iterator d = kentries.find(inum);
+        if (d != kentries.end())
+        {
+            names.swap(d->second);
+            nkentries -= names.size();
+            kentries.erase(d);
+        }
+        pthread_mutex_unlock(&kcache_mutex);
+
+        // ENOENT just means the kernel has nothing cached
+        fuse_lowlevel_notify_inval_inode(kchan, inum, 0, 0);
+        for (std::set<std::string>::iterator it = names.begin(); it != names.end(); ++it)
+            fuse_lowlevel_notify_inval_entry(kchan, inum, it->c_str(), it->size());
+
+        pthread_mutex_lock(&kcache_mutex);
+        inval_issued++;
+        pthread_cond_broadcast(&inval_done);
+    }
+    return NULL;
+}
+
 //
 // This is a typical fuse operation handler; you'll be writing
 // a bunch of handlers like it.
@@ -108,6 +270,8 @@ getattr(yfs_client::inum inum, struct stat &st)
 void fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
                         struct fuse_file_info *fi)
 {
+    static op_stats::counter c("getattr");
+    op_stats::op o(c);
     struct stat st;
     yfs_client::inum inum = ino; // req->in.h.nodeid;
     yfs_client::status ret;
@@ -118,7 +282,7 @@ void fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
         fuse_reply_err(req, ENOENT);
         return;
     }
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, kcache_timeout(inum));
 }
 
 //
@@ -137,6 +301,8 @@ void fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
 void fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
                         int to_set, struct fuse_file_info *fi)
 {
+    static op_stats::counter c("setattr");
+    op_stats::op o(c);
     printf("fuseserver_setattr 0x%x\n", to_set);
     if ((FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_SIZE) & to_set)
     {
@@ -151,7 +317,7 @@ void fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
             yfs->setattr(ino, attr->st_size);
         }
         getattr(ino, st);
-        fuse_reply_attr(req, &st, 0);
+        fuse_reply_attr(req, &st, kcache_timeout(ino));
 #else
         fuse_reply_err(req, ENOSYS);
 #endif
@@ -165,25 +331,48 @@ void fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 //
 // Read up to @size bytes starting at byte offset @off in file @ino.
 //
-// Pass the number of bytes actually read to fuse_reply_buf.
+// Pass the bytes actually read to fuse_reply_data.
 // If there are fewer than @size bytes to read between @off and the
 // end of the file, read just that many bytes. If @off is greater
 // than or equal to the size of the file, read zero bytes.
 //
-// Ignore @fi.
+// @fi->fh identifies the open file, for read-ahead.
 // @req identifies this request, and is used only to send a
-// response back to fuse with fuse_reply_buf or fuse_reply_err.
+// response back to fuse with fuse_reply_data or fuse_reply_err.
 //
 void fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
                      off_t off, struct fuse_file_info *fi)
 {
+    static op_stats::counter c("read");
+    op_stats::op o(c);
 #if 1
-    std::string buf;
+    std::vector<extent_client::piece> pieces;
     // Change the above "#if 0" to "#if 1", and your code goes here
     int r;
-    if ((r = yfs->read(ino, size, off, buf)) == yfs_client::OK)
+    if ((r = yfs->read(ino, size, off, pieces, fi->fh)) == yfs_client::OK)
     {
-        fuse_reply_buf(req, buf.data(), buf.size());
+        // The reply points into the cached chunks themselves. When
+        // the kernel takes spliced replies they go from there to the
+        // kernel; otherwise libfuse gathers several pieces into one
+        // buffer first, so only a read within one chunk is sent as
+        // it lies.
+        size_t n = std::max(pieces.size(), (size_t)1);
+        struct fuse_bufvec *bv = (struct fuse_bufvec *)
+            malloc(sizeof(struct fuse_bufvec) + (n - 1) * sizeof(struct fuse_buf));
+        VERIFY(bv != NULL);
+        *bv = FUSE_BUFVEC_INIT(0);
+        bv->count = n;
+        size_t total = 0;
+        for (size_t i = 0; i < pieces.size(); i++)
+        {
+            bv->buf[i] = bv->buf[0];
+            bv->buf[i].mem = (void *)(pieces[i].data->data() + pieces[i].off);
+            bv->buf[i].size = pieces[i].len;
+            total += pieces[i].len;
+        }
+        o.add_bytes(total);
+        fuse_reply_data(req, bv, (enum fuse_buf_copy_flags)0);
+        free(bv);
     }
     else
     {
@@ -195,7 +384,7 @@ void fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 }
 
 //
-// Write @size bytes from @buf to file @ino, starting
+// Write the bytes in @bufv to file @ino, starting
 // at byte offset @off in the file.
 //
 // If @off + @size is greater than the current size of the
@@ -206,18 +395,37 @@ void fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 //
 // Ignore @fi.
 //
+// @bufv is either in memory or, when the kernel splices requests,
+// in a pipe; either way it is copied once, into the string that is
+// handed down to the extent client.
+//
 // @req identifies this request, and is used only to send a
-// response back to fuse with fuse_reply_buf or fuse_reply_err.
+// response back to fuse with fuse_reply_write or fuse_reply_err.
 //
-void fuseserver_write(fuse_req_t req, fuse_ino_t ino,
-                      const char *buf, size_t size, off_t off,
-                      struct fuse_file_info *fi)
+void fuseserver_write_buf(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_bufvec *bufv, off_t off,
+                          struct fuse_file_info *fi)
 {
+    static op_stats::counter c("write_buf");
+    op_stats::op o(c);
 #if 1
     // Change the above line to "#if 1", and your code goes here
+    std::string data(fuse_buf_size(bufv), '\0');
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(data.size());
+    dst.buf[0].mem = &data[0];
+    ssize_t n = fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags)0);
+    if (n < 0)
+    {
+        fuse_reply_err(req, -n);
+        return;
+    }
+    data.resize(n);
+
     int r;
-    if ((r = yfs->write(ino, size, off, buf, size)) == yfs_client::OK)
+    size_t size;
+    if ((r = yfs->write(ino, off, data, size)) == yfs_client::OK)
     {
+        o.add_bytes(size);
         fuse_reply_write(req, size);
     }
     else
@@ -229,6 +437,43 @@ void fuseserver_write(fuse_req_t req, fuse_ino_t ino,
 #endif
 }
 
+//
+// Push the writes buffered for @ino to the extent server.
+// Called on every close() of the file (flush), on the last close
+// (release), and on fsync().
+//
+void fuseserver_flush(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi)
+{
+    static op_stats::counter c("flush");
+    op_stats::op o(c);
+    if (yfs->fsync(ino) == yfs_client::OK)
+    {
+        fuse_reply_err(req, 0);
+    }
+    else
+    {
+        fuse_reply_err(req, EIO);
+    }
+}
+
+void fuseserver_release(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+    static op_stats::counter c("release");
+    op_stats::op o(c);
+    yfs->release(fi->fh);
+    fuseserver_flush(req, ino, fi);
+}
+
+void fuseserver_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                      struct fuse_file_info *fi)
+{
+    static op_stats::counter c("fsync");
+    op_stats::op o(c);
+    fuseserver_flush(req, ino, fi);
+}
+
 //
 // Create file @name in directory @parent.
 //
@@ -242,8 +487,8 @@ void fuseserver_write(fuse_req_t req, fuse_ino_t ino,
 // - Change the parent's mtime and ctime to the current time/date
 //   (this may fall naturally out of your extent server code).
 // - On success, store the inum of newly created file into @e->ino,
-//   and the new file's attribute into @e->attr. Get the file's
-//   attributes with getattr().
+//   and the new file's attribute into @e->attr. The create call returns
+//   them along with the new inum.
 //
 // @return yfs_client::OK on success, and EXIST if @name already exists.
 //
@@ -252,30 +497,33 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
                         mode_t mode, struct fuse_entry_param *e, int type)
 {
     int ret;
-    // In yfs, timeouts are always set to 0.0, and generations are always set to 0
-    e->attr_timeout = 0.0;
-    e->entry_timeout = 0.0;
+    // In yfs, generations are always set to 0
     e->generation = 0;
 
     yfs_client::inum inum;
+    extent_protocol::attr a;
     if (type == extent_protocol::T_FILE)
-        ret = yfs->create(parent, name, mode, inum);
+        ret = yfs->create(parent, name, mode, inum, a);
     else
-        ret = yfs->mkdir(parent, name, mode, inum);
+        ret = yfs->mkdir(parent, name, mode, inum, a);
     if (ret != yfs_client::OK)
         return ret;
     e->ino = inum;
-    ret = getattr(inum, e->attr);
-    return ret;
+    attr2stat(inum, a, e->attr);
+    kcache_entry(parent, name, e);
+    return yfs_client::OK;
 }
 
 void fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
                        mode_t mode, struct fuse_file_info *fi)
 {
+    static op_stats::counter c("create");
+    op_stats::op o(c);
     struct fuse_entry_param e;
     yfs_client::status ret;
     if ((ret = fuseserver_createhelper(parent, name, mode, &e, extent_protocol::T_FILE)) == yfs_client::OK)
     {
+        fi->fh = yfs->open(e.ino);
         fuse_reply_create(req, &e, fi);
         printf("OK: create returns.\n");
     }
@@ -295,6 +543,8 @@ void fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 void fuseserver_mknod(fuse_req_t req, fuse_ino_t parent,
                       const char *name, mode_t mode, dev_t rdev)
 {
+    static op_stats::counter c("mknod");
+    op_stats::op o(c);
     struct fuse_entry_param e;
     yfs_client::status ret;
     if ((ret = fuseserver_createhelper(parent, name, mode, &e, extent_protocol::T_FILE)) == yfs_client::OK)
@@ -321,10 +571,10 @@ void fuseserver_mknod(fuse_req_t req, fuse_ino_t parent,
 //
 void fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+    static op_stats::counter c("lookup");
+    op_stats::op o(c);
     struct fuse_entry_param e;
-    // In yfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
+    // In yfs, generations are always set to 0
     e.generation = 0;
     bool found = false;
 
@@ -335,6 +585,7 @@ void fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
     {
         e.ino = ino;
         getattr(ino, e.attr);
+        kcache_entry(parent, name, &e);
         fuse_reply_entry(req, &e);
     }
     else
@@ -349,15 +600,14 @@ struct dirbuf
     size_t size;
 };
 
-void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
+void dirbuf_add(fuse_req_t req, struct dirbuf *b, const char *name,
+                const struct stat *stbuf)
 {
-    struct stat stbuf;
     size_t oldsize = b->size;
-    b->size += fuse_dirent_size(strlen(name));
+    b->size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
     b->p = (char *)realloc(b->p, b->size);
-    memset(&stbuf, 0, sizeof(stbuf));
-    stbuf.st_ino = ino;
-    fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
+    fuse_add_direntry(req, b->p + oldsize, b->size - oldsize, name, stbuf,
+                      b->size);
 }
 
 #define min(x, y) ((x) < (y) ? (x) : (y))
@@ -371,45 +621,102 @@ int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
         return fuse_reply_buf(req, NULL, 0);
 }
 
+//
+// An open directory: the listing serialized for the kernel, taken
+// when the directory is read from the start. Later chunks are cut
+// from the same snapshot, so the offsets handed to the kernel stay
+// valid and a big directory is read from yfs once, not per chunk.
+//
+struct dirhandle
+{
+    pthread_mutex_t m;
+    struct dirbuf b;
+};
+
+void fuseserver_opendir(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+    static op_stats::counter c("opendir");
+    op_stats::op o(c);
+    if (!yfs->isdir(ino))
+    {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    dirhandle *dh = new dirhandle;
+    pthread_mutex_init(&dh->m, NULL);
+    memset(&dh->b, 0, sizeof(dh->b));
+    fi->fh = (uint64_t)dh;
+    fuse_reply_open(req, fi);
+}
+
+void fuseserver_releasedir(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi)
+{
+    static op_stats::counter c("releasedir");
+    op_stats::op o(c);
+    dirhandle *dh = (dirhandle *)fi->fh;
+    pthread_mutex_destroy(&dh->m);
+    free(dh->b.p);
+    delete dh;
+    fuse_reply_err(req, 0);
+}
+
 //
 // Retrieve all the file names / i-numbers pairs
-// in directory @ino. Send the reply using reply_buf_limited.
+// in directory @ino into the snapshot of @fi->fh, and send the
+// chunk at @off using reply_buf_limited.
 //
-// You can ignore @size and @off (except that you must pass
-// them to reply_buf_limited).
+// A read from offset 0 (a new listing, or rewinddir()) takes a
+// fresh snapshot; other offsets are served from the current one.
 //
-// Call dirbuf_add(&b, name, inum) for each entry in the directory.
+// Call dirbuf_add(req, &b, name, &st) for each entry in the directory;
+// the type in st lets readers skip a stat per entry.
 //
 void fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
                         off_t off, struct fuse_file_info *fi)
 {
+    static op_stats::counter c("readdir");
+    op_stats::op o(c);
     yfs_client::inum inum = ino; // req->in.h.nodeid;
-    struct dirbuf b;
+    dirhandle *dh = (dirhandle *)fi->fh;
 
     printf("fuseserver_readdir\n");
 
-    if (!yfs->isdir(inum))
+    pthread_mutex_lock(&dh->m);
+    if (off == 0)
     {
-        fuse_reply_err(req, ENOTDIR);
-        return;
-    }
-
-    memset(&b, 0, sizeof(b));
+        std::list<yfs_client::direntplus> entries;
+        if (yfs->readdirplus(inum, entries) != yfs_client::OK)
+        {
+            pthread_mutex_unlock(&dh->m);
+            fuse_reply_err(req, EIO);
+            return;
+        }
 
-    std::list<yfs_client::dirent> entries;
-    yfs->readdir(inum, entries);
-    for (std::list<yfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it)
-    {
-        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t)it->inum);
+        struct dirbuf b;
+        memset(&b, 0, sizeof(b));
+        for (std::list<yfs_client::direntplus>::iterator it = entries.begin(); it != entries.end(); ++it)
+        {
+            struct stat st;
+            attr2stat(it->inum, it->attr, st);
+            dirbuf_add(req, &b, it->name.c_str(), &st);
+        }
+        free(dh->b.p);
+        dh->b = b;
     }
 
-    reply_buf_limited(req, b.p, b.size, off, size);
-    free(b.p);
+    reply_buf_limited(req, dh->b.p, dh->b.size, off, size);
+    pthread_mutex_unlock(&dh->m);
 }
 
 void fuseserver_open(fuse_req_t req, fuse_ino_t ino,
                      struct fuse_file_info *fi)
 {
+    static op_stats::counter c("open");
+    op_stats::op o(c);
+    // fi->fh tracks the access pattern of this open file
+    fi->fh = yfs->open(ino);
     fuse_reply_open(req, fi);
 }
 
@@ -426,13 +733,9 @@ void fuseserver_open(fuse_req_t req, fuse_ino_t ino,
 void fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
                       mode_t mode)
 {
+    static op_stats::counter c("mkdir");
+    op_stats::op o(c);
     struct fuse_entry_param e;
-    // In yfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
-    e.generation = 0;
-    // Suppress compiler warning of unused e.
-    (void)e;
 
 #if 1
     // Change the above line to "#if 1", and your code goes here
@@ -466,6 +769,8 @@ void fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 //
 void fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+    static op_stats::counter c("unlink");
+    op_stats::op o(c);
     int r;
     if ((r = yfs->unlink(parent, name)) == yfs_client::OK)
     {
@@ -484,21 +789,47 @@ void fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
     }
 }
 
+void fuseserver_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       fuse_ino_t newparent, const char *newname)
+{
+    static op_stats::counter c("rename");
+    op_stats::op o(c);
+    int r;
+    if ((r = yfs->rename(parent, name, newparent, newname, true)) == yfs_client::OK)
+    {
+        fuse_reply_err(req, 0);
+    }
+    else if (r == yfs_client::NOENT)
+    {
+        fuse_reply_err(req, ENOENT);
+    }
+    else if (r == yfs_client::EXIST)
+    {
+        fuse_reply_err(req, EEXIST);
+    }
+    else
+    {
+        fuse_reply_err(req, EIO);
+    }
+}
+
 void fuseserver_symlink(fuse_req_t req, const char *dir, fuse_ino_t parent, const char *name)
 {
+    static op_stats::counter c("symlink");
+    op_stats::op o(c);
 
     struct fuse_entry_param e;
-    // In yfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
+    // In yfs, generations are always set to 0
     e.generation = 0;
 
     yfs_client::inum inum;
+    extent_protocol::attr a;
     yfs_client::status ret;
-    if ((ret = yfs->symlink(parent, dir, name, inum)) == yfs_client::OK)
+    if ((ret = yfs->symlink(parent, dir, name, inum, a)) == yfs_client::OK)
     {
         e.ino = inum;
-        getattr(inum, e.attr);
+        attr2stat(inum, a, e.attr);
+        kcache_entry(parent, name, &e);
         fuse_reply_entry(req, &e);
     }
     else
@@ -509,6 +840,8 @@ void fuseserver_symlink(fuse_req_t req, const char *dir, fuse_ino_t parent, cons
 
 void fuseserver_readlink(fuse_req_t req, fuse_ino_t ino)
 {
+    static op_stats::counter c("readlink");
+    op_stats::op o(c);
     yfs_client::status ret;
     std::string file_path;
 
@@ -522,8 +855,71 @@ void fuseserver_readlink(fuse_req_t req, fuse_ino_t ino)
     }
 }
 
-void fuseserver_statfs(fuse_req_t req)
+//
+// Clone the file, or snapshot the tree, named in the argument into
+// directory @ino; see yfs_ioctl.h. The kernel only passes on ioctls
+// whose argument size is encoded in @cmd, and copies the argument
+// into @in_buf for us.
+//
+void fuseserver_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                      struct fuse_file_info *fi, unsigned flags,
+                      const void *in_buf, size_t in_bufsz, size_t out_bufsz)
 {
+    static op_stats::counter c("ioctl");
+    op_stats::op o(c);
+    struct yfs_clone_args args;
+
+    if ((unsigned)cmd != YFS_IOC_CLONE && (unsigned)cmd != YFS_IOC_SNAPSHOT)
+    {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+    if ((flags & FUSE_IOCTL_COMPAT) || in_bufsz != sizeof(args))
+    {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    memcpy(&args, in_buf, sizeof(args));
+    args.name[sizeof(args.name) - 1] = '\0';
+    if (!yfs->isdir(ino))
+    {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    if ((unsigned)cmd == YFS_IOC_CLONE && yfs->isdir(args.src))
+    {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    yfs_client::inum inum;
+    int r;
+    if ((unsigned)cmd == YFS_IOC_CLONE)
+        r = yfs->clone(args.src, ino, args.name, inum);
+    else
+        r = yfs->snapshot(args.src, ino, args.name, inum);
+    if (r == yfs_client::OK)
+    {
+        fuse_reply_ioctl(req, 0, NULL, 0);
+    }
+    else if (r == yfs_client::EXIST)
+    {
+        fuse_reply_err(req, EEXIST);
+    }
+    else if (r == yfs_client::NOENT)
+    {
+        fuse_reply_err(req, ENOENT);
+    }
+    else
+    {
+        fuse_reply_err(req, EIO);
+    }
+}
+
+void fuseserver_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    static op_stats::counter c("statfs");
+    op_stats::op o(c);
     struct statvfs buf;
 
     printf("statfs\n");
@@ -536,19 +932,99 @@ void fuseserver_statfs(fuse_req_t req)
     fuse_reply_statfs(req, &buf);
 }
 
+// largest read and write requests the kernel is asked to send
+#define FUSE_MAX_IO (128 * 1024)
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+//
+// Ask for large writes and for requests and replies to be spliced
+// through pipes, so streaming I/O costs fewer requests and copies.
+//
+void fuseserver_init(void *userdata, struct fuse_conn_info *conn)
+{
+    conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES |
+                                   FUSE_CAP_SPLICE_READ |
+                                   FUSE_CAP_SPLICE_WRITE |
+                                   FUSE_CAP_SPLICE_MOVE);
+    // the clone ioctls are issued on directories
+    conn->want |= conn->capable & FUSE_CAP_IOCTL_DIR;
+    if (conn->max_write > FUSE_MAX_IO)
+        conn->max_write = FUSE_MAX_IO;
+}
+
 struct fuse_lowlevel_ops fuseserver_oper;
 
+// the lock client's retention statistics, next to op_stats on SIGUSR1
+static void
+dump_lock_stats(FILE *f)
+{
+    if (yfs != NULL)
+        yfs->get_lock_client()->dump_stats(f);
+}
+
+// threads that serve kernel requests, unless FUSE_THREADS says otherwise
+#define FUSE_THREADS 8
+
+struct fuse_session *fuse_se;
+
+//
+// One of the threads that read requests from the kernel and process
+// them. Every yfs_client call may wait for locks and RPCs; with a
+// pool of these, one slow request does not hold up the others.
+//
+void *
+fuseserver_worker(void *)
+{
+    // a request is read into buf unless the channel splices it into
+    // a pipe; like fuse_session_loop(), fbuf is reset for every request
+    // since fuse_session_receive_buf() rewrites mem, size and flags
+    size_t bufsize = fuse_chan_bufsize(kchan);
+    char *buf = (char *) malloc(bufsize);
+    VERIFY(buf != NULL);
+    serving_request = true;
+
+    while (!fuse_session_exited(fuse_se))
+    {
+        struct fuse_chan *ch = kchan;
+        struct fuse_buf fbuf;
+        memset(&fbuf, 0, sizeof(fbuf));
+        fbuf.mem = buf;
+        fbuf.size = bufsize;
+        int res = fuse_session_receive_buf(fuse_se, &fbuf, &ch);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0)
+        {
+            // 0 or -ENODEV once the file system is unmounted
+            if (res < 0 && res != -ENODEV)
+                fprintf(stderr, "fuse_session_receive_buf: %s\n", strerror(-res));
+            break;
+        }
+        fuse_session_process_buf(fuse_se, &fbuf, ch);
+    }
+
+    free(buf);
+    // wake up the other workers' loops too
+    fuse_session_exit(fuse_se);
+    return NULL;
+}
+
 int main(int argc, char *argv[])
 {
     char *mountpoint = 0;
     int err = -1;
-    int fd;
+    int nthreads = FUSE_THREADS;
 
     setvbuf(stdout, NULL, _IONBF, 0);
 
+    // before any thread is started, so that none of them takes it
+    op_stats::dump_on(SIGUSR1, stdout);
+    op_stats::also_dump(dump_lock_stats);
+
 #if 1
     if(argc != 4){
-        fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server> <port-lock-server>\n");
+        fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server>[,<port>...] <port-lock-server>\n");
         exit(1);
     }
 #else
@@ -559,6 +1035,12 @@ int main(int argc, char *argv[])
 #endif
     mountpoint = argv[1];
 
+    char *threads_env = getenv("FUSE_THREADS");
+    if (threads_env != NULL && atoi(threads_env) > 0)
+    {
+        nthreads = atoi(threads_env);
+    }
+
     srandom(getpid());
 
     myid = random();
@@ -566,20 +1048,28 @@ int main(int argc, char *argv[])
     yfs = new yfs_client(argv[2], argv[3]);
     // yfs = new yfs_client();
 
+    fuseserver_oper.init = fuseserver_init;
     fuseserver_oper.getattr = fuseserver_getattr;
     fuseserver_oper.statfs = fuseserver_statfs;
+    fuseserver_oper.opendir = fuseserver_opendir;
     fuseserver_oper.readdir = fuseserver_readdir;
+    fuseserver_oper.releasedir = fuseserver_releasedir;
     fuseserver_oper.lookup = fuseserver_lookup;
     fuseserver_oper.create = fuseserver_create;
     fuseserver_oper.mknod = fuseserver_mknod;
     fuseserver_oper.open = fuseserver_open;
     fuseserver_oper.read = fuseserver_read;
-    fuseserver_oper.write = fuseserver_write;
+    fuseserver_oper.write_buf = fuseserver_write_buf;
+    fuseserver_oper.flush = fuseserver_flush;
+    fuseserver_oper.release = fuseserver_release;
+    fuseserver_oper.fsync = fuseserver_fsync;
     fuseserver_oper.setattr = fuseserver_setattr;
     fuseserver_oper.unlink = fuseserver_unlink;
+    fuseserver_oper.rename = fuseserver_rename;
     fuseserver_oper.mkdir = fuseserver_mkdir;
     fuseserver_oper.symlink = fuseserver_symlink;
     fuseserver_oper.readlink = fuseserver_readlink;
+    fuseserver_oper.ioctl = fuseserver_ioctl;
 
     /** Your code here for Lab.
      * you may want to add
@@ -601,6 +1091,10 @@ int main(int argc, char *argv[])
     //fuse_argv[fuse_argc++] = "-o";
     //fuse_argv[fuse_argc++] = "allow_other";
 
+    fuse_argv[fuse_argc++] = "-o";
+    fuse_argv[fuse_argc++] = "big_writes,max_read=" XSTR(FUSE_MAX_IO)
+                             ",max_write=" XSTR(FUSE_MAX_IO);
+
     fuse_argv[fuse_argc++] = mountpoint;
     fuse_argv[fuse_argc++] = "-d";
 
@@ -616,8 +1110,8 @@ int main(int argc, char *argv[])
 
     args.allocated = 0;
 
-    fd = fuse_mount(mountpoint, &args);
-    if (fd == -1)
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch == NULL)
     {
         fprintf(stderr, "fuse_mount failed\n");
         exit(1);
@@ -633,20 +1127,33 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    struct fuse_chan *ch = fuse_kern_chan_new(fd);
-    if (ch == NULL)
-    {
-        fprintf(stderr, "fuse_kern_chan_new failed\n");
-        exit(1);
-    }
+    kchan = ch;
+    pthread_t th;
+    VERIFY(pthread_create(&th, NULL, kcache_inval_thread, NULL) == 0);
+    yfs->set_invalidate(kcache_invalidate);
 
     fuse_session_add_chan(se, ch);
-    // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-    err = fuse_session_loop(se);
+    if (nthreads == 1)
+    {
+        serving_request = true;
+        err = fuse_session_loop(se);
+    }
+    else
+    {
+        // fuse_session_loop_mt() has no bound on its threads
+        fuse_se = se;
+        std::vector<pthread_t> workers(nthreads - 1);
+        for (size_t i = 0; i < workers.size(); i++)
+            VERIFY(pthread_create(&workers[i], NULL, fuseserver_worker, NULL) == 0);
+        fuseserver_worker(NULL);
+        for (size_t i = 0; i < workers.size(); i++)
+            pthread_join(workers[i], NULL);
+        err = 0;
+    }
 
+    fuse_session_remove_chan(ch);
     fuse_session_destroy(se);
-    close(fd);
-    fuse_unmount(mountpoint);
+    fuse_unmount(mountpoint, ch);
 
     return err ? 1 : 0;
 }
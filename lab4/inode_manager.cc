@@ -12,7 +12,7 @@ disk::disk()
 
 void disk::read_block(blockid_t id, char *buf)
 {
-  if ((id <= 0) || (id > BLOCK_NUM))
+  if ((id <= 0) || (id >= BLOCK_NUM))
   {
     printf("read block id out of range!\n");
     return;
@@ -30,7 +30,7 @@ void disk::read_block(blockid_t id, char *buf)
 void disk::write_block(blockid_t id, const char *buf)
 {
 
-  if ((id <= 0) || (id > BLOCK_NUM))
+  if ((id <= 0) || (id >= BLOCK_NUM))
   {
     printf("write block id out of range!\n");
     return;
@@ -66,6 +66,9 @@ block_manager::alloc_block()
 
     for (int bitmap_index = 0; bitmap_index < BPB; bitmap_index++)
     {
+      // the bitmap block has more bits than the disk has blocks
+      if ((block_id - BBLOCK(1)) * BPB + bitmap_index + 1 >= BLOCK_NUM)
+        break;
       char bitmap_byte = bitmap_buf[bitmap_index / 8];
       char freebit = bitmap_byte & ((char)1 << (7 - (bitmap_index % 8)));
 
@@ -89,12 +92,23 @@ void block_manager::free_block(uint32_t id)
    * note: you should unmark the corresponding bit in the block bitmap when free.
    */
   char bitmap_buf[BLOCK_SIZE];
-  if (id <= 0 || id > BLOCK_NUM)
+  if (id <= 0 || id >= BLOCK_NUM)
   {
     printf("free block id out of range!\n");
     return;
   }
   pthread_mutex_lock(&block_mutex);
+  std::map<uint32_t, int>::iterator ref = using_blocks.find(id);
+  if (ref != using_blocks.end())
+  {
+    // still used by another clone, just drop one reference
+    if (--ref->second <= 1)
+    {
+      using_blocks.erase(ref);
+    }
+    pthread_mutex_unlock(&block_mutex);
+    return;
+  }
   blockid_t block_id = BBLOCK(id);
 
   read_block(block_id, bitmap_buf);
@@ -109,6 +123,34 @@ void block_manager::free_block(uint32_t id)
   return;
 }
 
+void block_manager::ref_block(uint32_t id)
+{
+  if (id <= 0 || id >= BLOCK_NUM)
+  {
+    printf("ref block id out of range!\n");
+    return;
+  }
+  pthread_mutex_lock(&block_mutex);
+  std::map<uint32_t, int>::iterator ref = using_blocks.find(id);
+  if (ref == using_blocks.end())
+  {
+    using_blocks[id] = 2;
+  }
+  else
+  {
+    ref->second++;
+  }
+  pthread_mutex_unlock(&block_mutex);
+}
+
+bool block_manager::is_shared(uint32_t id)
+{
+  pthread_mutex_lock(&block_mutex);
+  bool shared = using_blocks.count(id) != 0;
+  pthread_mutex_unlock(&block_mutex);
+  return shared;
+}
+
 // The layout of disk should be like this:
 // |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
 block_manager::block_manager()
@@ -297,6 +339,54 @@ void inode_manager::put_inode(uint32_t inum, struct inode *ino)
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+/* Return a block the caller may overwrite in place: bid itself if
+ * it is not shared, otherwise a private copy of it, in which case
+ * the reference to the shared block is dropped. */
+blockid_t
+inode_manager::cow_block(blockid_t bid)
+{
+  char buf[BLOCK_SIZE];
+
+  if (!bm->is_shared(bid))
+    return bid;
+
+  blockid_t new_bid = bm->alloc_block();
+  bm->read_block(bid, buf);
+  bm->write_block(new_bid, buf);
+  bm->free_block(bid);
+  return new_bid;
+}
+
+/* Copy-on-write the first block_num data blocks of ino.
+ * Indirect blocks are never shared, see clone_inode(). */
+void inode_manager::unshare_blocks(struct inode *ino, int block_num)
+{
+  for (int i = 0; i < MIN(block_num, NDIRECT); i++)
+  {
+    ino->blocks[i] = cow_block(ino->blocks[i]);
+  }
+
+  if (block_num > NDIRECT)
+  {
+    blockid_t indirect_blocks[BLOCK_SIZE / sizeof(blockid_t)];
+    bool changed = false;
+    bm->read_block(ino->blocks[NDIRECT], (char *)indirect_blocks);
+    for (int i = 0; i < block_num - NDIRECT; i++)
+    {
+      blockid_t bid = cow_block(indirect_blocks[i]);
+      if (bid != indirect_blocks[i])
+      {
+        indirect_blocks[i] = bid;
+        changed = true;
+      }
+    }
+    if (changed)
+    {
+      bm->write_block(ino->blocks[NDIRECT], (char *)indirect_blocks);
+    }
+  }
+}
+
 /* Get all the data of a file by inum. 
  * Return alloced data, should be freed by caller. */
 void inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
@@ -401,6 +491,9 @@ void inode_manager::write_file(uint32_t inum, const char *buf, int size)
   int prev_block_num = (ino->size - 1 + BLOCK_SIZE) / BLOCK_SIZE;
   int next_block_num = (size - 1 + BLOCK_SIZE) / BLOCK_SIZE;
 
+  // blocks shared with a clone must not be overwritten in place
+  unshare_blocks(ino, MIN(prev_block_num, next_block_num));
+
   // new file is smaller or the same size
   if (next_block_num <= prev_block_num)
   {
@@ -557,6 +650,144 @@ void inode_manager::write_file(uint32_t inum, const char *buf, int size)
   return;
 }
 
+/* Write size bytes at offset off, growing the file if needed.
+ * Unlike write_file, only the blocks covering the range are
+ * read and written. Holes are filled with '\0'. */
+void inode_manager::write_range(uint32_t inum, uint32_t off, const char *buf, int size)
+{
+  char block_buf[BLOCK_SIZE];
+  if (size < 0 || (uint64_t)off + size > MAXFILE * BLOCK_SIZE)
+  {
+    printf("write range size error\n");
+    return;
+  }
+
+  if (buf == NULL)
+  {
+    printf("write range buf is NULL\n");
+    return;
+  }
+
+  struct inode *ino = get_inode(inum);
+  if (ino == NULL)
+  {
+    printf("write range inode null\n");
+    return;
+  }
+
+  uint32_t end = off + size;
+  uint32_t new_size = (size > 0 && end > ino->size) ? end : ino->size;
+  int prev_block_num = (ino->size - 1 + BLOCK_SIZE) / BLOCK_SIZE;
+  int next_block_num = (new_size - 1 + BLOCK_SIZE) / BLOCK_SIZE;
+
+  blockid_t indirect_blocks[BLOCK_SIZE / sizeof(blockid_t)];
+  if (prev_block_num > NDIRECT)
+  {
+    bm->read_block(ino->blocks[NDIRECT], (char *)indirect_blocks);
+  }
+  else if (next_block_num > NDIRECT)
+  {
+    ino->blocks[NDIRECT] = bm->alloc_block();
+    bzero(indirect_blocks, sizeof(indirect_blocks));
+  }
+
+  // the bytes past the old end of the last block may be stale
+  if (new_size > ino->size && ino->size % BLOCK_SIZE != 0)
+  {
+    int last = prev_block_num - 1;
+    blockid_t *slot = last < NDIRECT ? &ino->blocks[last] : &indirect_blocks[last - NDIRECT];
+    *slot = cow_block(*slot);
+    bm->read_block(*slot, block_buf);
+    bzero(block_buf + ino->size % BLOCK_SIZE, BLOCK_SIZE - ino->size % BLOCK_SIZE);
+    bm->write_block(*slot, block_buf);
+  }
+
+  bzero(block_buf, sizeof(block_buf));
+  for (int i = prev_block_num; i < next_block_num; i++)
+  {
+    blockid_t *slot = i < NDIRECT ? &ino->blocks[i] : &indirect_blocks[i - NDIRECT];
+    *slot = bm->alloc_block();
+    bm->write_block(*slot, block_buf);
+  }
+
+  for (uint32_t i = off / BLOCK_SIZE; size > 0 && i <= (end - 1) / BLOCK_SIZE; i++)
+  {
+    blockid_t *slot = i < NDIRECT ? &ino->blocks[i] : &indirect_blocks[i - NDIRECT];
+    uint32_t block_start = i * BLOCK_SIZE;
+    uint32_t from = off > block_start ? off - block_start : 0;
+    uint32_t to = end < block_start + BLOCK_SIZE ? end - block_start : BLOCK_SIZE;
+
+    *slot = cow_block(*slot);
+    if (from != 0 || to != BLOCK_SIZE)
+    {
+      bm->read_block(*slot, block_buf);
+    }
+    memcpy(block_buf + from, buf + block_start + from - off, to - from);
+    bm->write_block(*slot, block_buf);
+  }
+
+  if (next_block_num > NDIRECT)
+  {
+    bm->write_block(ino->blocks[NDIRECT], (char *)indirect_blocks);
+  }
+
+  ino->size = new_size;
+  ino->mtime = (unsigned int)time(NULL);
+  put_inode(inum, ino);
+  free(ino);
+}
+
+/* Read at most size bytes starting at offset off. Only the blocks
+ * covering the range are read; *size_out is 0 past the end. */
+void inode_manager::read_range(uint32_t inum, uint32_t off, int size, char **buf_out, int *size_out)
+{
+  char buf[BLOCK_SIZE];
+  if (buf_out == NULL || size_out == NULL)
+  {
+    printf("read range buf out is NULL\n");
+    return;
+  }
+  *size_out = 0;
+
+  struct inode *ino = get_inode(inum);
+  if (ino == NULL)
+  {
+    printf("read range inode null\n");
+    return;
+  }
+
+  if (size <= 0 || off >= ino->size)
+  {
+    free(ino);
+    return;
+  }
+
+  uint32_t end = MIN((uint64_t)off + size, (uint64_t)ino->size);
+  *buf_out = (char *)malloc(end - off);
+  *size_out = end - off;
+
+  blockid_t indirect_blocks[BLOCK_SIZE / sizeof(blockid_t)];
+  if ((end - 1) / BLOCK_SIZE >= NDIRECT)
+  {
+    bm->read_block(ino->blocks[NDIRECT], (char *)indirect_blocks);
+  }
+
+  for (uint32_t i = off / BLOCK_SIZE; i <= (end - 1) / BLOCK_SIZE; i++)
+  {
+    blockid_t read_block_id = i < NDIRECT ? ino->blocks[i] : indirect_blocks[i - NDIRECT];
+    uint32_t block_start = i * BLOCK_SIZE;
+    uint32_t from = off > block_start ? off - block_start : 0;
+    uint32_t to = end < block_start + BLOCK_SIZE ? end - block_start : BLOCK_SIZE;
+
+    bm->read_block(read_block_id, buf);
+    memcpy(*buf_out + block_start + from - off, buf + from, to - from);
+  }
+
+  ino->atime = (unsigned int)time(NULL);
+  put_inode(inum, ino);
+  free(ino);
+}
+
 void inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
 {
   /*
@@ -625,6 +856,7 @@ void inode_manager::remove_file(uint32_t inum)
     {
       bm->free_block(indirect_blocks[i]);
     }
+    bm->free_block(ino->blocks[NDIRECT]);
   }
 
   free_inode(inum);
@@ -633,6 +865,48 @@ void inode_manager::remove_file(uint32_t inum)
   return;
 }
 
+/* Create a new inode with the same type, attributes and content
+ * as inum. Data blocks are shared and only copied when one of the
+ * two inodes overwrites them, so the cost is O(number of blocks)
+ * in metadata and no data. Return the new inum, 0 on failure. */
+uint32_t
+inode_manager::clone_inode(uint32_t inum)
+{
+  struct inode *ino = get_inode(inum);
+  if (ino == NULL)
+  {
+    printf("clone inode null\n");
+    return 0;
+  }
+
+  uint32_t new_inum = alloc_inode(ino->type);
+  int block_num = (ino->size - 1 + BLOCK_SIZE) / BLOCK_SIZE;
+
+  for (int i = 0; i < MIN(block_num, NDIRECT); i++)
+  {
+    bm->ref_block(ino->blocks[i]);
+  }
+
+  if (block_num > NDIRECT)
+  {
+    // the clone gets its own copy of the indirect block, so that
+    // freeing either inode only drops references to the data blocks
+    blockid_t indirect_blocks[BLOCK_SIZE / sizeof(blockid_t)];
+    bm->read_block(ino->blocks[NDIRECT], (char *)indirect_blocks);
+    for (int i = 0; i < block_num - NDIRECT; i++)
+    {
+      bm->ref_block(indirect_blocks[i]);
+    }
+    ino->blocks[NDIRECT] = bm->alloc_block();
+    bm->write_block(ino->blocks[NDIRECT], (char *)indirect_blocks);
+  }
+
+  put_inode(new_inum, ino);
+  free(ino);
+
+  return new_inum;
+}
+
 void inode_manager::append_block(uint32_t inum, blockid_t &bid)
 {
   /*
@@ -659,6 +933,11 @@ void inode_manager::append_block(uint32_t inum, blockid_t &bid)
     {
       ino->blocks[NDIRECT] = bm->alloc_block();
     }
+    else
+    {
+      // a clone must not see the new entry
+      ino->blocks[NDIRECT] = cow_block(ino->blocks[NDIRECT]);
+    }
 
     blockid_t indirect_blocks[BLOCK_SIZE / sizeof(blockid_t)];
     bm->read_block(ino->blocks[NDIRECT], (char *)indirect_blocks);
@@ -668,6 +947,7 @@ void inode_manager::append_block(uint32_t inum, blockid_t &bid)
 
   ino->size = ino->size + BLOCK_SIZE;
   put_inode(inum, ino);
+  free(ino);
 }
 
 void inode_manager::get_block_ids(uint32_t inum, std::list<blockid_t> &block_ids)
@@ -709,12 +989,22 @@ void inode_manager::read_block(blockid_t id, char buf[BLOCK_SIZE])
   bm->read_block(id, buf);
 }
 
-void inode_manager::write_block(blockid_t id, const char buf[BLOCK_SIZE])
+/* Overwrite block id in place. A block shared by clones cannot be
+ * copied on write here, since only the inodes know where they refer
+ * to it; writing it would change every clone, so false is returned
+ * instead. Blocks handed out by append_block() are never shared. */
+bool inode_manager::write_block(blockid_t id, const char buf[BLOCK_SIZE])
 {
   /*
    * your code goes here.
    */
+  if (bm->is_shared(id))
+  {
+    printf("write_block %u is shared\n", id);
+    return false;
+  }
   bm->write_block(id, buf);
+  return true;
 }
 
 void inode_manager::complete(uint32_t inum, uint32_t size)
@@ -33,6 +33,8 @@ typedef struct superblock {
 class block_manager {
  private:
   disk *d;
+  // reference counts of blocks shared between cloned inodes,
+  // a block that is not in the map has exactly one owner.
   std::map <uint32_t, int> using_blocks;
   pthread_mutex_t block_mutex;
  public:
@@ -41,6 +43,8 @@ class block_manager {
 
   uint32_t alloc_block();
   void free_block(uint32_t id);
+  void ref_block(uint32_t id);
+  bool is_shared(uint32_t id);
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
 };
@@ -80,6 +84,8 @@ class inode_manager {
   block_manager *bm;
   struct inode* get_inode(uint32_t inum);
   void put_inode(uint32_t inum, struct inode *ino);
+  blockid_t cow_block(blockid_t bid);
+  void unshare_blocks(struct inode *ino, int block_num);
   pthread_mutex_t inode_mutex;
  public:
   inode_manager();
@@ -87,12 +93,15 @@ class inode_manager {
   void free_inode(uint32_t inum);
   void read_file(uint32_t inum, char **buf, int *size);
   void write_file(uint32_t inum, const char *buf, int size);
+  void write_range(uint32_t inum, uint32_t off, const char *buf, int size);
+  void read_range(uint32_t inum, uint32_t off, int size, char **buf, int *size_out);
   void remove_file(uint32_t inum);
+  uint32_t clone_inode(uint32_t inum);
   void getattr(uint32_t inum, extent_protocol::attr &a);
   void append_block(uint32_t inum, blockid_t &bid);
   void get_block_ids(uint32_t inum, std::list<blockid_t> &block_ids);
   void read_block(blockid_t bid, char block[BLOCK_SIZE]);
-  void write_block(blockid_t bid, const char block[BLOCK_SIZE]);
+  bool write_block(blockid_t bid, const char block[BLOCK_SIZE]);
   void complete(uint32_t inum, uint32_t size);
 };
 
@@ -8,11 +8,24 @@
 #include <stdio.h>
 #include "tprintf.h"
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
 
-#define RVOKEMAX_ACQUIRE 1
+#define LEASE_US (lock_protocol::lease_ms * 1000ULL)
 
 int lock_client_cache::last_port = 0;
 
+static unsigned long long
+now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 lock_client_cache::lock_client_cache(std::string xdst,
                                      class lock_release_user *_lu)
     : lock_client(xdst), lu(_lu)
@@ -37,13 +50,90 @@ lock_client_cache::lock_client_cache(std::string xdst,
   rlsrpc->reg(rlock_protocol::retry, this, &lock_client_cache::retry_handler);
 
   pthread_mutex_init(&mutex, NULL);
+
+  retain_grants = RETAIN_GRANTS;
+  retain_us = RETAIN_US;
+  char *env = getenv("LOCK_RETAIN_GRANTS");
+  if (env != NULL && atoi(env) >= 0)
+    retain_grants = atoi(env);
+  env = getenv("LOCK_RETAIN_US");
+  if (env != NULL && atoi(env) >= 0)
+    retain_us = atoi(env);
+  cache_locks = CACHE_LOCKS;
+  cache_idle_us = CACHE_IDLE_US;
+  env = getenv("LOCK_CACHE_LOCKS");
+  if (env != NULL && atoi(env) >= 0)
+    cache_locks = atoi(env);
+  env = getenv("LOCK_CACHE_IDLE_US");
+  if (env != NULL && atoi(env) >= 0)
+    cache_idle_us = atoi(env);
+  memset(&stats, 0, sizeof(stats));
+  next_renew = 0;
+  lease_until = 0;
+  lease_epoch = 0;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&due_cond, &attr);
+  pthread_cond_init(&renew_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_t th;
+  VERIFY(pthread_create(&th, NULL, &lock_client_cache::releaser, this) == 0);
+  VERIFY(pthread_create(&th, NULL, &lock_client_cache::renewer, this) == 0);
+}
+
+void
+lock_client_cache::set_retention(int grants, unsigned long long us)
+{
+  pthread_mutex_lock(&mutex);
+  retain_grants = grants;
+  retain_us = us;
+  pthread_mutex_unlock(&mutex);
+}
+
+void
+lock_client_cache::set_cache(size_t locks, unsigned long long idle_us)
+{
+  pthread_mutex_lock(&mutex);
+  cache_locks = locks;
+  cache_idle_us = idle_us;
+  pthread_cond_signal(&due_cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+// Whether a local thread may take the lock in mode now. A lock from
+// a lease that has run out is not used at all. Under a revoke that
+// mode would break, only retain_grants such grants are made, and
+// none once half a lease has passed since the revoke, so that the
+// client that asked does not wait long; later comers wait for the
+// lock to come back from the server.
+bool
+lock_client_cache::may_grant(lock_info *li, int mode)
+{
+  if (!leased(li))
+    return false;
+  if (li->revoke_to >= li->granted || mode <= li->revoke_to)
+    return true;
+  if (li->retained >= retain_grants ||
+      now_us() >= li->revoked_at + LEASE_US / 2)
+    return false;
+  li->retained++;
+  stats.retained++;
+  return true;
 }
 
 lock_protocol::status
 lock_client_cache::acquire(lock_protocol::lockid_t lid)
+{
+  return acquire(lid, lock_protocol::EXCLUSIVE);
+}
+
+lock_protocol::status
+lock_client_cache::acquire(lock_protocol::lockid_t lid, int mode)
 {
   int ret = lock_protocol::OK;
-  int r;
+  lock_protocol::fence_t fence;
   pthread_mutex_lock(&mutex);
 
   if (lock_map.count(lid) == 0)
@@ -53,128 +143,372 @@ lock_client_cache::acquire(lock_protocol::lockid_t lid)
 
   lock_info *li = &lock_map[lid];
   li->acquire_num++;
-  while (li->st == LOCKED || li->st == ACQUIRING || li->st == RELEASING)
+  if (mode == lock_protocol::EXCLUSIVE)
+    li->xwaiting++;
+
+  for (;;)
   {
+    if (!li->releasing && li->wanted == lock_protocol::NONE)
+    {
+      // readers do not overtake a waiting writer
+      if (mode == lock_protocol::SHARED && li->granted >= lock_protocol::SHARED &&
+          !li->writer && li->xwaiting == 0 && may_grant(li, mode))
+      {
+        li->readers++;
+        clear_idle(li);
+        break;
+      }
+      if (mode == lock_protocol::EXCLUSIVE && li->granted == lock_protocol::EXCLUSIVE &&
+          !li->writer && li->readers == 0 && may_grant(li, mode))
+      {
+        li->writer = true;
+        clear_idle(li);
+        break;
+      }
+
+      // the server must grant more than we have; an upgrade waits
+      // until no local thread uses the shared lock
+      if (li->granted < mode && li->readers == 0 && !li->writer)
+      {
+        li->wanted = mode;
+        li->retry = false;
+
+        unsigned long long sent = now_us();
+        pthread_mutex_unlock(&mutex);
+        ret = cl->call(lock_protocol::acquire, lid, id, mode, fence);
+        pthread_mutex_lock(&mutex);
+        if (ret == lock_protocol::OK || ret == lock_protocol::RETRY)
+          renewed(sent);
+        // otherwise the token comes with the retry
+        if (ret == lock_protocol::OK)
+          li->fence = fence;
+
+        if (ret == lock_protocol::RETRY)
+        {
+          if (li->granted != lock_protocol::NONE)
+          {
+            // the server dropped our shared lock to queue the upgrade
+            li->granted = lock_protocol::NONE;
+            pthread_mutex_unlock(&mutex);
+            if (lu)
+              lu->dorelease(lid);
+            pthread_mutex_lock(&mutex);
+          }
+          while (!li->retry)
+          {
+            pthread_cond_wait(&li->retry_mutex, &mutex);
+          }
+          ret = lock_protocol::OK;
+        }
+        // the thread that fetched the lock gets to use it, even if
+        // a revoke has overtaken the grant
+        if (ret == lock_protocol::OK)
+          take(li, mode);
+        li->wanted = lock_protocol::NONE;
+        pthread_cond_broadcast(&li->local_wait_mutex);
+        break;
+      }
+    }
     pthread_cond_wait(&li->local_wait_mutex, &mutex);
   }
 
-  if (li->st == FREE)
-  {
-    li->st = LOCKED;
-    li->acquire_num--;
-    pthread_mutex_unlock(&mutex);
-    return ret;
-  }
+  li->acquire_num--;
+  if (mode == lock_protocol::EXCLUSIVE)
+    li->xwaiting--;
+  if (ret != lock_protocol::OK)
+    set_idle(lid, li);
+  pthread_mutex_unlock(&mutex);
+  return ret;
+}
+
+// Whether only the server can give us li in mode, and nobody here
+// is using it or already asking for it.
+bool
+lock_client_cache::needs_server(lock_info *li, int mode)
+{
+  return !li->releasing && li->wanted == lock_protocol::NONE &&
+         li->granted < mode && li->readers == 0 && !li->writer;
+}
+
+// The server has granted mode; the calling thread holds the lock.
+void
+lock_client_cache::take(lock_info *li, int mode)
+{
+  li->granted = mode;
+  li->epoch = lease_epoch;
+  if (mode == lock_protocol::SHARED)
+    li->readers++;
+  else
+    li->writer = true;
+  clear_idle(li);
+}
+
+lock_protocol::status
+lock_client_cache::acquire_many(std::vector<lock_protocol::lockid_t> lids,
+                                int mode)
+{
+  int ret = lock_protocol::OK;
+  size_t held = 0;
+
+  std::sort(lids.begin(), lids.end());
+  lids.erase(std::unique(lids.begin(), lids.end()), lids.end());
 
-  if (li->st == NONE)
+  pthread_mutex_lock(&mutex);
+  while (held < lids.size() && ret == lock_protocol::OK)
   {
-    li->st = ACQUIRING;
-    li->retry = false;
-    
+    // the run of locks from here on that only the server can give
+    std::vector<lock_protocol::lockid_t> batch;
+    for (size_t j = held; j < lids.size(); j++)
+    {
+      if (!needs_server(&lock_map[lids[j]], mode))
+        break;
+      batch.push_back(lids[j]);
+    }
+
+    // a lock we have, or must wait for here: acquire does that
+    if (batch.size() < 2)
+    {
+      pthread_mutex_unlock(&mutex);
+      ret = acquire(lids[held], mode);
+      pthread_mutex_lock(&mutex);
+      if (ret == lock_protocol::OK)
+        held++;
+      continue;
+    }
+
+    for (size_t j = 0; j < batch.size(); j++)
+    {
+      lock_info *li = &lock_map[batch[j]];
+      li->wanted = mode;
+      li->retry = false;
+      li->acquire_num++;
+      if (mode == lock_protocol::EXCLUSIVE)
+        li->xwaiting++;
+    }
+
+    std::vector<lock_protocol::fence_t> fences;
+    unsigned long long sent = now_us();
     pthread_mutex_unlock(&mutex);
-    ret = cl->call(lock_protocol::acquire, lid, id, r);
+    ret = cl->call(lock_protocol::acquire_many, batch, id, mode, fences);
     pthread_mutex_lock(&mutex);
+    int r = 0;
+    if (ret == lock_protocol::OK || ret == lock_protocol::RETRY)
+    {
+      renewed(sent);
+      r = std::min(fences.size(), batch.size());
+    }
 
-    if (ret == lock_protocol::OK)
+    // the locks past the one queued for are given up before waiting,
+    // so that we wait holding only locks below it
+    for (size_t j = 0; j < batch.size(); j++)
     {
-      li->st = LOCKED;
-      //li->retry = false;
+      lock_info *li = &lock_map[batch[j]];
+      if ((int)j == r && ret == lock_protocol::RETRY)
+        continue;
+      if ((int)j < r)
+      {
+        li->fence = fences[j];
+        take(li, mode);
+        held++;
+      }
+      li->wanted = lock_protocol::NONE;
+      li->acquire_num--;
+      if (mode == lock_protocol::EXCLUSIVE)
+        li->xwaiting--;
+      pthread_cond_broadcast(&li->local_wait_mutex);
+      release_idle(batch[j], li);
+      set_idle(batch[j], li);
     }
-    else
+    if (ret == lock_protocol::RETRY)
     {
-      while (!li->retry)
+      lock_info *li = &lock_map[batch[r]];
+      // queued at the server, as in acquire
+      if (li->granted != lock_protocol::NONE)
       {
-        pthread_cond_wait(&li->retry_mutex, &mutex);
+        li->granted = lock_protocol::NONE;
+        pthread_mutex_unlock(&mutex);
+        if (lu)
+          lu->dorelease(batch[r]);
+        pthread_mutex_lock(&mutex);
       }
-      li->st = LOCKED;
+      while (!li->retry)
+        pthread_cond_wait(&li->retry_mutex, &mutex);
+      take(li, mode);
+      held++;
+      li->wanted = lock_protocol::NONE;
+      li->acquire_num--;
+      if (mode == lock_protocol::EXCLUSIVE)
+        li->xwaiting--;
+      pthread_cond_broadcast(&li->local_wait_mutex);
     }
+    if (ret == lock_protocol::RETRY)
+      ret = lock_protocol::OK;
   }
-  
-  li->acquire_num--;
   pthread_mutex_unlock(&mutex);
+
+  if (ret != lock_protocol::OK)
+  {
+    for (size_t j = 0; j < held; j++)
+      release(lids[j]);
+  }
   return ret;
 }
 
+// Carry out a pending revoke once the retention policy lets go of
+// the lock: local waiters get it first, up to retain_grants of them,
+// and an idle lock is kept for retain_us after its last use, by
+// handing it to the releaser thread. Called with mutex held; drops
+// it while talking to the server, so a revoke that comes in
+// meanwhile is carried out by the next round.
+void
+lock_client_cache::release_idle(lock_protocol::lockid_t lid, lock_info *li)
+{
+  int r;
+
+  for (;;)
+  {
+    if (li->granted == lock_protocol::NONE && li->wanted == lock_protocol::NONE)
+      li->revoke_to = lock_protocol::EXCLUSIVE; // stale
+    if (li->revoke_to >= li->granted || li->wanted != lock_protocol::NONE ||
+        li->releasing || li->writer)
+      return;
+    // readers may go on through a downgrade
+    if (li->revoke_to == lock_protocol::NONE && li->readers > 0)
+      return;
+
+    // nobody may use a lock whose lease has run out, so it goes back
+    // at once
+    bool expired = !leased(li);
+    int waiting = li->revoke_to == lock_protocol::NONE ?
+                  li->acquire_num : li->xwaiting;
+    if (waiting > 0 && li->retained < retain_grants && !expired)
+      return;
+    unsigned long long now = now_us();
+    unsigned long long hold = std::min(li->last_use + retain_us,
+                                       li->revoked_at + LEASE_US / 2);
+    if (waiting > 0)
+    {
+      stats.capped++;
+    }
+    else if (now < hold && !expired)
+    {
+      due.insert(std::make_pair(hold, lid));
+      pthread_cond_signal(&due_cond);
+      stats.delayed++;
+      return;
+    }
+    stats.releases++;
+    stats.hold_us += now - li->revoked_at;
+
+    int keep = li->revoke_to;
+    li->releasing = true;
+    li->downgrading = keep == lock_protocol::SHARED;
+    li->revoke_to = lock_protocol::EXCLUSIVE;
+    pthread_mutex_unlock(&mutex);
+
+    if (lu)
+    {
+      if (keep == lock_protocol::NONE)
+        lu->dorelease(lid);
+      else
+        lu->dodowngrade(lid);
+    }
+    cl->call(lock_protocol::release, lid, id, keep, r);
+
+    pthread_mutex_lock(&mutex);
+    li->granted = keep;
+    if (keep == lock_protocol::NONE)
+    {
+      clear_idle(li);
+      dropped.push_back(lid);
+    }
+    li->retained = 0;
+    li->releasing = false;
+    li->downgrading = false;
+    pthread_cond_broadcast(&li->local_wait_mutex);
+  }
+}
+
 lock_protocol::status
 lock_client_cache::release(lock_protocol::lockid_t lid)
 {
   int ret = lock_protocol::OK;
-  int r;
 
+  pthread_mutex_lock(&mutex);
   if (lock_map.count(lid) == 0)
   {
     tprintf("client: no lock %llu exists\n", lid);
+    pthread_mutex_unlock(&mutex);
     return lock_protocol::NOENT;
   }
 
-  pthread_mutex_lock(&mutex);
-  
   lock_info *li = &lock_map[lid];
-
-  if (li->revoked && li->acquire_num < RVOKEMAX_ACQUIRE)
+  if (li->writer)
+    li->writer = false;
+  else if (li->readers > 0)
+    li->readers--;
+  else
   {
-    li->st = RELEASING;
-    li->revoked = false;
-    
+    tprintf("client: lock %llu is not held\n", lid);
     pthread_mutex_unlock(&mutex);
-
-    ret = cl->call(lock_protocol::release, lid, id, r);
-
-    pthread_mutex_lock(&mutex);
-    
-    li->st = NONE;
-    pthread_cond_signal(&li->local_wait_mutex);
+    return lock_protocol::NOENT;
   }
-  else
+
+  li->last_use = now_us();
+  if (!leased(li))
   {
-    li->st = FREE;
-    pthread_cond_signal(&li->local_wait_mutex);
+    tprintf("client: lock %llu held past its lease\n", lid);
+    stats.overruns++;
   }
-
+  release_idle(lid, li);
+  pthread_cond_broadcast(&li->local_wait_mutex);
+  set_idle(lid, li);
   pthread_mutex_unlock(&mutex);
   return ret;
 }
 
 rlock_protocol::status
-lock_client_cache::revoke_handler(lock_protocol::lockid_t lid,
+lock_client_cache::revoke_handler(lock_protocol::lockid_t lid, int mode,
                                   int &)
 {
-  usleep(50000);
   int ret = rlock_protocol::OK;
-  int r;
   pthread_mutex_lock(&mutex);
-  lock_info *li = &lock_map[lid];
-
-  if (li->st == FREE)
+  stats.revokes++;
+  std::map<lock_protocol::lockid_t, lock_info>::iterator it = lock_map.find(lid);
+  if (it == lock_map.end())
   {
-    li->st = RELEASING;
-    
+    // given back meanwhile
     pthread_mutex_unlock(&mutex);
-    ret = cl->call(lock_protocol::release, lid, id, r);
-    pthread_mutex_lock(&mutex);
-    
-    li->st = NONE;
-    pthread_cond_signal(&li->local_wait_mutex);
+    return ret;
   }
-  else
+  lock_info *li = &it->second;
+  if (mode < li->revoke_to)
   {
-    li->revoked = true;
+    if (li->revoke_to == lock_protocol::EXCLUSIVE)
+    {
+      li->retained = 0;
+      li->revoked_at = now_us();
+    }
+    li->revoke_to = mode;
   }
+  release_idle(lid, li);
+  set_idle(lid, li);
   pthread_mutex_unlock(&mutex);
   return ret;
 }
 
 rlock_protocol::status
 lock_client_cache::retry_handler(lock_protocol::lockid_t lid,
-                                 int &)
+                                 lock_protocol::fence_t fence, int &)
 {
   int ret = rlock_protocol::OK;
+  pthread_mutex_lock(&mutex);
   if (lock_map.count(lid) == 0)
   {
     tprintf("client: no lock %llu exists\n", lid);
+    pthread_mutex_unlock(&mutex);
     return rlock_protocol::OK;
   }
-  pthread_mutex_lock(&mutex);
   if (lock_map[lid].retry)
   {
     tprintf("client: %s aleady recevie retry request\n", id.c_str());
@@ -182,8 +516,320 @@ lock_client_cache::retry_handler(lock_protocol::lockid_t lid,
     return rlock_protocol::OK;
   }
   lock_map[lid].retry = true;
+  lock_map[lid].fence = fence;
   pthread_cond_signal(&lock_map[lid].retry_mutex);
   pthread_mutex_unlock(&mutex);
   return ret;
 }
 
+// Whether this client currently owns lid in some mode, held locally
+// or not. Data protected by lid may be cached while this is true;
+// it may only be modified under an EXCLUSIVE lock. A downgrade keeps
+// the cache, since readers may still be using it.
+bool
+lock_client_cache::is_cached(lock_protocol::lockid_t lid)
+{
+  pthread_mutex_lock(&mutex);
+  std::map<lock_protocol::lockid_t, lock_info>::iterator it = lock_map.find(lid);
+  bool cached = it != lock_map.end() &&
+                it->second.granted != lock_protocol::NONE &&
+                (!it->second.releasing || it->second.downgrading);
+  pthread_mutex_unlock(&mutex);
+  return cached;
+}
+
+// Whether lid was granted to us in a lease that has run out since,
+// or was revoked half a lease ago or more. The server may have handed
+// it to another client, so nothing must be written under it any more.
+bool
+lock_client_cache::lapsed(lock_protocol::lockid_t lid)
+{
+  pthread_mutex_lock(&mutex);
+  std::map<lock_protocol::lockid_t, lock_info>::iterator it = lock_map.find(lid);
+  bool l = false;
+  if (it != lock_map.end() && it->second.granted != lock_protocol::NONE)
+  {
+    lock_info *li = &it->second;
+    l = !leased(li) || (li->revoke_to < li->granted &&
+                        now_us() >= li->revoked_at + LEASE_US / 2);
+  }
+  pthread_mutex_unlock(&mutex);
+  return l;
+}
+
+// The token of our grant of lid, for the writes made under it; 0 if
+// we do not hold lid.
+lock_protocol::fence_t
+lock_client_cache::fence(lock_protocol::lockid_t lid)
+{
+  pthread_mutex_lock(&mutex);
+  std::map<lock_protocol::lockid_t, lock_info>::iterator it = lock_map.find(lid);
+  lock_protocol::fence_t f = 0;
+  if (it != lock_map.end() && it->second.granted != lock_protocol::NONE)
+    f = it->second.fence;
+  pthread_mutex_unlock(&mutex);
+  return f;
+}
+
+// Whether li was granted in the current lease, which still runs.
+bool
+lock_client_cache::leased(const lock_info *li)
+{
+  return li->epoch == lease_epoch && now_us() < lease_until;
+}
+
+// The server extended our leases at sent or later. If the reply
+// comes in after they ran out, the server may have taken our locks
+// in between, and the new lease does not cover them.
+void
+lock_client_cache::renewed(unsigned long long sent)
+{
+  if (lease_until != 0 && now_us() >= lease_until)
+    lapse();
+  if (sent + LEASE_US > lease_until)
+    lease_until = sent + LEASE_US;
+}
+
+// Our leases ran out at lease_until, after which the server may give
+// any lock we have been asked for to another client. Start a new
+// epoch, so that the locks granted in the old one are used no more,
+// and have the releaser give them all back as if revoked; those
+// still held go back once released. Called with mutex held.
+void
+lock_client_cache::lapse()
+{
+  unsigned long long now = now_us();
+  std::map<lock_protocol::lockid_t, lock_info>::iterator it;
+
+  lease_epoch++;
+  for (it = lock_map.begin(); it != lock_map.end(); it++)
+  {
+    lock_info *li = &it->second;
+    // an acquire in flight takes the lock in the new epoch
+    if (li->granted == lock_protocol::NONE ||
+        li->wanted != lock_protocol::NONE)
+      continue;
+    tprintf("client: lease on lock %llu lapsed\n", it->first);
+    if (li->revoke_to == lock_protocol::EXCLUSIVE)
+      li->retained = 0;
+    li->revoke_to = lock_protocol::NONE;
+    li->revoked_at = lease_until - LEASE_US;
+    due.insert(std::make_pair(now, it->first));
+  }
+  lease_until = 0;
+  pthread_cond_signal(&due_cond);
+}
+
+// Renew the leases on all our locks in one call. Should that fail
+// until they run out, the server may take the locks away, so give
+// them up. Called with mutex held; drops it meanwhile.
+void
+lock_client_cache::renew_leases()
+{
+  int r;
+  unsigned long long sent = now_us();
+
+  next_renew = sent + LEASE_US / 4;
+  pthread_mutex_unlock(&mutex);
+  int ret = cl->call(lock_protocol::renew, id, r,
+                     rpcc::to(lock_protocol::lease_ms / 4));
+  pthread_mutex_lock(&mutex);
+  if (ret == lock_protocol::OK)
+    renewed(sent);
+  else if (lease_until != 0 && now_us() >= lease_until)
+    lapse();
+}
+
+// Whether a local thread uses li, waits for it or is changing it.
+bool
+lock_client_cache::busy(const lock_info *li)
+{
+  return li->readers > 0 || li->writer || li->acquire_num > 0 ||
+         li->wanted != lock_protocol::NONE || li->releasing;
+}
+
+// Put lid in idle_locks if it is cached and unused.
+void
+lock_client_cache::set_idle(lock_protocol::lockid_t lid, lock_info *li)
+{
+  if (li->idle || li->granted == lock_protocol::NONE || busy(li))
+    return;
+  idle_locks.push_front(lid);
+  li->lru = idle_locks.begin();
+  li->idle = true;
+  if (idle_locks.size() > cache_locks)
+    pthread_cond_signal(&due_cond);
+}
+
+void
+lock_client_cache::clear_idle(lock_info *li)
+{
+  if (!li->idle)
+    return;
+  idle_locks.erase(li->lru);
+  li->idle = false;
+}
+
+// Whether idle_locks has more than cache_locks, or a lock idle for
+// cache_idle_us.
+bool
+lock_client_cache::must_trim(unsigned long long now)
+{
+  if (idle_locks.empty())
+    return false;
+  return idle_locks.size() > cache_locks ||
+         lock_map[idle_locks.back()].last_use + cache_idle_us <= now;
+}
+
+// Give back the least recently used idle locks, as many as must_trim
+// wants, in one call. Called with mutex held; drops it meanwhile.
+void
+lock_client_cache::trim()
+{
+  int r;
+  unsigned long long now = now_us();
+  std::vector<lock_protocol::lockid_t> batch;
+
+  // a lock found in use after all is only taken off the list; it is
+  // put back once idle
+  while (must_trim(now))
+  {
+    lock_protocol::lockid_t lid = idle_locks.back();
+    lock_info *li = &lock_map[lid];
+    clear_idle(li);
+    if (li->granted == lock_protocol::NONE || busy(li))
+      continue;
+    li->releasing = true;
+    batch.push_back(lid);
+  }
+  if (batch.empty())
+    return;
+
+  pthread_mutex_unlock(&mutex);
+  for (size_t i = 0; i < batch.size(); i++)
+  {
+    if (lu)
+      lu->dorelease(batch[i]);
+  }
+  cl->call(lock_protocol::release_many, batch, id, r);
+  pthread_mutex_lock(&mutex);
+
+  for (size_t i = 0; i < batch.size(); i++)
+  {
+    lock_info *li = &lock_map[batch[i]];
+    li->granted = lock_protocol::NONE;
+    li->releasing = false;
+    li->revoke_to = lock_protocol::EXCLUSIVE;
+    li->retained = 0;
+    pthread_cond_broadcast(&li->local_wait_mutex);
+    dropped.push_back(batch[i]);
+  }
+  stats.dropped += batch.size();
+}
+
+// Erase the entries of dropped locks that nothing refers to. Only
+// the releaser thread erases, and never while it holds a lock_info.
+void
+lock_client_cache::collect()
+{
+  for (size_t i = 0; i < dropped.size(); i++)
+  {
+    std::map<lock_protocol::lockid_t, lock_info>::iterator it =
+        lock_map.find(dropped[i]);
+    if (it != lock_map.end() && !it->second.idle &&
+        it->second.granted == lock_protocol::NONE && !busy(&it->second))
+      lock_map.erase(it);
+  }
+  dropped.clear();
+}
+
+// Give back the idle locks whose retention or cache time is up.
+void *
+lock_client_cache::releaser(void *arg)
+{
+  lock_client_cache *lc = (lock_client_cache *)arg;
+
+  pthread_mutex_lock(&lc->mutex);
+  for (;;)
+  {
+    unsigned long long now = now_us();
+    if (!lc->dropped.empty())
+      lc->collect();
+    if (!lc->due.empty() && lc->due.begin()->first <= now)
+    {
+      std::pair<unsigned long long, lock_protocol::lockid_t> first =
+          *lc->due.begin();
+      lc->due.erase(lc->due.begin());
+      std::map<lock_protocol::lockid_t, lock_info>::iterator it =
+          lc->lock_map.find(first.second);
+      if (it != lc->lock_map.end())
+      {
+        lc->release_idle(first.second, &it->second);
+        lc->set_idle(first.second, &it->second);
+      }
+      continue;
+    }
+    if (lc->must_trim(now))
+    {
+      lc->trim();
+      continue;
+    }
+
+    // look again now and then for locks that have gone idle
+    unsigned long long wake = now + LEASE_US / 4;
+    if (!lc->due.empty() && lc->due.begin()->first < wake)
+      wake = lc->due.begin()->first;
+    if (!lc->idle_locks.empty())
+      wake = std::min(wake, lc->lock_map[lc->idle_locks.back()].last_use +
+                            lc->cache_idle_us);
+    struct timespec ts;
+    ts.tv_sec = wake / 1000000;
+    ts.tv_nsec = (wake % 1000000) * 1000;
+    pthread_cond_timedwait(&lc->due_cond, &lc->mutex, &ts);
+  }
+  return NULL;
+}
+
+// Keep the leases renewed, every LEASE_US / 4.
+void *
+lock_client_cache::renewer(void *arg)
+{
+  lock_client_cache *lc = (lock_client_cache *)arg;
+
+  pthread_mutex_lock(&lc->mutex);
+  for (;;)
+  {
+    if (now_us() >= lc->next_renew)
+    {
+      lc->renew_leases();
+      continue;
+    }
+    struct timespec ts;
+    ts.tv_sec = lc->next_renew / 1000000;
+    ts.tv_nsec = (lc->next_renew % 1000000) * 1000;
+    pthread_cond_timedwait(&lc->renew_cond, &lc->mutex, &ts);
+  }
+  return NULL;
+}
+
+lock_client_cache::retention_stats
+lock_client_cache::get_stats()
+{
+  pthread_mutex_lock(&mutex);
+  retention_stats st = stats;
+  pthread_mutex_unlock(&mutex);
+  return st;
+}
+
+void
+lock_client_cache::dump_stats(FILE *f)
+{
+  retention_stats st = get_stats();
+  fprintf(f, "lock_client: revokes %llu releases %llu retained %llu "
+          "capped %llu delayed %llu avg_hold_us %llu overruns %llu "
+          "dropped %llu\n",
+          st.revokes, st.releases, st.retained, st.capped, st.delayed,
+          st.releases ? st.hold_us / st.releases : 0, st.overruns,
+          st.dropped);
+  fflush(f);
+}
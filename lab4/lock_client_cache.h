@@ -5,6 +5,10 @@
 #define lock_client_cache_h
 
 #include <string>
+#include <set>
+#include <list>
+#include <vector>
+#include <stdio.h>
 #include "lock_protocol.h"
 #include "rpc.h"
 #include "lock_client.h"
@@ -12,40 +16,89 @@
 
 // Classes that inherit lock_release_user can override dorelease so that
 // that they will be called when lock_client releases a lock.
-// You will not need to do anything with this class until Lab 6.
+// dorelease runs before the lock is handed back to the server, while
+// no local thread holds it, so it can flush state cached under the lock.
+// dodowngrade runs instead when an EXCLUSIVE lock goes down to SHARED;
+// the cached state stays valid but must be written back.
 class lock_release_user
 {
 public:
   virtual void dorelease(lock_protocol::lockid_t) = 0;
+  virtual void dodowngrade(lock_protocol::lockid_t lid) { dorelease(lid); }
   virtual ~lock_release_user(){};
 };
 
+// How long a client hangs on to a lock the server wants back. Once
+// a revoke arrives, up to retain_grants more local acquires that the
+// revoke would forbid are let through, and an idle lock is kept until
+// retain_us have passed since its last local release. The defaults
+// can be overridden by LOCK_RETAIN_GRANTS and LOCK_RETAIN_US.
+#define RETAIN_GRANTS 8
+#define RETAIN_US 1000
+
+// How many idle locks a client caches. Locks unused for cache_idle_us,
+// and the least recently used ones past cache_locks, are given back
+// to the server unasked, so that the next client to want them need
+// not revoke them. The defaults can be overridden by LOCK_CACHE_LOCKS
+// and LOCK_CACHE_IDLE_US.
+#define CACHE_LOCKS 1024
+#define CACHE_IDLE_US 2000000
+
 class lock_client_cache : public lock_client
 {
-private:
-  enum State
+public:
+  struct retention_stats
   {
-    NONE,
-    FREE,
-    LOCKED,
-    ACQUIRING,
-    RELEASING
+    unsigned long long revokes;     // revokes received
+    unsigned long long releases;    // locks given back, NONE or SHARED
+    unsigned long long retained;    // local grants made under a revoke
+    unsigned long long capped;      // releases with local waiters left
+    unsigned long long delayed;     // releases put off by retain_us
+    unsigned long long hold_us;     // revoke to release, summed
+    unsigned long long overruns;    // locks released after their lease
+    unsigned long long dropped;     // idle locks given back unasked
   };
 
+private:
+  // granted is the mode the server has given this client. Local
+  // threads share it: any number of readers, or one writer if it is
+  // EXCLUSIVE. wanted is the mode of an outstanding acquire, during
+  // which nothing is sent back to the server; a revoke that comes in
+  // meanwhile, or while the lock is held, is kept in revoke_to and
+  // carried out once the lock is idle. retained counts the local
+  // grants made since the revoke came in at revoked_at; last_use is
+  // the last local release. epoch is the lease the lock was granted
+  // in, fence the token of the grant. A lock cached and unused since
+  // is idle, at lru in idle_locks.
   struct lock_info
   {
-    State st;
-    bool revoked;
+    int granted;
+    int wanted;
+    int revoke_to;
+    bool releasing;
+    bool downgrading;
     bool retry;
+    int readers;
+    bool writer;
     int acquire_num;
+    int xwaiting;
+    int retained;
+    unsigned long long revoked_at;
+    unsigned long long last_use;
+    unsigned int epoch;
+    lock_protocol::fence_t fence;
+    bool idle;
+    std::list<lock_protocol::lockid_t>::iterator lru;
 
     pthread_cond_t retry_mutex;
-    pthread_cond_t revoke_mutex;
     pthread_cond_t local_wait_mutex;
-    lock_info() : st(NONE), revoked(false), retry(false), acquire_num(0)
+    lock_info() : granted(lock_protocol::NONE), wanted(lock_protocol::NONE),
+                  revoke_to(lock_protocol::EXCLUSIVE), releasing(false),
+                  downgrading(false), retry(false), readers(0), writer(false), acquire_num(0),
+                  xwaiting(0), retained(0), revoked_at(0), last_use(0),
+                  epoch(0), fence(0), idle(false)
     {
       pthread_cond_init(&retry_mutex, NULL);
-      pthread_cond_init(&revoke_mutex, NULL);
       pthread_cond_init(&local_wait_mutex, NULL);
     }
   };
@@ -56,16 +109,69 @@ private:
   pthread_mutex_t mutex;
   std::map<lock_protocol::lockid_t, lock_info> lock_map;
 
+  int retain_grants;
+  unsigned long long retain_us;
+  retention_stats stats;
+  // idle locks to give back once retain_us is up, by due time; the
+  // releaser thread waits on due_cond for the earliest. The renewer
+  // thread renews the leases on all locks at next_renew, so that
+  // giving locks back, however many, never holds that up. The leases
+  // last until lease_until as far as we know, 0 if they have run
+  // out; each time they do, lease_epoch moves on.
+  std::set<std::pair<unsigned long long, lock_protocol::lockid_t> > due;
+  pthread_cond_t due_cond;
+  pthread_cond_t renew_cond;
+  unsigned long long next_renew;
+  unsigned long long lease_until;
+  unsigned int lease_epoch;
+  // idle locks, most recently used first; dropped lists the locks
+  // given back lately, whose entries the releaser thread erases from
+  // lock_map if nothing refers to them any more
+  size_t cache_locks;
+  unsigned long long cache_idle_us;
+  std::list<lock_protocol::lockid_t> idle_locks;
+  std::vector<lock_protocol::lockid_t> dropped;
+
+  void release_idle(lock_protocol::lockid_t, lock_info *);
+  bool may_grant(lock_info *, int mode);
+  bool needs_server(lock_info *, int mode);
+  void take(lock_info *, int mode);
+  bool leased(const lock_info *);
+  void renewed(unsigned long long sent);
+  void lapse();
+  void renew_leases();
+  static bool busy(const lock_info *);
+  void set_idle(lock_protocol::lockid_t, lock_info *);
+  void clear_idle(lock_info *);
+  bool must_trim(unsigned long long now);
+  void trim();
+  void collect();
+  static void *releaser(void *);
+  static void *renewer(void *);
+
 public:
   static int last_port;
   lock_client_cache(std::string xdst, class lock_release_user *l = 0);
   virtual ~lock_client_cache(){};
   lock_protocol::status acquire(lock_protocol::lockid_t);
+  // mode is SHARED or EXCLUSIVE; the caller must not already hold lid
+  lock_protocol::status acquire(lock_protocol::lockid_t, int mode);
+  // Acquire all of lids in mode, in lid order, asking the server for
+  // as many of them as it can in one call. On error none are held.
+  lock_protocol::status acquire_many(std::vector<lock_protocol::lockid_t> lids,
+                                     int mode = lock_protocol::EXCLUSIVE);
   lock_protocol::status release(lock_protocol::lockid_t);
-  rlock_protocol::status revoke_handler(lock_protocol::lockid_t,
+  rlock_protocol::status revoke_handler(lock_protocol::lockid_t, int,
                                         int &);
   rlock_protocol::status retry_handler(lock_protocol::lockid_t,
-                                       int &);
+                                       lock_protocol::fence_t, int &);
+  bool is_cached(lock_protocol::lockid_t);
+  bool lapsed(lock_protocol::lockid_t);
+  lock_protocol::fence_t fence(lock_protocol::lockid_t);
+  void set_retention(int grants, unsigned long long us);
+  void set_cache(size_t locks, unsigned long long idle_us);
+  retention_stats get_stats();
+  void dump_stats(FILE *);
 };
 
 #endif
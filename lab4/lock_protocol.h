@@ -10,13 +10,62 @@ class lock_protocol {
   enum xxstatus { OK, RETRY, RPCERR, NOENT, IOERR };
   typedef int status;
   typedef unsigned long long lockid_t;
+  // fencing token of a grant, see below; 0 is no grant
+  typedef unsigned long long fence_t;
+  // A lock is held by one client in EXCLUSIVE mode or by any number
+  // of clients in SHARED mode. Modes are ordered: holding a mode
+  // allows everything the lower ones do.
+  enum mode {
+    NONE = 0,
+    SHARED,
+    EXCLUSIVE
+  };
   enum rpc_numbers {
     acquire = 0x7001,
     release,
-    stat
+    stat,
+    renew,
+    acquire_many,
+    release_many
   };
+  // how long a client's grants stand after its last acquire or renew
+  enum { lease_ms = 3000 };
 };
 
+// acquire(lid, id, mode) grants mode, replying with the fencing
+// token of the grant, or answers RETRY, in which case the server
+// sends retry with the token once it has granted the mode; a client
+// that asks for EXCLUSIVE while holding SHARED gives up SHARED when
+// it gets RETRY. revoke(lid, mode) asks a holder to go down to mode:
+// NONE to hand the lock back, SHARED to downgrade. release(lid, id,
+// mode) does so.
+//
+// acquire_many(lids, id, mode) acquires lids, sorted and without
+// duplicates, in that order: it stops at the first lock it cannot
+// grant at once and answers RETRY for it, as acquire would, replying
+// with the tokens of the locks granted before it. A client holding
+// some of a set of locks thus only waits for a lock above all those
+// it holds. release_many(lids, id) gives back lids that nobody asked
+// for, all to NONE.
+//
+// Grants are leased. renew(id) extends all of a client's leases at
+// once; a client renews well within lease_ms. Once its lease is up,
+// the server takes a lock the holder has been asked for away from it
+// without asking, and so it does one lease after the first revoke,
+// renewed or not, so that no holder keeps a lock others wait for for
+// longer. The client counts its lease from when it sent the call that
+// last extended it, so it ends no later than the server's; past that
+// end, or half a lease after a revoke came in, and until it has given
+// back every lock it held then, the client writes nothing under those
+// locks.
+//
+// Every grant carries a fencing token, larger than that of any
+// earlier grant of the lock, also across restarts of the server as
+// long as it grants fewer than a million locks a second. Clients
+// send it along with their writes, and the extent server refuses a
+// write with a smaller token than one it has seen for the extent, so
+// that a holder that has lost its lock without noticing cannot write
+// over its successor.
 class rlock_protocol {
 public:
     enum xxstatus { OK, RPCERR };
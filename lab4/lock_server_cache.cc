@@ -1,166 +1,710 @@
 // the caching lock server implementation
 
 #include "lock_server_cache.h"
+#include <algorithm>
 #include <sstream>
 #include <stdio.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <time.h>
 #include "lang/verify.h"
 #include "handle.h"
 #include "tprintf.h"
 
+// slots a shard starts with
+#define SHARD_SLOTS 16
+
+#define LEASE_US (lock_protocol::lease_ms * 1000ULL)
+// how long a sender waits for a client to take a revoke or retry
+#define DELIVER_MS (lock_protocol::lease_ms / 4)
+
+static unsigned long long
+now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 lock_server_cache::lock_server_cache() : nacquire(0)
 {
-  pthread_mutex_init(&mutex, NULL);
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  lock_protocol::fence_t fence = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+  for (int i = 0; i < (1 << LOCK_SHARD_BITS); i++)
+  {
+    pthread_mutex_init(&shards[i].mutex, NULL);
+    slot empty = { 0, NULL };
+    shards[i].slots.assign(SHARD_SLOTS, empty);
+    shards[i].used = 0;
+    shards[i].free_waiters = NULL;
+    shards[i].free_infos = NULL;
+    shards[i].next_fence = fence;
+  }
+  pthread_rwlock_init(&clients_lock, NULL);
+  pthread_mutex_init(&outbox_mutex, NULL);
+  pthread_cond_init(&outbox_cond, NULL);
+  outbox.assign(SHARD_SLOTS, NULL);
+  outbox_used = 0;
+  ready_head = ready_tail = NULL;
+  free_mailboxes = NULL;
+  free_mail = NULL;
+  for (int i = 0; i < LOCK_SENDERS; i++)
+  {
+    pthread_t th;
+    VERIFY(pthread_create(&th, NULL, sender_thread, this) == 0);
+  }
+
+  pthread_mutex_init(&leases_mutex, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&leases_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_t th;
+  VERIFY(pthread_create(&th, NULL, lease_thread, this) == 0);
+}
+
+// Lock ids are inums, mostly small and sequential; mix them so that
+// both the shard (top bits) and the slot (low bits) are spread out.
+uint64_t lock_server_cache::lock_hash(lock_protocol::lockid_t lid)
+{
+  uint64_t h = lid;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+lock_server_cache::shard &lock_server_cache::shard_of(lock_protocol::lockid_t lid)
+{
+  return shards[lock_hash(lid) >> (64 - LOCK_SHARD_BITS)];
 }
 
-bool inWaitingQueue(std::queue<std::string> waiting_queue, std::string id)
+// The lock_info of lid in shard sh, which the caller has locked.
+// Missing ones are added if create is set, and NULL otherwise.
+lock_server_cache::lock_info *
+lock_server_cache::find(shard &sh, lock_protocol::lockid_t lid, bool create)
 {
-  while (!waiting_queue.empty())
+  size_t mask = sh.slots.size() - 1;
+  for (size_t i = lock_hash(lid) & mask;; i = (i + 1) & mask)
   {
-    if (waiting_queue.front() == id)
+    slot &s = sh.slots[i];
+    if (s.li != NULL && s.lid == lid)
+      return s.li;
+    if (s.li == NULL)
     {
-      return true;
+      if (!create)
+        return NULL;
+      if ((sh.used + 1) * 2 > sh.slots.size())
+      {
+        grow(sh);
+        return find(sh, lid, create);
+      }
+      s.lid = lid;
+      s.li = sh.free_infos;
+      if (s.li != NULL)
+        sh.free_infos = s.li->next_free;
+      else
+        s.li = new lock_info;
+      s.li->fence = 0;
+      sh.used++;
+      return s.li;
     }
-    waiting_queue.pop();
   }
+}
+
+// Double the slots of sh and place every lock again.
+void lock_server_cache::grow(shard &sh)
+{
+  slot empty = { 0, NULL };
+  std::vector<slot> old(sh.slots.size() * 2, empty);
+  old.swap(sh.slots);
+  size_t mask = sh.slots.size() - 1;
+  for (size_t j = 0; j < old.size(); j++)
+  {
+    if (old[j].li == NULL)
+      continue;
+    size_t i = lock_hash(old[j].lid) & mask;
+    while (sh.slots[i].li != NULL)
+      i = (i + 1) & mask;
+    sh.slots[i] = old[j];
+  }
+}
+
+// Drop lid from sh, which the caller has locked, if the lock is idle.
+// Its lock_info, all of whose clients are clear then, is kept for
+// reuse.
+void lock_server_cache::reap(shard &sh, lock_protocol::lockid_t lid)
+{
+  size_t mask = sh.slots.size() - 1;
+  size_t i = lock_hash(lid) & mask;
+  while (sh.slots[i].li != NULL && sh.slots[i].lid != lid)
+    i = (i + 1) & mask;
+  lock_info *li = sh.slots[i].li;
+  if (li == NULL || li->writer != NOBODY || li->nreaders > 0 ||
+      li->head != NULL || li->nrevoked > 0)
+    return;
+  li->next_free = sh.free_infos;
+  sh.free_infos = li;
+  sh.used--;
+
+  // Close the hole: a later lock in the run moves into it unless it
+  // would then sit before its home slot, where probing starts.
+  for (size_t j = (i + 1) & mask; sh.slots[j].li != NULL; j = (j + 1) & mask)
+  {
+    size_t home = lock_hash(sh.slots[j].lid) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask))
+    {
+      sh.slots[i] = sh.slots[j];
+      i = j;
+    }
+  }
+  sh.slots[i].li = NULL;
+}
+
+lock_server_cache::client_t lock_server_cache::intern(const std::string &id)
+{
+  pthread_rwlock_rdlock(&clients_lock);
+  std::unordered_map<std::string, client_t>::iterator it = client_ids.find(id);
+  if (it != client_ids.end())
+  {
+    client_t c = it->second;
+    pthread_rwlock_unlock(&clients_lock);
+    return c;
+  }
+  pthread_rwlock_unlock(&clients_lock);
+
+  pthread_rwlock_wrlock(&clients_lock);
+  std::pair<std::unordered_map<std::string, client_t>::iterator, bool> ins =
+      client_ids.insert(std::make_pair(id, (client_t)client_names.size()));
+  if (ins.second)
+    client_names.push_back(id);
+  client_t c = ins.first->second;
+  pthread_rwlock_unlock(&clients_lock);
+  return c;
+}
+
+std::string lock_server_cache::client_name(client_t c)
+{
+  pthread_rwlock_rdlock(&clients_lock);
+  std::string id = client_names[c];
+  pthread_rwlock_unlock(&clients_lock);
+  return id;
+}
+
+bool lock_server_cache::is_reader(const lock_info &li, client_t c)
+{
+  return (size_t)c < li.readers.size() && li.readers[c];
+}
+
+void lock_server_cache::set_reader(lock_info &li, client_t c, bool reader)
+{
+  if (is_reader(li, c) == reader)
+    return;
+  if ((size_t)c >= li.readers.size())
+    li.readers.resize(c + 1, false);
+  li.readers[c] = reader;
+  if (reader)
+    li.nreaders++;
+  else
+    li.nreaders--;
+}
+
+bool lock_server_cache::is_waiting(const lock_info &li, client_t c)
+{
+  return (size_t)c < li.waiting.size() && li.waiting[c];
+}
+
+bool lock_server_cache::is_revoked(const lock_info &li, client_t c)
+{
+  return (size_t)c < li.revoked.size() && li.revoked[c] != 0;
+}
+
+// Record that holder c has been asked to go down to mode, by deadline.
+void lock_server_cache::set_revoked(lock_info &li, client_t c,
+                                    unsigned long long deadline, int mode)
+{
+  if ((size_t)c >= li.revoked.size())
+  {
+    li.revoked.resize(c + 1, 0);
+    li.revoked_none.resize(c + 1, false);
+  }
+  if (li.revoked[c] == 0)
+    li.nrevoked++;
+  li.revoked[c] = deadline;
+  li.revoked_none[c] = mode == lock_protocol::NONE;
+}
 
+void lock_server_cache::clear_revoked(lock_info &li, client_t c)
+{
+  if (!is_revoked(li, c))
+    return;
+  li.revoked[c] = 0;
+  li.nrevoked--;
+}
+
+void lock_server_cache::enqueue(shard &sh, lock_info &li, client_t c, int mode)
+{
+  waiter *w = sh.free_waiters;
+  if (w != NULL)
+    sh.free_waiters = w->next;
+  else
+    w = new waiter;
+  w->client = c;
+  w->mode = mode;
+  w->next = NULL;
+  if (li.tail != NULL)
+    li.tail->next = w;
+  else
+    li.head = w;
+  li.tail = w;
+  if ((size_t)c >= li.waiting.size())
+    li.waiting.resize(c + 1, false);
+  li.waiting[c] = true;
+}
+
+void lock_server_cache::dequeue(shard &sh, lock_info &li)
+{
+  waiter *w = li.head;
+  li.head = w->next;
+  if (li.head == NULL)
+    li.tail = NULL;
+  li.waiting[w->client] = false;
+  w->next = sh.free_waiters;
+  sh.free_waiters = w;
+}
+
+// Make client c a holder of li in mode and return the token of the
+// grant.
+lock_protocol::fence_t lock_server_cache::grant(shard &sh, lock_info &li,
+                                                client_t c, int mode)
+{
+  if (mode == lock_protocol::EXCLUSIVE)
+    li.writer = c;
+  else
+    set_reader(li, c, true);
+  clear_revoked(li, c);
+  li.fence = ++sh.next_fence;
+  return li.fence;
+}
+
+// Grant the head of the queue for as long as it fits with the holders.
+void lock_server_cache::grant_waiters(shard &sh, lock_info &li, msgbuf &out)
+{
+  while (li.head != NULL)
+  {
+    waiter *w = li.head;
+    if (li.writer != NOBODY)
+      break;
+    if (w->mode == lock_protocol::EXCLUSIVE && li.nreaders > 0)
+      break;
+    message m = { w->client, rlock_protocol::retry, 0,
+                  grant(sh, li, w->client, w->mode) };
+    out.push(m);
+    dequeue(sh, li);
+  }
+}
+
+// Ask holder c to go down to keep, unless it has been asked to
+// already; it has one lease from the first ask to comply. A holder
+// whose lease is already up is not asked but stripped; returns
+// whether it was.
+bool lock_server_cache::revoke_holder(lock_protocol::lockid_t lid,
+                                      lock_info &li, client_t c, int keep,
+                                      unsigned long long now, msgbuf &out)
+{
+  unsigned long long lease = lease_of(c);
+  if (lease <= now)
+  {
+    tprintf("server: lease of client %d on lock %llu is up\n", c, lid);
+    strip(li, c, keep);
+    return true;
+  }
+  if (is_revoked(li, c) &&
+      (li.revoked_none[c] || keep == lock_protocol::SHARED))
+    return false;
+  set_revoked(li, c, is_revoked(li, c) ? li.revoked[c] : now + LEASE_US, keep);
+  message m = { c, rlock_protocol::revoke, keep, 0 };
+  out.push(m);
+  // in case the client is gone and the revoke never gets through
+  watch(lid, c, lease);
   return false;
 }
 
-int lock_server_cache::acquire(lock_protocol::lockid_t lid, std::string id,
-                               int &)
+// Ask the holders in the way of the head of the queue to step down:
+// a writer to SHARED if the head only reads, everybody to NONE if it
+// writes. Returns whether any holder was stripped, since the queue
+// may then move.
+bool lock_server_cache::revoke_holders(lock_protocol::lockid_t lid,
+                                       lock_info &li, msgbuf &out)
 {
-  lock_protocol::status ret = lock_protocol::OK;
-  pthread_mutex_lock(&mutex);
-  if (lock_admin.count(lid) == 0)
+  if (li.head == NULL)
+    return false;
+  int keep = li.head->mode == lock_protocol::SHARED ?
+             lock_protocol::SHARED : lock_protocol::NONE;
+
+  bool stripped = false;
+  unsigned long long now = now_us();
+  if (keep == lock_protocol::NONE)
   {
-    lock_admin[lid] = lock_info();
+    // stripping a reader only clears its own bit
+    for (client_t c = 0; c < (client_t)li.readers.size(); c++)
+    {
+      if (li.readers[c] && revoke_holder(lid, li, c, keep, now, out))
+        stripped = true;
+    }
   }
+  if (li.writer != NOBODY && revoke_holder(lid, li, li.writer, keep, now, out))
+    stripped = true;
+  return stripped;
+}
 
-  lock_info *li = &lock_admin[lid];
+// Move the queue as far as it goes.
+void lock_server_cache::settle(shard &sh, lock_protocol::lockid_t lid,
+                               lock_info &li, msgbuf &out)
+{
+  do
+    grant_waiters(sh, li, out);
+  while (revoke_holders(lid, li, out));
+}
+
+// Pairs of lock and client, mixed for the outbox table.
+uint64_t lock_server_cache::dest_hash(lock_protocol::lockid_t lid, client_t c)
+{
+  return lock_hash(lid ^ ((uint64_t)c * 0x9e3779b97f4a7c15ULL));
+}
 
-  //tprintf("server: lock owner: %s\n", li->owner.c_str());
-  //tprintf("server: %s call for aquire\n", id.c_str());
-  if (li->is_hold)
+// The mailbox of client c for lid, a new one if there is none.
+// Called with outbox_mutex held.
+lock_server_cache::mailbox *
+lock_server_cache::mailbox_of(lock_protocol::lockid_t lid, client_t c)
+{
+  size_t mask = outbox.size() - 1;
+  for (size_t i = dest_hash(lid, c) & mask;; i = (i + 1) & mask)
   {
-    if (li->owner == id)
+    mailbox *mb = outbox[i];
+    if (mb != NULL && mb->lid == lid && mb->client == c)
+      return mb;
+    if (mb == NULL)
     {
-      tprintf("server: client %s had alread get the lock\n", id.c_str());
-      pthread_mutex_unlock(&mutex);
-      return lock_protocol::OK;
+      if ((outbox_used + 1) * 2 > outbox.size())
+      {
+        grow_outbox();
+        return mailbox_of(lid, c);
+      }
+      mb = free_mailboxes;
+      if (mb != NULL)
+        free_mailboxes = mb->next_ready;
+      else
+        mb = new mailbox;
+      mb->lid = lid;
+      mb->client = c;
+      mb->head = mb->tail = NULL;
+      mb->next_ready = NULL;
+      outbox[i] = mb;
+      outbox_used++;
+      return mb;
     }
+  }
+}
+
+// Double the outbox table, as grow() does a shard.
+void lock_server_cache::grow_outbox()
+{
+  std::vector<mailbox *> old(outbox.size() * 2, (mailbox *)NULL);
+  old.swap(outbox);
+  size_t mask = outbox.size() - 1;
+  for (size_t j = 0; j < old.size(); j++)
+  {
+    if (old[j] == NULL)
+      continue;
+    size_t i = dest_hash(old[j]->lid, old[j]->client) & mask;
+    while (outbox[i] != NULL)
+      i = (i + 1) & mask;
+    outbox[i] = old[j];
+  }
+}
 
-    if (inWaitingQueue(li->waiting_queue, id))
+// Take the empty mailbox mb out of the table, closing the hole as
+// reap() does, and keep it for reuse. Called with outbox_mutex held.
+void lock_server_cache::drop_mailbox(mailbox *mb)
+{
+  size_t mask = outbox.size() - 1;
+  size_t i = dest_hash(mb->lid, mb->client) & mask;
+  while (outbox[i] != mb)
+    i = (i + 1) & mask;
+  outbox_used--;
+  for (size_t j = (i + 1) & mask; outbox[j] != NULL; j = (j + 1) & mask)
+  {
+    size_t home = dest_hash(outbox[j]->lid, outbox[j]->client) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask))
     {
-      tprintf("server: client %s is already in waiting queue\n", id.c_str());
-      pthread_mutex_unlock(&mutex);
-      return lock_protocol::RETRY;
+      outbox[i] = outbox[j];
+      i = j;
     }
-    int r;
-    std::string revoke_cl;
-    if (li->waiting_queue.empty())
+  }
+  outbox[i] = NULL;
+  mb->next_ready = free_mailboxes;
+  free_mailboxes = mb;
+}
+
+// Queue mb for a sender. Called with outbox_mutex held.
+void lock_server_cache::make_ready(mailbox *mb)
+{
+  mb->next_ready = NULL;
+  if (ready_tail != NULL)
+    ready_tail->next_ready = mb;
+  else
+    ready_head = mb;
+  ready_tail = mb;
+  pthread_cond_signal(&outbox_cond);
+}
+
+// Put msgs in the outbox. Grants go out before revokes, so that a
+// client is not asked to give back a lock it has not been told
+// about yet, if it can help it. A mailbox that has mail is either
+// ready or being worked on, with the message in delivery still at
+// its head.
+void lock_server_cache::send(lock_protocol::lockid_t lid, const msgbuf &msgs)
+{
+  if (msgs.size() == 0)
+    return;
+  pthread_mutex_lock(&outbox_mutex);
+  for (size_t i = 0; i < msgs.size(); i++)
+  {
+    mailbox *mb = mailbox_of(lid, msgs[i].client);
+    mail *ml = free_mail;
+    if (ml != NULL)
+      free_mail = ml->next;
+    else
+      ml = new mail;
+    ml->m = msgs[i];
+    ml->next = NULL;
+    if (mb->tail != NULL)
     {
-      revoke_cl = li->owner;
+      mb->tail->next = ml;
     }
     else
     {
-      revoke_cl = li->waiting_queue.back();
+      mb->head = ml;
+      make_ready(mb);
     }
+    mb->tail = ml;
+  }
+  pthread_mutex_unlock(&outbox_mutex);
+}
 
-    li->waiting_queue.push(id);
-    while (revoke_cl != li->owner)
+// Send m, giving up on the client after DELIVER_MS so that a stopped
+// client ties up a sender for no longer than that. Returns whether m
+// should be tried again: a lost revoke is not, since the lease thread
+// takes the lock from a holder that does not answer, but a lost retry
+// is while the client's lease lasts, or the client would wait for its
+// grant forever.
+bool lock_server_cache::deliver(lock_protocol::lockid_t lid, const message &m)
+{
+  int r;
+  std::string id = client_name(m.client);
+  handle h(id);
+  if (!h.safebind())
+  {
+    tprintf("server: cannot bind to client %s\n", id.c_str());
+    return false;
+  }
+  int ret;
+  if (m.proc == rlock_protocol::retry)
+    ret = h.safebind()->call(rlock_protocol::retry, lid, m.fence, r,
+                             rpcc::to(DELIVER_MS));
+  else
+    ret = h.safebind()->call(rlock_protocol::revoke, lid, m.mode, r,
+                             rpcc::to(DELIVER_MS));
+  if (ret >= 0)
+    return false;
+  tprintf("server: %s to client %s on lock %llu failed: %d\n",
+          m.proc == rlock_protocol::retry ? "retry" : "revoke", id.c_str(),
+          lid, ret);
+  return m.proc == rlock_protocol::retry && now_us() < lease_of(m.client);
+}
+
+// A message stays at the head of its mailbox until it is delivered or
+// given up on, which keeps other senders off the mailbox meanwhile.
+void *lock_server_cache::sender_thread(void *arg)
+{
+  lock_server_cache *ls = (lock_server_cache *)arg;
+
+  pthread_mutex_lock(&ls->outbox_mutex);
+  for (;;)
+  {
+    while (ls->ready_head == NULL)
+      pthread_cond_wait(&ls->outbox_cond, &ls->outbox_mutex);
+    mailbox *mb = ls->ready_head;
+    ls->ready_head = mb->next_ready;
+    if (ls->ready_head == NULL)
+      ls->ready_tail = NULL;
+    message m = mb->head->m;
+    pthread_mutex_unlock(&ls->outbox_mutex);
+
+    bool again = ls->deliver(mb->lid, m);
+
+    pthread_mutex_lock(&ls->outbox_mutex);
+    if (again)
     {
-      pthread_cond_wait(&li->revoke_cv, &mutex);
+      // to the back of ready, behind the mail of other clients
+      ls->make_ready(mb);
+      continue;
     }
-    pthread_mutex_unlock(&mutex);
-    handle h(revoke_cl);
+    mail *done = mb->head;
+    mb->head = done->next;
+    if (mb->head == NULL)
+      mb->tail = NULL;
+    done->next = ls->free_mail;
+    ls->free_mail = done;
+    if (mb->head != NULL)
+      ls->make_ready(mb);
+    else
+      ls->drop_mailbox(mb);
+  }
+  return NULL;
+}
 
-    if (h.safebind())
+int lock_server_cache::acquire(lock_protocol::lockid_t lid, std::string id,
+                               int mode, lock_protocol::fence_t &fence)
+{
+  client_t c = intern(id);
+  renew_lease(c);
+  return acquire_one(lid, c, id, mode, fence);
+}
+
+int lock_server_cache::acquire_many(std::vector<lock_protocol::lockid_t> lids,
+                                    std::string id, int mode,
+                                    std::vector<lock_protocol::fence_t> &fences)
+{
+  client_t c = intern(id);
+  renew_lease(c);
+
+  fences.clear();
+  for (size_t i = 0; i < lids.size(); i++)
+  {
+    if (i > 0 && lids[i] <= lids[i - 1])
     {
-      ret = h.safebind()->call(rlock_protocol::revoke, lid, r);
+      tprintf("server: client %s asks for locks out of order\n", id.c_str());
+      return lock_protocol::IOERR;
     }
-    pthread_mutex_lock(&mutex);
-    /*if (!h.safebind() || ret != lock_protocol::OK)
-    {
-      tprintf("server: call for client %s revoke error\n", li->owner.c_str());
-      ret = lock_protocol::IOERR;
-      pthread_mutex_unlock(&mutex);
+    lock_protocol::fence_t fence;
+    int ret = acquire_one(lids[i], c, id, mode, fence);
+    if (ret != lock_protocol::OK)
       return ret;
-    }*/
-    ret = lock_protocol::RETRY;
+    fences.push_back(fence);
+  }
+  return lock_protocol::OK;
+}
+
+int lock_server_cache::acquire_one(lock_protocol::lockid_t lid, client_t c,
+                                   const std::string &id, int mode,
+                                   lock_protocol::fence_t &fence)
+{
+  lock_protocol::status ret = lock_protocol::OK;
+  msgbuf msgs;
+  shard &sh = shard_of(lid);
+  pthread_mutex_lock(&sh.mutex);
+
+  lock_info &li = *find(sh, lid, true);
+  if (li.writer == c ||
+      (mode == lock_protocol::SHARED && is_reader(li, c)))
+  {
+    tprintf("server: client %s had alread get the lock\n", id.c_str());
+    fence = li.fence;
+    pthread_mutex_unlock(&sh.mutex);
+    return lock_protocol::OK;
+  }
+
+  if (is_waiting(li, c))
+  {
+    tprintf("server: client %s is already in waiting queue\n", id.c_str());
+    pthread_mutex_unlock(&sh.mutex);
+    return lock_protocol::RETRY;
+  }
+
+  // an upgrade: the client's shared lock is given up either way
+  set_reader(li, c, false);
+  clear_revoked(li, c);
+
+  if (li.head == NULL && li.writer == NOBODY &&
+      (mode == lock_protocol::SHARED || li.nreaders == 0))
+  {
+    fence = grant(sh, li, c, mode);
   }
   else
   {
-    li->is_hold = true;
-    li->owner = id;
+    enqueue(sh, li, c, mode);
+    settle(sh, lid, li, msgs);
+    ret = lock_protocol::RETRY;
   }
-  pthread_mutex_unlock(&mutex);
+  pthread_mutex_unlock(&sh.mutex);
+
+  send(lid, msgs);
   return ret;
 }
 
 int lock_server_cache::release(lock_protocol::lockid_t lid, std::string id,
-                               int &r)
+                               int mode, int &r)
 {
-  lock_protocol::status ret = lock_protocol::OK;
+  client_t c = intern(id);
+  renew_lease(c);
+  return release_one(lid, c, id, mode);
+}
 
-  if (lock_admin.count(lid) == 0)
+int lock_server_cache::release_many(std::vector<lock_protocol::lockid_t> lids,
+                                    std::string id, int &)
+{
+  client_t c = intern(id);
+  renew_lease(c);
+  for (size_t i = 0; i < lids.size(); i++)
+    release_one(lids[i], c, id, lock_protocol::NONE);
+  return lock_protocol::OK;
+}
+
+int lock_server_cache::release_one(lock_protocol::lockid_t lid, client_t c,
+                                   const std::string &id, int mode)
+{
+  lock_protocol::status ret = lock_protocol::OK;
+  msgbuf msgs;
+  shard &sh = shard_of(lid);
+  pthread_mutex_lock(&sh.mutex);
+  lock_info *lip = find(sh, lid, false);
+  if (lip == NULL)
   {
-    tprintf("server: no lock %llu exists in lock_admin\n", lid);
+    tprintf("server: no lock %llu exists in lock table\n", lid);
+    pthread_mutex_unlock(&sh.mutex);
     return lock_protocol::NOENT;
   }
 
-  pthread_mutex_lock(&mutex);
-  lock_info *li = &lock_admin[lid];
-  //tprintf("server: %s call for release\n", id.c_str());
-
-  if (li->owner != id || !li->is_hold)
+  lock_info &li = *lip;
+  if (li.writer == c)
   {
-    tprintf("server: %s has already released\n", id.c_str());
-    pthread_mutex_unlock(&mutex);
-    return lock_protocol::OK;
+    li.writer = NOBODY;
+    if (mode == lock_protocol::SHARED)
+      set_reader(li, c, true);
   }
-
-  if (!li->is_hold)
+  else if (is_reader(li, c) && mode == lock_protocol::NONE)
   {
-    tprintf("server: lock %llu is not held\n", lid);
-    ret = lock_protocol::IOERR;
+    set_reader(li, c, false);
   }
   else
   {
-    if (li->waiting_queue.empty())
-    {
-      tprintf("server: %s call for release, waiting queue should not be empty\n", id.c_str());
-      li->is_hold = false;
-      li->owner = "";
-      ret = lock_protocol::OK;
-    }
-    else
-    {
-      std::string retry_cl = li->waiting_queue.front();
-
-      li->waiting_queue.pop();
-      li->owner = retry_cl;
-      //tprintf("server: lock:%llu new owner %s\n", lid, retry_cl.c_str());
-      handle h(retry_cl);
+    tprintf("server: %s has already released\n", id.c_str());
+    pthread_mutex_unlock(&sh.mutex);
+    return lock_protocol::OK;
+  }
+  clear_revoked(li, c);
 
-      if (h.safebind())
-      {
-        pthread_mutex_unlock(&mutex);
-        ret = h.safebind()->call(rlock_protocol::retry, lid, r);
-        pthread_mutex_lock(&mutex);
-      }
-      pthread_cond_broadcast(&li->revoke_cv);
-      /*if (!h.safebind() || ret != lock_protocol::OK)
-      {
-        tprintf("server: call for client %s retry error\n", retry_cl.c_str());
-        ret = lock_protocol::RPCERR;
-      }*/
+  settle(sh, lid, li, msgs);
+  reap(sh, lid);
+  pthread_mutex_unlock(&sh.mutex);
 
-      //tprintf("server: send retry succeed, new owner %s\n", retry_cl.c_str());
-    }
-  }
-  pthread_mutex_unlock(&mutex);
+  send(lid, msgs);
   return ret;
 }
 
@@ -172,3 +716,138 @@ lock_server_cache::stat(lock_protocol::lockid_t lid, int &r)
   return lock_protocol::OK;
 }
 
+
+int lock_server_cache::renew(std::string id, int &r)
+{
+  renew_lease(intern(id));
+  r = lock_protocol::lease_ms;
+  return lock_protocol::OK;
+}
+
+void lock_server_cache::renew_lease(client_t c)
+{
+  unsigned long long until = now_us() + LEASE_US;
+  pthread_mutex_lock(&leases_mutex);
+  if ((size_t)c >= lease_until.size())
+    lease_until.resize(c + 1, 0);
+  lease_until[c] = until;
+  pthread_mutex_unlock(&leases_mutex);
+}
+
+unsigned long long lock_server_cache::lease_of(client_t c)
+{
+  pthread_mutex_lock(&leases_mutex);
+  unsigned long long until =
+      (size_t)c < lease_until.size() ? lease_until[c] : 0;
+  pthread_mutex_unlock(&leases_mutex);
+  return until;
+}
+
+// Order of the expiries heap: the earliest on top.
+bool lock_server_cache::later(const expiry &a, const expiry &b)
+{
+  return a.when > b.when;
+}
+
+// Have the lease thread look at client c's hold on lid at when.
+void lock_server_cache::watch(lock_protocol::lockid_t lid, client_t c,
+                              unsigned long long when)
+{
+  expiry e = { when, lid, c };
+  pthread_mutex_lock(&leases_mutex);
+  bool first = expiries.empty() || when < expiries.front().when;
+  expiries.push_back(e);
+  std::push_heap(expiries.begin(), expiries.end(), later);
+  if (first)
+    pthread_cond_signal(&leases_cond);
+  pthread_mutex_unlock(&leases_mutex);
+}
+
+// Take client c down to mode, as if it had released.
+void lock_server_cache::strip(lock_info &li, client_t c, int mode)
+{
+  if (li.writer == c)
+  {
+    li.writer = NOBODY;
+    if (mode == lock_protocol::SHARED)
+      set_reader(li, c, true);
+  }
+  else if (mode == lock_protocol::NONE)
+  {
+    set_reader(li, c, false);
+  }
+  clear_revoked(li, c);
+}
+
+// Take lid from client c if it has not complied with a revoke and
+// its lease or its deadline is up, or look again when one will be.
+// A client that keeps renewing may be in the middle of a long
+// operation, but it does not get to make the others wait for longer
+// than a lease: its late writes are fenced off.
+void lock_server_cache::expire(lock_protocol::lockid_t lid, client_t c)
+{
+  msgbuf msgs;
+  shard &sh = shard_of(lid);
+  pthread_mutex_lock(&sh.mutex);
+  lock_info *li = find(sh, lid, false);
+  if (li == NULL || !is_revoked(*li, c))
+  {
+    pthread_mutex_unlock(&sh.mutex);
+    return;
+  }
+
+  unsigned long long now = now_us(), until = lease_of(c);
+  unsigned long long deadline = li->revoked[c];
+  if (now < until && now < deadline)
+  {
+    watch(lid, c, std::min(until, deadline));
+  }
+  else
+  {
+    if (now < until)
+    {
+      tprintf("server: client %d kept lock %llu past its revoke\n", c, lid);
+    }
+    else
+    {
+      tprintf("server: lease of client %d on lock %llu is up\n", c, lid);
+    }
+    strip(*li, c, li->revoked_none[c] ? lock_protocol::NONE :
+                                        lock_protocol::SHARED);
+    settle(sh, lid, *li, msgs);
+    reap(sh, lid);
+  }
+  pthread_mutex_unlock(&sh.mutex);
+
+  send(lid, msgs);
+}
+
+void *lock_server_cache::lease_thread(void *arg)
+{
+  lock_server_cache *ls = (lock_server_cache *)arg;
+
+  pthread_mutex_lock(&ls->leases_mutex);
+  for (;;)
+  {
+    if (ls->expiries.empty())
+    {
+      pthread_cond_wait(&ls->leases_cond, &ls->leases_mutex);
+      continue;
+    }
+    expiry e = ls->expiries.front();
+    if (now_us() < e.when)
+    {
+      struct timespec ts;
+      ts.tv_sec = e.when / 1000000;
+      ts.tv_nsec = (e.when % 1000000) * 1000;
+      pthread_cond_timedwait(&ls->leases_cond, &ls->leases_mutex, &ts);
+      continue;
+    }
+    std::pop_heap(ls->expiries.begin(), ls->expiries.end(), later);
+    ls->expiries.pop_back();
+    pthread_mutex_unlock(&ls->leases_mutex);
+    ls->expire(e.lid, e.client);
+    pthread_mutex_lock(&ls->leases_mutex);
+  }
+  return NULL;
+}
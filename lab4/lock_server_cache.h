@@ -3,36 +3,222 @@
 
 #include <string>
 
-#include <map>
-#include <queue>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
 #include "lock_protocol.h"
 #include "rpc.h"
 #include "lock_server.h"
 
+// the lock table is split into 1 << LOCK_SHARD_BITS shards
+#define LOCK_SHARD_BITS 6
+// threads that send revokes and retries to clients
+#define LOCK_SENDERS 16
+// messages a handler collects before it needs to allocate
+#define LOCK_MSGS 8
+
 class lock_server_cache
 {
 private:
+  // Client ids ("host:port") are interned as small integers, in the
+  // order the clients first show up; NOBODY stands for no client.
+  typedef int client_t;
+  enum { NOBODY = -1 };
+  pthread_rwlock_t clients_lock;
+  std::unordered_map<std::string, client_t> client_ids;
+  std::vector<std::string> client_names;
+
+  // A waiter is linked into the FIFO of its lock. Nodes are reused
+  // through the free list of the shard, so that queueing does not
+  // allocate once the shard has seen enough waiters.
+  struct waiter
+  {
+    client_t client;
+    int mode;
+    waiter *next;
+  };
+  // Holders are one writer or a set of readers. Waiters are granted
+  // in FIFO order, a run of SHARED ones together. readers, waiting
+  // and revoked are by client, so that they only grow the first time
+  // a client uses the lock. revoked holds the deadline of the revoke
+  // sent to a holder, 0 if none, and revoked_none whether it was asked
+  // to go down to NONE rather than SHARED. fence is the token of the
+  // last grant. lock_infos are reused through the free list of the
+  // shard, linked through next_free.
   struct lock_info
   {
-    bool is_hold;
-    std::string owner;
-    std::queue<std::string> waiting_queue;
-    pthread_cond_t revoke_cv;
-    lock_info() : is_hold(false), owner("")
+    client_t writer;
+    std::vector<bool> readers;
+    size_t nreaders;
+    waiter *head, *tail;
+    std::vector<bool> waiting;
+    std::vector<unsigned long long> revoked;
+    std::vector<bool> revoked_none;
+    size_t nrevoked;
+    lock_protocol::fence_t fence;
+    lock_info *next_free;
+    lock_info() : writer(NOBODY), nreaders(0), head(NULL), tail(NULL),
+                  nrevoked(0), fence(0), next_free(NULL) {}
+  };
+  // a revoke or retry to send once mutex is dropped; a retry carries
+  // the token of the grant
+  struct message
+  {
+    client_t client;
+    unsigned int proc;
+    int mode;
+    lock_protocol::fence_t fence;
+  };
+  // The messages a handler makes under a shard mutex, the first
+  // LOCK_MSGS of them kept in place.
+  class msgbuf
+  {
+    message first[LOCK_MSGS];
+    std::vector<message> rest;
+    size_t n;
+
+  public:
+    msgbuf() : n(0) {}
+    void push(const message &m)
+    {
+      if (n < LOCK_MSGS)
+        first[n] = m;
+      else
+        rest.push_back(m);
+      n++;
+    }
+    size_t size() const { return n; }
+    const message &operator[](size_t i) const
     {
-      pthread_cond_init(&revoke_cv, NULL);
+      return i < LOCK_MSGS ? first[i] : rest[i - LOCK_MSGS];
     }
   };
+  // The lock table is sharded by a hash of the lock id, each shard
+  // behind its own mutex, so that requests for different locks
+  // rarely wait for each other. A shard is an open-addressing hash
+  // table with linear probing; its size is a power of two and it is
+  // kept at most half full. An empty slot has li NULL. A lock that
+  // nobody holds, waits for or is being asked to give back is
+  // dropped from the table. A lock always falls in the same shard, so
+  // each shard hands out the fencing tokens of its locks from its own
+  // counter, next_fence, which starts at the time of day in us.
+  struct slot
+  {
+    lock_protocol::lockid_t lid;
+    lock_info *li;
+  };
+  struct shard
+  {
+    pthread_mutex_t mutex;
+    std::vector<slot> slots;
+    size_t used;
+    waiter *free_waiters;
+    lock_info *free_infos;
+    lock_protocol::fence_t next_fence;
+  };
+  // Revokes and retries wait in the outbox for a pool of sender
+  // threads, so that a handler never waits for a client. The mail to
+  // one client about one lock is kept in order in their mailbox, and
+  // goes out one message at a time; ready lists, through next_ready,
+  // the mailboxes that have mail and no sender working on them. The
+  // mailboxes are found through an open-addressing table like a
+  // shard's, which drops them once empty. Mailboxes and mail are
+  // reused through free lists, so that sending does not allocate
+  // once the outbox has seen enough traffic.
+  struct mail
+  {
+    message m;
+    mail *next;
+  };
+  struct mailbox
+  {
+    lock_protocol::lockid_t lid;
+    client_t client;
+    mail *head, *tail;
+    mailbox *next_ready;
+  };
+  pthread_mutex_t outbox_mutex;
+  pthread_cond_t outbox_cond;
+  std::vector<mailbox *> outbox;
+  size_t outbox_used;
+  mailbox *ready_head, *ready_tail;
+  mailbox *free_mailboxes;
+  mail *free_mail;
+  // Leases: lease_until is by client, the end of its lease as of its
+  // last acquire, release or renew. expiries is a heap, earliest
+  // first, of the holders that have been sent a revoke, by the time
+  // their lease may be up; the lease thread takes the lock from each
+  // one that has not complied by then and has not renewed either, or
+  // whose deadline is up.
+  struct expiry
+  {
+    unsigned long long when;
+    lock_protocol::lockid_t lid;
+    client_t client;
+  };
+  pthread_mutex_t leases_mutex;
+  pthread_cond_t leases_cond;
+  std::vector<unsigned long long> lease_until;
+  std::vector<expiry> expiries;
   int nacquire;
-  pthread_mutex_t mutex;
-  std::map<lock_protocol::lockid_t, lock_info> lock_admin;
+  shard shards[1 << LOCK_SHARD_BITS];
+
+  static uint64_t lock_hash(lock_protocol::lockid_t);
+  shard &shard_of(lock_protocol::lockid_t);
+  static lock_info *find(shard &, lock_protocol::lockid_t, bool create);
+  static void grow(shard &);
+  static void reap(shard &, lock_protocol::lockid_t);
+
+  client_t intern(const std::string &);
+  std::string client_name(client_t);
+  static bool is_reader(const lock_info &, client_t);
+  static void set_reader(lock_info &, client_t, bool);
+  static bool is_waiting(const lock_info &, client_t);
+  static bool is_revoked(const lock_info &, client_t);
+  static void set_revoked(lock_info &, client_t, unsigned long long deadline,
+                          int mode);
+  static void clear_revoked(lock_info &, client_t);
+  static void enqueue(shard &, lock_info &, client_t, int mode);
+  static void dequeue(shard &, lock_info &);
+  static lock_protocol::fence_t grant(shard &, lock_info &, client_t, int mode);
+  void grant_waiters(shard &, lock_info &, msgbuf &);
+  bool revoke_holder(lock_protocol::lockid_t, lock_info &, client_t,
+                     int keep, unsigned long long now, msgbuf &);
+  bool revoke_holders(lock_protocol::lockid_t, lock_info &, msgbuf &);
+  void settle(shard &, lock_protocol::lockid_t, lock_info &, msgbuf &);
+
+  static uint64_t dest_hash(lock_protocol::lockid_t, client_t);
+  mailbox *mailbox_of(lock_protocol::lockid_t, client_t);
+  void grow_outbox();
+  void drop_mailbox(mailbox *);
+  void make_ready(mailbox *);
+  void send(lock_protocol::lockid_t, const msgbuf &);
+  bool deliver(lock_protocol::lockid_t, const message &);
+  static void *sender_thread(void *);
+
+  int acquire_one(lock_protocol::lockid_t, client_t, const std::string &id,
+                  int mode, lock_protocol::fence_t &);
+  int release_one(lock_protocol::lockid_t, client_t, const std::string &id,
+                  int mode);
+  void renew_lease(client_t);
+  unsigned long long lease_of(client_t);
+  static bool later(const expiry &, const expiry &);
+  void watch(lock_protocol::lockid_t, client_t, unsigned long long when);
+  static void strip(lock_info &, client_t, int mode);
+  void expire(lock_protocol::lockid_t, client_t);
+  static void *lease_thread(void *);
 
 public:
   lock_server_cache();
   lock_protocol::status stat(lock_protocol::lockid_t, int &);
-  int acquire(lock_protocol::lockid_t, std::string id, int &);
-  int release(lock_protocol::lockid_t, std::string id, int &);
+  int acquire(lock_protocol::lockid_t, std::string id, int mode,
+              lock_protocol::fence_t &);
+  int release(lock_protocol::lockid_t, std::string id, int mode, int &);
+  int renew(std::string id, int &);
+  int acquire_many(std::vector<lock_protocol::lockid_t> lids, std::string id,
+                   int mode, std::vector<lock_protocol::fence_t> &);
+  int release_many(std::vector<lock_protocol::lockid_t> lids, std::string id,
+                   int &);
 };
 
 #endif
-
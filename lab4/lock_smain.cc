@@ -44,6 +44,11 @@ main(int argc, char *argv[])
   server.reg(lock_protocol::stat, &ls, &lock_server_cache::stat);
   server.reg(lock_protocol::release, &ls, &lock_server_cache::release);
   server.reg(lock_protocol::acquire, &ls, &lock_server_cache::acquire);
+  server.reg(lock_protocol::renew, &ls, &lock_server_cache::renew);
+  server.reg(lock_protocol::acquire_many, &ls,
+             &lock_server_cache::acquire_many);
+  server.reg(lock_protocol::release_many, &ls,
+             &lock_server_cache::release_many);
 
 #endif
 
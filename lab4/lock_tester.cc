@@ -13,6 +13,10 @@
 #include <stdio.h>
 #include "lang/verify.h"
 #include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <algorithm>
 // must be >= 2
 int nt = 6; //XXX: lab1's rpc handlers are blocking. Since rpcs uses a thread pool of 10 threads, we cannot test more than 10 blocking rpc.
 std::string dst;
@@ -21,11 +25,16 @@ lock_client_cache **lc = new lock_client_cache * [nt];
 lock_protocol::lockid_t a = 1;
 lock_protocol::lockid_t b = 2;
 lock_protocol::lockid_t c = 3;
+lock_protocol::lockid_t d = 4;
+lock_protocol::lockid_t e = 5;
 
 // check_grant() and check_release() check that the lock server
 // doesn't grant the same lock to both clients.
 // it assumes that lock names are distinct in the first byte.
+// check_read_grant() and check_read_release() do the same for
+// shared grants, which may overlap each other but no exclusive one.
 int ct[256];
+int rd[256];
 pthread_mutex_t count_mutex;
 
 void
@@ -33,7 +42,7 @@ check_grant(lock_protocol::lockid_t lid)
 {
   ScopedLock ml(&count_mutex);
   int x = lid & 0xff;
-  if(ct[x] != 0){
+  if(ct[x] != 0 || rd[x] != 0){
     fprintf(stderr, "error: server granted %016llx twice\n", lid);
     fprintf(stdout, "error: server granted %016llx twice\n", lid);
     exit(1);
@@ -53,6 +62,77 @@ check_release(lock_protocol::lockid_t lid)
   ct[x] -= 1;
 }
 
+void
+check_read_grant(lock_protocol::lockid_t lid)
+{
+  ScopedLock ml(&count_mutex);
+  int x = lid & 0xff;
+  if(ct[x] != 0){
+    fprintf(stderr, "error: server granted %016llx shared while held\n", lid);
+    fprintf(stdout, "error: server granted %016llx shared while held\n", lid);
+    exit(1);
+  }
+  rd[x] += 1;
+}
+
+void
+check_read_release(lock_protocol::lockid_t lid)
+{
+  ScopedLock ml(&count_mutex);
+  int x = lid & 0xff;
+  if(rd[x] < 1){
+    fprintf(stderr, "error: client released un-read lock %016llx\n", lid);
+    exit(1);
+  }
+  rd[x] -= 1;
+}
+
+double
+now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// A client in a process of its own, forked before any other, which
+// the tests can stop to play a holder that has stalled. It runs one
+// command at a time: 'a' acquires e, 'r' releases it, and 'l' asks
+// whether its grant has lapsed.
+pid_t holder;
+int to_holder[2], from_holder[2];
+
+void
+holder_loop(void)
+{
+  // not the seed of the first client in the parent
+  close(to_holder[1]);
+  close(from_holder[0]);
+  lock_client_cache::last_port = getpid();
+  lock_client_cache *hc = new lock_client_cache(dst);
+  char cmd, reply;
+  while (read(to_holder[0], &cmd, 1) == 1) {
+    reply = 'y';
+    if (cmd == 'a')
+      hc->acquire(e);
+    else if (cmd == 'r')
+      hc->release(e);
+    else if (cmd == 'l' && !hc->lapsed(e))
+      reply = 'n';
+    VERIFY(write(from_holder[1], &reply, 1) == 1);
+  }
+  _exit(0);
+}
+
+char
+holder_cmd(char cmd)
+{
+  char reply;
+  VERIFY(write(to_holder[1], &cmd, 1) == 1);
+  VERIFY(read(from_holder[0], &reply, 1) == 1);
+  return reply;
+}
+
 void
 test1(void)
 {
@@ -144,6 +224,182 @@ test5(void *x)
   return 0;
 }
 
+pthread_barrier_t all_read;
+
+void *
+test6(void *x)
+{
+  int i = * (int *) x;
+
+  printf ("test6: client %d acquire d shared, all together\n", i);
+  lc[i]->acquire(d, lock_protocol::SHARED);
+  check_read_grant(d);
+  // every client holds d at once, or this never returns
+  pthread_barrier_wait(&all_read);
+  check_read_release(d);
+  lc[i]->release(d);
+
+  // the shared grants cached above are upgraded, by all at once
+  printf ("test6: client %d upgrade d and read it again\n", i);
+  for (int j = 0; j < 10; j++) {
+    if (j % 2 == 0) {
+      lc[i]->acquire(d, lock_protocol::EXCLUSIVE);
+      check_grant(d);
+      printf ("test6: client %d got lock exclusive\n", i);
+      check_release(d);
+    } else {
+      lc[i]->acquire(d, lock_protocol::SHARED);
+      check_read_grant(d);
+      printf ("test6: client %d got lock shared\n", i);
+      usleep(random() % 1000);
+      check_read_release(d);
+    }
+    lc[i]->release(d);
+  }
+  return 0;
+}
+
+void *
+test7(void *x)
+{
+  int i = * (int *) x;
+  std::vector<lock_protocol::lockid_t> lids;
+
+  // each client asks for a b c in an order of its own
+  lids.push_back(a);
+  lids.push_back(b);
+  lids.push_back(c);
+  std::rotate(lids.begin(), lids.begin() + i % 3, lids.end());
+  if (i % 2)
+    std::reverse(lids.begin(), lids.end());
+
+  printf ("test7: client %d acquire_many a b c concurrent\n", i);
+  for (int j = 0; j < 10; j++) {
+    VERIFY(lc[i]->acquire_many(lids) == lock_protocol::OK);
+    for (size_t k = 0; k < lids.size(); k++)
+      check_grant(lids[k]);
+    printf ("test7: client %d got locks\n", i);
+    for (size_t k = 0; k < lids.size(); k++) {
+      check_release(lids[k]);
+      lc[i]->release(lids[k]);
+    }
+  }
+  return 0;
+}
+
+void
+test8(void)
+{
+  printf ("test8: holder acquire e and stall, client 1 acquire e\n");
+  holder_cmd('a');
+  check_grant(e);
+  kill(holder, SIGSTOP);
+
+  // the stalled holder renews no more, so its lease runs out and
+  // the server hands e on
+  double start = now();
+  lc[1]->acquire(e);
+  double took = now() - start;
+  printf ("test8: client 1 got e after %.2fs\n", took);
+  kill(holder, SIGCONT);
+  if (took > 3 * lock_protocol::lease_ms / 1000.0) {
+    fprintf(stderr, "error: lease of stalled holder held for %.2fs\n", took);
+    exit(1);
+  }
+  // e is client 1's now
+  check_release(e);
+  check_grant(e);
+
+  if (holder_cmd('l') != 'y') {
+    fprintf(stderr, "error: stalled holder still trusts its grant of e\n");
+    exit(1);
+  }
+  holder_cmd('r');
+  check_release(e);
+  lc[1]->release(e);
+}
+
+void
+test9(void)
+{
+  printf ("test9: holder re-acquire e taken from it\n");
+  holder_cmd('a');
+  check_grant(e);
+  if (holder_cmd('l') != 'n') {
+    fprintf(stderr, "error: new grant of e already lapsed\n");
+    exit(1);
+  }
+  check_release(e);
+  holder_cmd('r');
+
+  // the server drops the state of a lock no client holds; ask again
+  // for such locks, many of them, while others are still cached
+  printf ("test9: client 0 give back locks, client 1 acquire them\n");
+  std::vector<lock_protocol::lockid_t> lids;
+  for (int k = 1; k <= 64; k++)
+    lids.push_back(((lock_protocol::lockid_t)k << 8) | 0x40);
+  lc[0]->set_cache(0, 0);
+  for (size_t k = 0; k < lids.size(); k++) {
+    lc[0]->acquire(lids[k]);
+    check_grant(lids[k]);
+    check_release(lids[k]);
+    lc[0]->release(lids[k]);
+  }
+  double start = now();
+  for (size_t k = 0; k < lids.size(); k++) {
+    while (lc[0]->is_cached(lids[k])) {
+      if (now() - start > lock_protocol::lease_ms / 1000.0) {
+        fprintf(stderr, "error: client 0 keeps %016llx\n", lids[k]);
+        exit(1);
+      }
+      usleep(10000);
+    }
+  }
+  for (size_t k = 0; k < lids.size(); k++) {
+    lc[1]->acquire(lids[k]);
+    check_grant(lids[k]);
+    check_release(lids[k]);
+    if (k % 2)
+      lc[1]->release(lids[k]);
+  }
+  for (size_t k = 0; k < lids.size(); k += 2)
+    lc[1]->release(lids[k]);
+}
+
+void
+test10(void)
+{
+  printf ("test10: client 0 hold d and renew, client 1 acquire d\n");
+  lc[0]->acquire(d);
+  check_grant(d);
+  lock_protocol::fence_t fence = lc[0]->fence(d);
+
+  // client 0 never gives d back but keeps its lease; the server
+  // takes d from it one lease after the revoke
+  double start = now();
+  lc[1]->acquire(d);
+  double took = now() - start;
+  printf ("test10: client 1 got d after %.2fs\n", took);
+  if (took > 2 * lock_protocol::lease_ms / 1000.0) {
+    fprintf(stderr, "error: revoked holder kept d for %.2fs\n", took);
+    exit(1);
+  }
+  if (!lc[0]->lapsed(d)) {
+    fprintf(stderr, "error: revoked holder still trusts its grant of d\n");
+    exit(1);
+  }
+  if (lc[1]->fence(d) <= fence) {
+    fprintf(stderr, "error: grant of d has an old token\n");
+    exit(1);
+  }
+  // d is client 1's now
+  check_release(d);
+  check_grant(d);
+  lc[0]->release(d);
+  check_release(d);
+  lc[1]->release(d);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -166,13 +422,23 @@ main(int argc, char *argv[])
 
     if (argc > 2) {
       test = atoi(argv[2]);
-      if(test < 1 || test > 5){
-        printf("Test number must be between 1 and 5\n");
+      if(test < 1 || test > 10){
+        printf("Test number must be between 1 and 10\n");
         exit(1);
       }
     }
 
     VERIFY(pthread_mutex_init(&count_mutex, NULL) == 0);
+
+    if(!test || test == 8 || test == 9){
+      VERIFY(pipe(to_holder) == 0 && pipe(from_holder) == 0);
+      holder = fork();
+      VERIFY(holder >= 0);
+      if (holder == 0)
+        holder_loop();
+      close(to_holder[0]);
+      close(from_holder[1]);
+    }
     //printf("simple lock client\n");
     //for (int i = 0; i < nt; i++) lc[i] = new lock_client(dst);
     printf("cache lock client\n");
@@ -237,6 +503,56 @@ main(int argc, char *argv[])
       }
     }
 
+    if(!test || test == 6){
+      printf("test 6\n");
+
+      // test 6
+      pthread_barrier_init(&all_read, NULL, nt);
+      for (int i = 0; i < nt; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test6, (void *) a);
+	VERIFY (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+	pthread_join(th[i], NULL);
+      }
+    }
+
+    if(!test || test == 7){
+      printf("test 7\n");
+
+      // test 7
+      for (int i = 0; i < nt; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test7, (void *) a);
+	VERIFY (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+	pthread_join(th[i], NULL);
+      }
+    }
+
+    // test 9 starts from where test 8 leaves the holder
+    if(!test || test == 8 || test == 9){
+      printf("test 8\n");
+      test8();
+    }
+
+    if(!test || test == 9){
+      printf("test 9\n");
+      test9();
+    }
+
+    if(!test || test == 10){
+      printf("test 10\n");
+      test10();
+    }
+
+    if (holder > 0) {
+      close(to_holder[1]);
+      waitpid(holder, NULL, 0);
+    }
+
     printf ("%s: passed all tests successfully\n", argv[0]);
 
 }
@@ -9,9 +9,11 @@ using namespace std;
 
 void NameNode::init(const string &extent_dst, const string &lock_dst)
 {
-  ec = new extent_client(extent_dst);
-  lc = new lock_client_cache(lock_dst);
   yfs = new yfs_client(extent_dst, lock_dst);
+  // share yfs's caches, so that extents cached by yfs are flushed
+  // whenever a lock taken here is revoked
+  ec = yfs->get_extent_client();
+  lc = yfs->get_lock_client();
 
   /* Add your init logic here */
 }
@@ -105,50 +107,13 @@ bool NameNode::Rename(yfs_client::inum src_dir_ino, string src_name, yfs_client:
 {
   printf("NameNode:: begin Rename\n");
   fflush(stdout);
-  lc->acquire(src_dir_ino);
-  bool found = false;
-  yfs_client::inum ino;
-
-  if (yfs->lookup_l(src_dir_ino, src_name.c_str(), found, ino) != yfs_client::OK)
+  // HDFS does not replace an existing destination
+  if (yfs->rename(src_dir_ino, src_name.c_str(), dst_dir_ino, dst_name.c_str(), false) != yfs_client::OK)
   {
-    printf("Rename: yfs lookup_l error\n");
+    printf("Rename: yfs rename error\n");
     fflush(stdout);
-    lc->release(src_dir_ino);
     return false;
   }
-
-  if (!found)
-  {
-    printf("Rename: src file not found\n");
-    fflush(stdout);
-    lc->release(src_dir_ino);
-    return false;
-  }
-
-  if (yfs->deleteDirent_l(src_dir_ino, src_name.c_str()) != yfs_client::OK)
-  {
-    printf("Rename: yfs deleteDirent_l error\n");
-    fflush(stdout);
-    lc->release(src_dir_ino);
-    return false;
-  }
-
-  lc->release(src_dir_ino);
-
-  yfs_client::dirent dst_entry;
-  dst_entry.name = dst_name;
-  dst_entry.inum = ino;
-
-  lc->acquire(dst_dir_ino);
-  if (yfs->addDirent_l(dst_dir_ino, dst_entry) != yfs_client::OK)
-  {
-    printf("Rename: yfs addDirent_l error\n");
-    fflush(stdout);
-    lc->release(dst_dir_ino);
-    return false;
-  }
-
-  lc->release(dst_dir_ino);
   return true;
 }
 
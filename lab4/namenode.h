@@ -82,7 +82,7 @@ private:
   bool RecursiveLookup(const std::string &path, yfs_client::inum &ino, yfs_client::inum &last);
   bool RecursiveLookup(const std::string &path, yfs_client::inum &ino);
   bool RecursiveLookupParent(const std::string &path, yfs_client::inum &ino);
-  bool RecursiveDelete(yfs_client::inum ino);
+  bool RecursiveDelete(yfs_client::inum ino, const std::vector<yfs_client::inum> &held);
   bool ConvertLocatedBlock(const LocatedBlock &src, LocatedBlockProto &dst);
   std::list<LocatedBlock> GetBlockLocations(yfs_client::inum ino);
   bool Complete(yfs_client::inum ino, uint32_t new_size);
@@ -108,6 +108,7 @@ private:
 public:
   void init(const std::string &extent_dst, const std::string &lock_dst);
   bool PBGetFileInfoFromInum(yfs_client::inum ino, HdfsFileStatusProto &info);
+  bool PBGetFileInfoFromAttr(const extent_protocol::attr &a, HdfsFileStatusProto &info);
   void PBGetFileInfo(const GetFileInfoRequestProto &req, GetFileInfoResponseProto &resp);
   void PBGetListing(const GetListingRequestProto &req, GetListingResponseProto &resp);
   void PBGetBlockLocations(const GetBlockLocationsRequestProto &req, GetBlockLocationsResponseProto &resp);
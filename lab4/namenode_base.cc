@@ -302,6 +302,27 @@ bool NameNode::PBGetFileInfoFromInum(yfs_client::inum ino, HdfsFileStatusProto &
   return false;
 }
 
+bool NameNode::PBGetFileInfoFromAttr(const extent_protocol::attr &a, HdfsFileStatusProto &info) {
+  info.set_filetype(HdfsFileStatusProto_FileType_IS_FILE);
+  info.set_path("");
+  info.set_length(0);
+  info.set_owner("cse");
+  info.set_group("supergroup");
+  info.set_blocksize(BLOCK_SIZE);
+  if (a.type == extent_protocol::T_FILE) {
+    info.set_length(a.size);
+    info.mutable_permission()->set_perm(0666);
+  } else if (a.type == extent_protocol::T_DIR) {
+    info.set_filetype(HdfsFileStatusProto_FileType_IS_DIR);
+    info.mutable_permission()->set_perm(0777);
+  } else {
+    return false;
+  }
+  info.set_modification_time(((uint64_t) a.mtime) * 1000);
+  info.set_access_time(((uint64_t) a.atime) * 1000);
+  return true;
+}
+
 void NameNode::PBGetFileInfo(const GetFileInfoRequestProto &req, GetFileInfoResponseProto &resp) {
   yfs_client::inum ino;
   if (!RecursiveLookup(req.src(), ino))
@@ -315,8 +336,8 @@ void NameNode::PBGetListing(const GetListingRequestProto &req, GetListingRespons
   if (!RecursiveLookup(req.src(), ino))
     return;
   string start_after(req.startafter());
-  list<yfs_client::dirent> dir;
-  if (yfs->readdir(ino, dir) != yfs_client::OK)
+  list<yfs_client::direntplus> dir;
+  if (yfs->readdirplus(ino, dir) != yfs_client::OK)
     throw HdfsException("read directory failed");
   auto it = dir.begin();
   if (start_after.size() != 0) {
@@ -324,16 +345,13 @@ void NameNode::PBGetListing(const GetListingRequestProto &req, GetListingRespons
       it++;
   }
   for (; it != dir.end(); it++) {
-    if (!PBGetFileInfoFromInum(it->inum, *resp.mutable_dirlist()->add_partiallisting()))
+    if (!PBGetFileInfoFromAttr(it->attr, *resp.mutable_dirlist()->add_partiallisting()))
       throw HdfsException("get dirent info failed");
     resp.mutable_dirlist()->mutable_partiallisting()->rbegin()->set_path(it->name);
-    if (req.needlocation() && yfs->isfile(it->inum)) {
-      yfs_client::fileinfo info;
-      if (yfs->getfile(it->inum, info) != yfs_client::OK)
-        return;
+    if (req.needlocation() && it->attr.type == extent_protocol::T_FILE) {
       list<LocatedBlock> blocks = GetBlockLocations(it->inum);
       LocatedBlocksProto &locations = *resp.mutable_dirlist()->mutable_partiallisting()->rbegin()->mutable_locations();
-      locations.set_filelength(info.size);
+      locations.set_filelength(it->attr.size);
       locations.set_underconstruction(false);
       locations.set_islastblockcomplete(true);
       int i = 0;
@@ -521,14 +539,10 @@ void NameNode::PBRename(const RenameRequestProto &req, RenameResponseProto &resp
 }
 
 void NameNode::DualLock(lock_protocol::lockid_t a, lock_protocol::lockid_t b) {
-  if (a < b) {
-    lc->acquire(a);
-    lc->acquire(b);
-  } else if (a > b) {
-    lc->acquire(b);
-    lc->acquire(a);
-  } else
-    lc->acquire(a);
+  vector<lock_protocol::lockid_t> lids;
+  lids.push_back(a);
+  lids.push_back(b);
+  lc->acquire_many(lids);
 }
 
 void NameNode::DualUnlock(lock_protocol::lockid_t a, lock_protocol::lockid_t b) {
@@ -540,28 +554,14 @@ void NameNode::DualUnlock(lock_protocol::lockid_t a, lock_protocol::lockid_t b)
   }
 }
 
-bool NameNode::RecursiveDelete(yfs_client::inum ino) {
-  list<yfs_client::dirent> dir;
+// held are the locks taken by the caller; see yfs_client::remove_tree_l
+bool NameNode::RecursiveDelete(yfs_client::inum ino, const vector<yfs_client::inum> &held) {
   if (!Isdir(ino))
     return true;
-  if (!Readdir(ino, dir)) {
-    fprintf(stderr, "%s:%d Readdir(%llu) failed\n", __func__, __LINE__, ino); fflush(stderr);
+  if (yfs->remove_tree_l(ino, held) != yfs_client::OK) {
+    fprintf(stderr, "%s:%d remove_tree_l(%llu) failed\n", __func__, __LINE__, ino); fflush(stderr);
     return false;
   }
-  for (auto it = dir.begin(); it != dir.end(); it++) {
-    lc->acquire(it->inum);
-    if (!RecursiveDelete(it->inum)) {
-      lc->release(it->inum);
-      fprintf(stderr, "%s:%d recursively delete %s failed\n", __func__, __LINE__, it->name.c_str()); fflush(stderr);
-      return false;
-    }
-    if (!Unlink(ino, it->name, it->inum)) {
-      lc->release(it->inum);
-      fprintf(stderr, "%s:%d delete %s failed\n", __func__, __LINE__, it->name.c_str()); fflush(stderr);
-      return false;
-    }
-    lc->release(it->inum);
-  }
   return true;
 }
 
@@ -573,12 +573,26 @@ void NameNode::PBDelete(const DeleteRequestProto &req, DeleteResponseProto &resp
   }
   DualLock(ino, parent);
   if (req.recursive()) {
-    if (!RecursiveDelete(ino)) {
+    vector<yfs_client::inum> held;
+    held.push_back(ino);
+    held.push_back(parent);
+    if (!RecursiveDelete(ino, held)) {
       resp.set_result(false);
       DualUnlock(ino, parent);
       return;
     }
   }
+  // the path was looked up unlocked, and the locks may have been
+  // dropped while the tree was removed
+  string name = req.src().substr(req.src().rfind('/') + 1);
+  bool found;
+  yfs_client::inum now;
+  if (yfs->lookup_l(parent, name.c_str(), found, now) != yfs_client::OK ||
+      !found || now != ino) {
+    resp.set_result(false);
+    DualUnlock(ino, parent);
+    return;
+  }
   if (Isdir(ino)) {
     list<yfs_client::dirent> dir;
     if (!Readdir(ino, dir)) {
@@ -592,7 +606,7 @@ void NameNode::PBDelete(const DeleteRequestProto &req, DeleteResponseProto &resp
       return;
     }
   }
-  if (!Unlink(parent, req.src().substr(req.src().rfind('/') + 1), ino)) {
+  if (!Unlink(parent, name, ino)) {
     resp.set_result(false);
     DualUnlock(ino, parent);
     return;
@@ -0,0 +1,157 @@
+// per-operation counters and latency histograms
+
+#include "op_stats.h"
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include "lang/verify.h"
+
+static pthread_mutex_t counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+static op_stats::counter *counters;
+static void (*extra_dump)(FILE *);
+
+// the op the calling thread serves, if any
+static __thread op_stats::op *cur;
+
+static unsigned long long
+clock_us(clockid_t clk)
+{
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+op_stats::counter::counter(const char *_name)
+  : name(_name), count(0), bytes(0), total_us(0), cpu_us(0)
+{
+  pthread_mutex_init(&m, NULL);
+  memset(part_us, 0, sizeof(part_us));
+  memset(hist, 0, sizeof(hist));
+  pthread_mutex_lock(&counters_mutex);
+  next = counters;
+  counters = this;
+  pthread_mutex_unlock(&counters_mutex);
+}
+
+op_stats::op::op(counter &_c) : c(_c), bytes(0), depth(0)
+{
+  memset(part_us, 0, sizeof(part_us));
+  start = clock_us(CLOCK_MONOTONIC);
+  cpu_start = clock_us(CLOCK_THREAD_CPUTIME_ID);
+  // ops do not nest; an inner one is counted but gets no parts
+  if (cur == NULL)
+    cur = this;
+}
+
+op_stats::op::~op()
+{
+  unsigned long long us = clock_us(CLOCK_MONOTONIC) - start;
+  unsigned long long cpu = clock_us(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+  int b = 0;
+
+  if (cur == this)
+    cur = NULL;
+  while (b < NBUCKETS - 1 && us >= (1ULL << b))
+    b++;
+
+  pthread_mutex_lock(&c.m);
+  c.count++;
+  c.bytes += bytes;
+  c.total_us += us;
+  c.cpu_us += cpu;
+  for (int i = 0; i < NPARTS; i++)
+    c.part_us[i] += part_us[i];
+  c.hist[b]++;
+  pthread_mutex_unlock(&c.m);
+}
+
+op_stats::scope::scope(part _p) : p(_p), start(0)
+{
+  if (cur != NULL && cur->depth++ == 0)
+    start = clock_us(CLOCK_MONOTONIC);
+}
+
+op_stats::scope::~scope()
+{
+  if (cur != NULL && --cur->depth == 0)
+    cur->part_us[p] += clock_us(CLOCK_MONOTONIC) - start;
+}
+
+void
+op_stats::dump(FILE *f)
+{
+  pthread_mutex_lock(&counters_mutex);
+  fprintf(f, "op_stats: %-12s %10s %12s %10s %10s %10s %10s\n", "op", "count",
+          "bytes", "avg_us", "lock_us", "extent_us", "cpu_us");
+  for (counter *c = counters; c != NULL; c = c->next)
+  {
+    pthread_mutex_lock(&c->m);
+    if (c->count > 0)
+    {
+      fprintf(f, "op_stats: %-12s %10llu %12llu %10llu", c->name, c->count,
+              c->bytes, c->total_us / c->count);
+      for (int i = 0; i < NPARTS; i++)
+        fprintf(f, " %10llu", c->part_us[i] / c->count);
+      fprintf(f, " %10llu\n", c->cpu_us / c->count);
+
+      // only the buckets in use, as "<2^i us: count"
+      fprintf(f, "op_stats: %-12s", "");
+      for (int b = 0; b < NBUCKETS; b++)
+      {
+        if (c->hist[b] == 0)
+          continue;
+        if (b == NBUCKETS - 1)
+          fprintf(f, " >=%lluus:%llu", 1ULL << (b - 1), c->hist[b]);
+        else
+          fprintf(f, " <%lluus:%llu", 1ULL << b, c->hist[b]);
+      }
+      fprintf(f, "\n");
+    }
+    pthread_mutex_unlock(&c->m);
+  }
+  void (*fn)(FILE *) = extra_dump;
+  pthread_mutex_unlock(&counters_mutex);
+  if (fn != NULL)
+    fn(f);
+  fflush(f);
+}
+
+void
+op_stats::also_dump(void (*fn)(FILE *))
+{
+  pthread_mutex_lock(&counters_mutex);
+  extra_dump = fn;
+  pthread_mutex_unlock(&counters_mutex);
+}
+
+struct dump_args {
+  sigset_t set;
+  FILE *f;
+};
+
+static void *
+dump_thread(void *arg)
+{
+  dump_args *a = (dump_args *)arg;
+  int sig;
+
+  for (;;)
+  {
+    if (sigwait(&a->set, &sig) == 0)
+      op_stats::dump(a->f);
+  }
+  return NULL;
+}
+
+void
+op_stats::dump_on(int signo, FILE *f)
+{
+  dump_args *a = new dump_args;
+  pthread_t th;
+
+  sigemptyset(&a->set);
+  sigaddset(&a->set, signo);
+  a->f = f;
+  VERIFY(pthread_sigmask(SIG_BLOCK, &a->set, NULL) == 0);
+  VERIFY(pthread_create(&th, NULL, dump_thread, a) == 0);
+}
@@ -0,0 +1,75 @@
+// per-operation counters and latency histograms
+
+#ifndef op_stats_h
+#define op_stats_h
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+
+//
+// Each kind of operation (a FUSE request type, say) has a counter.
+// A thread serving one operation keeps an op on its stack; time the
+// thread spends inside a scope is charged to one part of that op,
+// and the rest of its time is spent locally. Scopes nest; only the
+// outermost one is charged, so an RPC made while acquiring a lock
+// counts as lock wait. Outside an op, scopes do nothing.
+//
+class op_stats {
+ public:
+  enum part { LOCK, EXTENT, NPARTS };
+  // latency histogram buckets: bucket i counts ops that took less
+  // than 2^i microseconds, the last one everything slower
+  enum { NBUCKETS = 24 };
+
+  class counter {
+   public:
+    counter(const char *name);
+   private:
+    friend class op_stats;
+    const char *name;
+    pthread_mutex_t m;
+    unsigned long long count;
+    unsigned long long bytes;
+    unsigned long long total_us;
+    unsigned long long cpu_us;
+    unsigned long long part_us[NPARTS];
+    unsigned long long hist[NBUCKETS];
+    counter *next;
+  };
+
+  class op {
+   public:
+    op(counter &c);
+    ~op();
+    // data moved by the operation, e.g. read or written
+    void add_bytes(size_t n) { bytes += n; }
+   private:
+    friend class op_stats;
+    counter &c;
+    unsigned long long start, cpu_start;
+    unsigned long long part_us[NPARTS];
+    size_t bytes;
+    int depth;
+  };
+
+  class scope {
+   public:
+    scope(part p);
+    ~scope();
+   private:
+    part p;
+    unsigned long long start;
+  };
+
+  // Print every counter to f.
+  static void dump(FILE *f);
+  // Block signo in the calling thread, and so in every thread it
+  // creates from now on, and dump to f from a thread of our own
+  // whenever signo arrives. Call before any other thread exists.
+  static void dump_on(int signo, FILE *f);
+  // Have dump also call fn, for statistics kept elsewhere.
+  static void also_dump(void (*fn)(FILE *));
+};
+
+#endif
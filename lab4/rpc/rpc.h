@@ -27,6 +27,162 @@ class rpc_const {
 		static const int cancel_failure = -7;
 };
 
+#define RPCC_ASYNC_THREADS 16
+
+// handle on the result of an asynchronous rpcc call. copies share
+// the same result. wait() blocks until the reply (or the failure)
+// is in and returns what the synchronous call() would have
+// returned; a callback registered with then() runs exactly once,
+// in the thread that completes the call, or right away if the
+// call has already completed. callbacks run on a caller pool and
+// so must not wait() on other asynchronous calls.
+template<class R>
+class rpc_future {
+	public:
+		typedef void (*callback_t)(void *arg, int ret, R &r);
+
+		rpc_future();
+		rpc_future(const rpc_future &f);
+		~rpc_future();
+		rpc_future &operator=(const rpc_future &f);
+
+		bool ready();
+		int wait();
+		int wait(R &r);
+		void then(callback_t cb, void *arg);
+
+		void complete(int ret, R &r);
+
+	private:
+		struct state {
+			pthread_mutex_t m;
+			pthread_cond_t c;
+			int refs;
+			bool done;
+			int ret;
+			R r;
+			callback_t cb;
+			void *cbarg;
+		};
+		state *s_;
+
+		void put();
+};
+
+template<class R>
+rpc_future<R>::rpc_future()
+{
+	s_ = new state();
+	VERIFY(pthread_mutex_init(&s_->m, 0) == 0);
+	VERIFY(pthread_cond_init(&s_->c, 0) == 0);
+	s_->refs = 1;
+	s_->done = false;
+	s_->ret = 0;
+	s_->cb = NULL;
+	s_->cbarg = NULL;
+}
+
+template<class R>
+rpc_future<R>::rpc_future(const rpc_future &f) : s_(f.s_)
+{
+	ScopedLock ml(&s_->m);
+	s_->refs++;
+}
+
+template<class R>
+rpc_future<R>::~rpc_future()
+{
+	put();
+}
+
+template<class R> rpc_future<R> &
+rpc_future<R>::operator=(const rpc_future &f)
+{
+	if (s_ == f.s_)
+		return *this;
+	{
+		ScopedLock ml(&f.s_->m);
+		f.s_->refs++;
+	}
+	put();
+	s_ = f.s_;
+	return *this;
+}
+
+template<class R> void
+rpc_future<R>::put()
+{
+	bool last;
+	{
+		ScopedLock ml(&s_->m);
+		last = (--s_->refs == 0);
+	}
+	if (last) {
+		VERIFY(pthread_mutex_destroy(&s_->m) == 0);
+		VERIFY(pthread_cond_destroy(&s_->c) == 0);
+		delete s_;
+	}
+}
+
+template<class R> bool
+rpc_future<R>::ready()
+{
+	ScopedLock ml(&s_->m);
+	return s_->done;
+}
+
+template<class R> int
+rpc_future<R>::wait()
+{
+	ScopedLock ml(&s_->m);
+	while (!s_->done)
+		VERIFY(pthread_cond_wait(&s_->c, &s_->m) == 0);
+	return s_->ret;
+}
+
+template<class R> int
+rpc_future<R>::wait(R &r)
+{
+	ScopedLock ml(&s_->m);
+	while (!s_->done)
+		VERIFY(pthread_cond_wait(&s_->c, &s_->m) == 0);
+	r = s_->r;
+	return s_->ret;
+}
+
+template<class R> void
+rpc_future<R>::then(callback_t cb, void *arg)
+{
+	{
+		ScopedLock ml(&s_->m);
+		if (!s_->done) {
+			s_->cb = cb;
+			s_->cbarg = arg;
+			return;
+		}
+	}
+	cb(arg, s_->ret, s_->r);
+}
+
+template<class R> void
+rpc_future<R>::complete(int ret, R &r)
+{
+	callback_t cb;
+	void *cbarg;
+	{
+		ScopedLock ml(&s_->m);
+		VERIFY(!s_->done);
+		s_->ret = ret;
+		s_->r = r;
+		s_->done = true;
+		cb = s_->cb;
+		cbarg = s_->cbarg;
+		VERIFY(pthread_cond_broadcast(&s_->c) == 0);
+	}
+	if (cb)
+		cb(cbarg, ret, s_->r);
+}
+
 // rpc client endpoint.
 // manages a xid space per destination socket
 // threaded: multiple threads can be sending RPCs,
@@ -138,6 +294,51 @@ class rpcc : public chanmgr {
 						const A4 & a4, const A5 & a5, const A6 &a6, const A7 &a7,
 						R & r, TO to = to_max); 
 
+		// asynchronous calls: marshall the arguments now, send
+		// the request from a pool of caller threads and hand the
+		// reply to the returned rpc_future. this only emulates
+		// asynchrony: each call holds a pool thread, blocked in
+		// call1(), until its reply is in, so at most as many calls
+		// as the pool has threads are outstanding and the rest
+		// queue. calls go to the shared pool of RPCC_ASYNC_THREADS
+		// unless the caller hands in a pool of its own, so that a
+		// burst of one kind of call cannot hold up another. the
+		// NameNode and DataNode still make only synchronous calls.
+		// the rpcc must outlive every call it has outstanding.
+		template<class R>
+			rpc_future<R> async_call_m(unsigned int proc, marshall &req,
+					TO to, ThrPool *pool = NULL);
+
+		template<class R>
+			rpc_future<R> async_call(unsigned int proc, TO to = to_max,
+					ThrPool *pool = NULL);
+		template<class R, class A1>
+			rpc_future<R> async_call(unsigned int proc, const A1 & a1,
+					TO to = to_max, ThrPool *pool = NULL);
+		template<class R, class A1, class A2>
+			rpc_future<R> async_call(unsigned int proc, const A1 & a1,
+					const A2 & a2, TO to = to_max, ThrPool *pool = NULL);
+		template<class R, class A1, class A2, class A3>
+			rpc_future<R> async_call(unsigned int proc, const A1 & a1,
+					const A2 & a2, const A3 & a3, TO to = to_max,
+					ThrPool *pool = NULL);
+		template<class R, class A1, class A2, class A3, class A4>
+			rpc_future<R> async_call(unsigned int proc, const A1 & a1,
+					const A2 & a2, const A3 & a3, const A4 & a4,
+					TO to = to_max, ThrPool *pool = NULL);
+
+	private:
+		static ThrPool *async_pool();
+
+		template<class R>
+			struct async_job {
+				rpcc *cl;
+				unsigned int proc;
+				std::string args;
+				TO to;
+				rpc_future<R> f;
+				void run(int);
+			};
 };
 
 template<class R> int 
@@ -252,6 +453,98 @@ rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
 	return call_m(proc, m, r, to);
 }
 
+inline ThrPool *
+rpcc::async_pool()
+{
+	static ThrPool pool(RPCC_ASYNC_THREADS);
+	return &pool;
+}
+
+template<class R> void
+rpcc::async_job<R>::run(int)
+{
+	marshall m;
+	unmarshall u;
+	R r = R();
+
+	m.rawbytes(args.data(), args.size());
+	int intret = cl->call1(proc, m, u, to);
+	if (intret >= 0) {
+		u >> r;
+		if (u.okdone() != true) {
+			fprintf(stderr, "rpcc::async_call: failed to unmarshall the "
+					"reply. You are probably calling RPC 0x%x with wrong "
+					"return type.\n", proc);
+			VERIFY(0);
+		}
+	}
+	f.complete(intret, r);
+	delete this;
+}
+
+template<class R> rpc_future<R>
+rpcc::async_call_m(unsigned int proc, marshall &req, TO to, ThrPool *pool)
+{
+	async_job<R> *j = new async_job<R>;
+	j->cl = this;
+	j->proc = proc;
+	j->args = req.str();
+	j->to = to;
+	rpc_future<R> f = j->f;
+	if (pool == NULL)
+		pool = async_pool();
+	VERIFY(pool->addObjJob(j, &async_job<R>::run, 0));
+	return f;
+}
+
+template<class R> rpc_future<R>
+rpcc::async_call(unsigned int proc, TO to, ThrPool *pool)
+{
+	marshall m;
+	return async_call_m<R>(proc, m, to, pool);
+}
+
+template<class R, class A1> rpc_future<R>
+rpcc::async_call(unsigned int proc, const A1 & a1, TO to, ThrPool *pool)
+{
+	marshall m;
+	m << a1;
+	return async_call_m<R>(proc, m, to, pool);
+}
+
+template<class R, class A1, class A2> rpc_future<R>
+rpcc::async_call(unsigned int proc, const A1 & a1, const A2 & a2, TO to,
+		ThrPool *pool)
+{
+	marshall m;
+	m << a1;
+	m << a2;
+	return async_call_m<R>(proc, m, to, pool);
+}
+
+template<class R, class A1, class A2, class A3> rpc_future<R>
+rpcc::async_call(unsigned int proc, const A1 & a1, const A2 & a2,
+		const A3 & a3, TO to, ThrPool *pool)
+{
+	marshall m;
+	m << a1;
+	m << a2;
+	m << a3;
+	return async_call_m<R>(proc, m, to, pool);
+}
+
+template<class R, class A1, class A2, class A3, class A4> rpc_future<R>
+rpcc::async_call(unsigned int proc, const A1 & a1, const A2 & a2,
+		const A3 & a3, const A4 & a4, TO to, ThrPool *pool)
+{
+	marshall m;
+	m << a1;
+	m << a2;
+	m << a3;
+	m << a4;
+	return async_call_m<R>(proc, m, to, pool);
+}
+
 bool operator<(const sockaddr_in &a, const sockaddr_in &b);
 
 class handler {
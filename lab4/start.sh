@@ -4,11 +4,16 @@ ulimit -c unlimited
 
 LOSSY=$1
 NUM_LS=$2
+NUM_ES=$3
 
 if [ -z $NUM_LS ]; then
     NUM_LS=0
 fi
 
+if [ -z $NUM_ES ]; then
+    NUM_ES=1
+fi
+
 BASE_PORT=$RANDOM
 BASE_PORT=$[BASE_PORT+2000]
 EXTENT_PORT=$BASE_PORT
@@ -49,20 +54,29 @@ unset RPC_LOSSY
 
 echo "starting ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &"
 ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &
+EXTENT_DST=$EXTENT_PORT
+x=1
+while [ $x -lt $NUM_ES ]; do
+    port=$[BASE_PORT+100+2*x]
+    echo "starting ./extent_server $port > extent_server$x.log 2>&1 &"
+    ./extent_server $port > extent_server$x.log 2>&1 &
+    EXTENT_DST=$EXTENT_DST,$port
+    x=$[x+1]
+done
 sleep 1
 
 rm -rf $YFSDIR1
 mkdir $YFSDIR1 || exit 1
 sleep 1
-echo "starting ./yfs_client $YFSDIR1 $EXTENT_PORT $LOCK_PORT > yfs_client1.log 2>&1 &"
-./yfs_client $YFSDIR1 $EXTENT_PORT $LOCK_PORT > yfs_client1.log 2>&1 &
+echo "starting ./yfs_client $YFSDIR1 $EXTENT_DST $LOCK_PORT > yfs_client1.log 2>&1 &"
+./yfs_client $YFSDIR1 $EXTENT_DST $LOCK_PORT > yfs_client1.log 2>&1 &
 sleep 1
 
 rm -rf $YFSDIR2
 mkdir $YFSDIR2 || exit 1
 sleep 1
-echo "starting ./yfs_client $YFSDIR2 $EXTENT_PORT $LOCK_PORT > yfs_client2.log 2>&1 &"
-./yfs_client $YFSDIR2 $EXTENT_PORT $LOCK_PORT > yfs_client2.log 2>&1 &
+echo "starting ./yfs_client $YFSDIR2 $EXTENT_DST $LOCK_PORT > yfs_client2.log 2>&1 &"
+./yfs_client $YFSDIR2 $EXTENT_DST $LOCK_PORT > yfs_client2.log 2>&1 &
 
 sleep 2
 
@@ -1,6 +1,9 @@
 // yfs client.  implements FS operations using extent and lock server
 #include "yfs_client.h"
 #include "extent_client.h"
+#include "dir_index.h"
+#include "op_stats.h"
+#include <algorithm>
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
@@ -8,23 +11,148 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <algorithm>
 
-yfs_client::yfs_client()
+// read-ahead window bounds, in bytes
+#define RA_MIN (128 * 1024)
+#define RA_MAX (2 * 1024 * 1024)
+// the dentry cache is emptied when it grows past this many entries
+#define DCACHE_MAX 65536
+// worker threads of remove_tree_l()
+#define RM_FANOUT 8
+
+yfs_client::yfs_client() : next_fh(1), ndentries(0), invalidate(NULL)
 {
     // ec = new extent_client();
+    pthread_mutex_init(&ra_mutex, NULL);
+    pthread_mutex_init(&dcache_mutex, NULL);
 }
 
 yfs_client::yfs_client(std::string extent_dst, std::string lock_dst)
+    : next_fh(1), ndentries(0), invalidate(NULL)
 {
-    ec = new extent_client(extent_dst);
-    lc = new lock_client_cache(lock_dst);
+    pthread_mutex_init(&ra_mutex, NULL);
+    pthread_mutex_init(&dcache_mutex, NULL);
+    lc = new lock_client_cache(lock_dst, this);
+    ec = new extent_client(extent_dst, this);
     if (ec->put(1, "") != extent_protocol::OK)
         printf("error init root dir\n"); // XYB: init root dir
 }
 
-void yfs_client::acquirelock(inum inum)
+void yfs_client::dorelease(lock_protocol::lockid_t lid)
+{
+    dcache_drop(lid);
+    if (ec->flush(lid) != extent_protocol::OK)
+        printf("dorelease: flush %llu error\n", lid);
+    if (invalidate)
+        invalidate(lid);
+}
+
+// Going down to SHARED: other clients may now read the inode, but
+// nobody can change it, so what is cached stays valid.
+void yfs_client::dodowngrade(lock_protocol::lockid_t lid)
+{
+    if (ec->writeback(lid) != extent_protocol::OK)
+        printf("dodowngrade: writeback %llu error\n", lid);
+}
+
+bool yfs_client::dcache_get(inum parent, const std::string &name, bool &found,
+                            inum &ino)
+{
+    bool hit = false;
+    pthread_mutex_lock(&dcache_mutex);
+    std::map<inum, std::map<std::string, inum> >::iterator d = dentries.find(parent);
+    if (d != dentries.end())
+    {
+        std::map<std::string, inum>::iterator it = d->second.find(name);
+        if (it != d->second.end())
+        {
+            hit = true;
+            found = it->second != 0;
+            if (found)
+                ino = it->second;
+        }
+    }
+    pthread_mutex_unlock(&dcache_mutex);
+    return hit;
+}
+
+// Record that name in parent is ino, or is missing if ino is 0.
+// The caller must hold the lock of parent.
+void yfs_client::dcache_put(inum parent, const std::string &name, inum ino)
+{
+    pthread_mutex_lock(&dcache_mutex);
+    if (ndentries >= DCACHE_MAX)
+    {
+        dentries.clear();
+        ndentries = 0;
+    }
+    std::map<std::string, inum> &d = dentries[parent];
+    if (d.count(name) == 0)
+        ndentries++;
+    d[name] = ino;
+    pthread_mutex_unlock(&dcache_mutex);
+}
+
+void yfs_client::dcache_drop(inum parent)
+{
+    pthread_mutex_lock(&dcache_mutex);
+    std::map<inum, std::map<std::string, inum> >::iterator d = dentries.find(parent);
+    if (d != dentries.end())
+    {
+        ndentries -= d->second.size();
+        dentries.erase(d);
+    }
+    pthread_mutex_unlock(&dcache_mutex);
+}
+
+// Operations that only read an inode take its lock SHARED, so that
+// clients reading the same file or directory do not revoke it from
+// each other.
+void yfs_client::acquirelock(inum inum, int mode)
+{
+    op_stats::scope s(op_stats::LOCK);
+    lc->acquire(inum, mode);
+}
+
+// Several locks at once, taken in inum order whatever the order of
+// inums, so that operations on more than one inode cannot deadlock.
+void yfs_client::acquirelocks(const std::vector<inum> &inums, int mode)
 {
-    lc->acquire(inum);
+    op_stats::scope s(op_stats::LOCK);
+    lc->acquire_many(inums, mode);
+}
+
+// Lock inums too, besides held, which are locked already, and add
+// them to held. Ones that all come after everything held are simply
+// taken. Otherwise taking them now could deadlock, so held is given
+// up and taken again along with them, and false is returned: what
+// was read under the locks in held may have changed meanwhile.
+bool yfs_client::extendlocks(std::vector<inum> &held,
+                             const std::vector<inum> &inums)
+{
+    std::vector<inum> more;
+    for (size_t i = 0; i < inums.size(); i++)
+    {
+        if (std::find(held.begin(), held.end(), inums[i]) == held.end())
+            more.push_back(inums[i]);
+    }
+    if (more.empty())
+        return true;
+    if (held.empty() ||
+        *std::min_element(more.begin(), more.end()) >
+        *std::max_element(held.begin(), held.end()))
+    {
+        acquirelocks(more);
+        held.insert(held.end(), more.begin(), more.end());
+        return true;
+    }
+
+    for (size_t i = 0; i < held.size(); i++)
+        releaselock(held[i]);
+    held.insert(held.end(), more.begin(), more.end());
+    acquirelocks(held);
+    return false;
 }
 
 void yfs_client::releaselock(inum inum)
@@ -42,6 +170,24 @@ void yfs_client::releaseBitmap()
     //lc->release(0);
 }
 
+// Directory pages go through the extent client, and so through its
+// cache while we hold the directory's lock.
+class ec_dir_io : public dir_io {
+  extent_client *ec;
+  yfs_client::inum dir;
+
+public:
+  ec_dir_io(extent_client *_ec, yfs_client::inum _dir) : ec(_ec), dir(_dir) {}
+  extent_protocol::status read(uint32_t off, uint32_t size, std::string &buf)
+  {
+    return ec->read(dir, off, size, buf);
+  }
+  extent_protocol::status write(uint32_t off, const std::string &buf)
+  {
+    return ec->write(dir, off, buf);
+  }
+};
+
 yfs_client::inum
 yfs_client::n2i(std::string n)
 {
@@ -61,7 +207,7 @@ yfs_client::filename(inum inum)
 
 bool yfs_client::isfile(inum inum)
 {
-    acquirelock(inum);
+    acquirelock(inum, lock_protocol::SHARED);
     bool r = isfile_l(inum);
     releaselock(inum);
     return r;
@@ -93,7 +239,7 @@ bool yfs_client::isfile_l(inum inum)
 
 bool yfs_client::isdir(inum inum)
 {
-    acquirelock(inum);
+    acquirelock(inum, lock_protocol::SHARED);
     bool r = isdir_l(inum);
     releaselock(inum);
     return r;
@@ -120,7 +266,7 @@ bool yfs_client::isdir_l(inum inum)
 
 bool yfs_client::issymlink(inum inum)
 {
-    acquirelock(inum);
+    acquirelock(inum, lock_protocol::SHARED);
     bool r = issymlink_l(inum);
     releaselock(inum);
     return r;
@@ -133,7 +279,7 @@ bool yfs_client::issymlink_l(inum inum)
 
 int yfs_client::getfile(inum inum, fileinfo &fin)
 {
-    acquirelock(inum);
+    acquirelock(inum, lock_protocol::SHARED);
     int r = getfile_l(inum, fin);
     releaselock(inum);
     return r;
@@ -163,7 +309,7 @@ release:
 
 int yfs_client::getdir(inum inum, dirinfo &din)
 {
-    acquirelock(inum);
+    acquirelock(inum, lock_protocol::SHARED);
     int r = getdir_l(inum, din);
     releaselock(inum);
     return r;
@@ -190,7 +336,7 @@ release:
 
 int yfs_client::getsymlink(inum inum, symlinkinfo &sin)
 {
-    acquirelock(inum);
+    acquirelock(inum, lock_protocol::SHARED);
     int r = getsymlink_l(inum, sin);
     releaselock(inum);
     return r;
@@ -265,56 +411,88 @@ int yfs_client::setattr_l(inum ino, size_t size)
 }
 
 int yfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
+{
+    extent_protocol::attr a;
+    return create(parent, name, mode, ino_out, a);
+}
+
+int yfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out,
+                       extent_protocol::attr &a)
 {
     acquirelock(parent);
-    int r = create_l(parent, name, mode, ino_out);
+    int r = create_l(parent, name, mode, ino_out, a);
     releaselock(parent);
     return r;
 }
 
-int yfs_client::create_l(inum parent, const char *name, mode_t mode, inum &ino_out)
+int yfs_client::create_l(inum parent, const char *name, mode_t mode, inum &ino_out,
+                         extent_protocol::attr &a)
 {
-    int r = OK;
+    int r = create_entry_l(parent, name, extent_protocol::T_FILE, "", ino_out, a);
+    if (r != OK)
+        printf("\tcreate:create entry error!\n");
+    return r;
+}
 
-    /*
-     * your code goes here.
-     * note: lookup is what you need to check if file exist;
-     * after create file or dir, you must remember to modify the parent infomation.
-     */
+// Create an inode of the given type holding data and link it into
+// parent. Every inode is placed by the ring, keyed by its path. When
+// that is the parent's shard the extent server does both in one RPC
+// and returns the new attributes; otherwise the inode is created on
+// its own shard and linked with further RPCs, so that files as well
+// as subtrees spread over the servers.
+int yfs_client::create_entry_l(inum parent, const char *name, uint32_t type,
+                               const std::string &data, inum &ino_out,
+                               extent_protocol::attr &a)
+{
     bool found = false;
-    if (lookup_l(parent, name, found, ino_out) != OK)
-    {
-        printf("\tcreate:lookup error!\n");
-        return IOERR;
-    }
-
-    if (found)
-    {
-        printf("\tcreate:same dir name found!\n");
+    inum existing;
+    if (dcache_get(parent, name, found, existing) && found)
         return EXIST;
-    }
 
-    acquireBitmap();
-    if (ec->create(extent_protocol::T_FILE, ino_out) != extent_protocol::OK)
+    std::string key = filename(parent) + "/" + name;
+    if (!ec->colocated(parent, key))
     {
-        printf("\tcreate::ec create error!\n");
-        releaseBitmap();
-        return IOERR;
-    }
-    releaseBitmap();
+        if (lookup_l(parent, name, found, existing) != OK)
+            return IOERR;
+        if (found)
+            return EXIST;
 
-    dirent dir_pair;
-    dir_pair.name = name;
-    dir_pair.inum = ino_out;
+        acquireBitmap();
+        if (ec->create(type, ino_out, key) != extent_protocol::OK)
+        {
+            releaseBitmap();
+            return IOERR;
+        }
+        releaseBitmap();
 
-    if (addDirent_l(parent, dir_pair) != OK)
-    {
-        printf("\tcreate::addDirent error!\n");
-        return IOERR;
+        dirent dir_pair;
+        dir_pair.name = name;
+        dir_pair.inum = ino_out;
+        if ((!data.empty() &&
+             ec->put(ino_out, data) != extent_protocol::OK) ||
+            addDirent_l(parent, dir_pair) != OK)
+        {
+            acquireBitmap();
+            ec->remove(ino_out);
+            releaseBitmap();
+            return IOERR;
+        }
+        if (ec->getattr(ino_out, a) != extent_protocol::OK)
+            return IOERR;
+        return OK;
     }
 
-    return r;
+    acquireBitmap();
+    int r = ec->create_in_dir(parent, name, type, data, ino_out, a);
+    releaseBitmap();
+    if (r == extent_protocol::EXIST)
+        return EXIST;
+    if (r != extent_protocol::OK)
+        return IOERR;
+    dcache_put(parent, name, ino_out);
+    return OK;
 }
+
 int yfs_client::addDirent(inum inode, dirent dir_pair)
 {
     acquirelock(inode);
@@ -325,31 +503,38 @@ int yfs_client::addDirent(inum inode, dirent dir_pair)
 
 int yfs_client::addDirent_l(inum inode, dirent dir_pair)
 {
-    int r = OK;
+    ec_dir_io io(ec, inode);
+    dir_index index(&io);
 
-    std::list<dirent> dir_list;
-    if (readdir_l(inode, dir_list) != OK)
+    int r = index.insert(dir_pair.name, dir_pair.inum);
+    if (r != extent_protocol::OK)
     {
-        printf("\taddDirent:readdir error!\n");
-        return IOERR;
+        printf("\taddDirent: insert error!\n");
+        return r == extent_protocol::EXIST ? EXIST : IOERR;
     }
-    dir_list.push_back(dir_pair);
-    std::stringstream ss_dir;
-    std::list<dirent>::iterator dir_iter = dir_list.begin();
+    dcache_put(inode, dir_pair.name, dir_pair.inum);
+    return OK;
+}
+
+// Replace the whole content of directory inode with dir_list.
+int yfs_client::writedir_l(inum inode, const std::list<dirent> &dir_list)
+{
+    string_dir_io io;
+    dir_index index(&io);
+
+    std::list<dirent>::const_iterator dir_iter = dir_list.begin();
     while (dir_iter != dir_list.end())
     {
-        ss_dir << dir_iter->name;
-        ss_dir << '\0';
-        ss_dir << dir_iter->inum;
-        //ss_dir << '\n';
+        if (index.insert(dir_iter->name, dir_iter->inum) != extent_protocol::OK)
+            return IOERR;
         dir_iter++;
     }
-    if (ec->put(inode, ss_dir.str()) != extent_protocol::OK)
+    dcache_drop(inode);
+    if (ec->put(inode, io.data) != extent_protocol::OK)
     {
-        printf("\taddDirent: ec put error!\n");
         return IOERR;
     }
-    return r;
+    return OK;
 }
 
 int yfs_client::deleteDirent(inum inode, const char *name)
@@ -362,93 +547,63 @@ int yfs_client::deleteDirent(inum inode, const char *name)
 
 int yfs_client::deleteDirent_l(inum inode, const char *name)
 {
-    int r = OK;
+    ec_dir_io io(ec, inode);
+    dir_index index(&io);
+    inum removed;
 
-    std::list<dirent> dir_list;
-    if (readdir_l(inode, dir_list) != OK)
+    int r = index.remove(name, removed);
+    if (r != extent_protocol::OK && r != extent_protocol::NOENT)
     {
-        printf("\taddDirent:readdir error!\n");
+        printf("\tdeleteDirent: remove error!\n");
         return IOERR;
     }
-    std::stringstream ss_dir;
-    std::list<dirent>::iterator dir_iter = dir_list.begin();
-    while (dir_iter != dir_list.end())
-    {
-        if (dir_iter->name == name)
-        {
-            dir_iter++;
-            continue;
-        }
-        ss_dir << dir_iter->name;
-        ss_dir << '\0';
-        ss_dir << dir_iter->inum;
-        //ss_dir << '\n';
-        dir_iter++;
-    }
-    if (ec->put(inode, ss_dir.str()) != extent_protocol::OK)
+    dcache_put(inode, name, 0);
+    return OK;
+}
+
+// Point name in directory inode at ino; old is the inum it named.
+int yfs_client::replaceDirent_l(inum inode, const char *name, inum ino, inum &old)
+{
+    ec_dir_io io(ec, inode);
+    dir_index index(&io);
+
+    int r = index.replace(name, ino, old);
+    if (r != extent_protocol::OK)
     {
-        printf("\taddDirent: ec put error!\n");
-        return IOERR;
+        printf("\treplaceDirent: replace error!\n");
+        return r == extent_protocol::NOENT ? NOENT : IOERR;
     }
-    return r;
+    dcache_put(inode, name, ino);
+    return OK;
 }
 
 int yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
+{
+    extent_protocol::attr a;
+    return mkdir(parent, name, mode, ino_out, a);
+}
+
+int yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out,
+                      extent_protocol::attr &a)
 {
     acquirelock(parent);
-    int r = mkdir_l(parent, name, mode, ino_out);
+    int r = mkdir_l(parent, name, mode, ino_out, a);
     releaselock(parent);
     return r;
 }
 
-int yfs_client::mkdir_l(inum parent, const char *name, mode_t mode, inum &ino_out)
+int yfs_client::mkdir_l(inum parent, const char *name, mode_t mode, inum &ino_out,
+                        extent_protocol::attr &a)
 {
-    int r = OK;
-
-    /*
-     * your code goes here.
-     * note: lookup is what you need to check if directory exist;
-     * after create file or dir, you must remember to modify the parent infomation.
-     */
-
-    bool found = false;
-    if (lookup_l(parent, name, found, ino_out) != OK)
-    {
-        printf("\tmkdir:lookup error!\n");
-        return IOERR;
-    }
-
-    if (found)
-    {
-        printf("\tmkdir:same dir name found!\n");
-        return EXIST;
-    }
-
-    acquireBitmap();
-    if (ec->create(extent_protocol::T_DIR, ino_out) != extent_protocol::OK)
-    {
-        printf("\tmkdir:ec create error!\n");
-        releaseBitmap();
-        return IOERR;
-    }
-    releaseBitmap();
-
-    dirent dir_pair;
-    dir_pair.name = name;
-    dir_pair.inum = ino_out;
-
-    if (addDirent_l(parent, dir_pair) != OK)
-    {
-        printf("\tmkdir:addDirent error!\n");
-        return IOERR;
-    }
-
+    int r = create_entry_l(parent, name, extent_protocol::T_DIR, "", ino_out, a);
+    if (r != OK)
+        printf("\tmkdir:create entry error!\n");
     return r;
 }
 
 int yfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
 {
-    acquirelock(parent);
+    acquirelock(parent, lock_protocol::SHARED);
     int r = lookup_l(parent, name, found, ino_out);
     releaselock(parent);
     return r;
@@ -461,35 +616,26 @@ int yfs_client::lookup_l(inum parent, const char *name, bool &found, inum &ino_o
     /*
      * your code goes here.
      * note: lookup file from parent dir according to name;
-     * you should design the format of directory content.
+     * directories are hash indexed, see dir_index.h.
      */
-    std::list<dirent> list;
-    if (readdir_l(parent, list) != OK)
-    {
-        printf("\tlookup:readdir error!\n");
-        return IOERR;
-    }
-    found = false;
+    if (dcache_get(parent, name, found, ino_out))
+        return r;
 
-    std::list<dirent>::iterator dirent_iter = list.begin();
-    while (dirent_iter != list.end())
+    ec_dir_io io(ec, parent);
+    dir_index index(&io);
+    if (index.lookup(name, found, ino_out) != extent_protocol::OK)
     {
-        dirent dir_pair = *dirent_iter;
-        if (dir_pair.name == name)
-        {
-            found = true;
-            ino_out = dir_pair.inum;
-            break;
-        }
-        dirent_iter++;
+        printf("\tlookup:dir index error!\n");
+        return IOERR;
     }
+    dcache_put(parent, name, found ? ino_out : 0);
 
     return r;
 }
 
 int yfs_client::readdir(inum dir, std::list<dirent> &list)
 {
-    acquirelock(dir);
+    acquirelock(dir, lock_protocol::SHARED);
     int r = readdir_l(dir, list);
     releaselock(dir);
     return r;
@@ -504,110 +650,289 @@ int yfs_client::readdir_l(inum dir, std::list<dirent> &list)
      * note: you should parse the dirctory content using your defined format,
      * and push the dirents to the list.
      */
-    std::string all_dir_name;
-    dirent entry;
-    if (ec->get(dir, all_dir_name) != extent_protocol::OK)
+    string_dir_io io;
+    if (ec->get(dir, io.data) != extent_protocol::OK)
+    {
+        return IOERR;
+    }
+
+    dir_index index(&io);
+    std::list<dir_index::entry> entries;
+    if (index.list(entries) != extent_protocol::OK)
     {
+        printf("\treaddir:dir index error!\n");
         return IOERR;
     }
 
     list.clear();
-    std::istringstream ss_dir(all_dir_name);
-    while (getline(ss_dir, entry.name, '\0'))
+    std::list<dir_index::entry>::iterator it;
+    for (it = entries.begin(); it != entries.end(); it++)
     {
-        ss_dir >> entry.inum;
+        dirent entry;
+        entry.name = it->name;
+        entry.inum = it->inum;
         list.push_back(entry);
     }
 
     return r;
 }
 
+// readdir() plus the attributes of every entry, fetched with one
+// RPC per extent server instead of one per entry. The attributes
+// are read without the entries' locks, so they do not reflect
+// writes still buffered by other clients.
+int yfs_client::readdirplus(inum dir, std::list<direntplus> &list)
+{
+    std::list<dirent> entries;
+    acquirelock(dir, lock_protocol::SHARED);
+    int r = readdir_l(dir, entries);
+    releaselock(dir);
+    if (r != OK)
+        return r;
+    return attrs_of(entries, list);
+}
+
+int yfs_client::readdirplus_l(inum dir, std::list<direntplus> &list)
+{
+    std::list<dirent> entries;
+    int r = readdir_l(dir, entries);
+    if (r != OK)
+        return r;
+    return attrs_of(entries, list);
+}
+
+int yfs_client::attrs_of(std::list<dirent> &entries, std::list<direntplus> &list)
+{
+    std::vector<inum> inums;
+    std::list<dirent>::iterator it;
+    for (it = entries.begin(); it != entries.end(); it++)
+        inums.push_back(it->inum);
+    std::vector<extent_protocol::attr> attrs;
+    if (ec->getattr_multi(inums, attrs) != extent_protocol::OK)
+    {
+        printf("\treaddirplus:ec getattr_multi error!\n");
+        return IOERR;
+    }
+
+    list.clear();
+    size_t i = 0;
+    for (it = entries.begin(); it != entries.end(); it++, i++)
+    {
+        // removed since the directory was read
+        if (attrs[i].type == 0)
+            continue;
+        direntplus entry;
+        entry.name = it->name;
+        entry.inum = it->inum;
+        entry.attr = attrs[i];
+        list.push_back(entry);
+    }
+    return OK;
+}
+
 int yfs_client::read(inum ino, size_t size, off_t off, std::string &data)
 {
-    acquirelock(ino);
+    acquirelock(ino, lock_protocol::SHARED);
     int r = read_l(ino, size, off, data);
     releaselock(ino);
     return r;
 }
 
+int yfs_client::read(inum ino, size_t size, off_t off, std::string &data,
+                     unsigned long long fh)
+{
+    acquirelock(ino, lock_protocol::SHARED);
+    int r = read_l(ino, size, off, data);
+    releaselock(ino);
+    if (r == OK)
+        read_ahead(fh, ino, off, data.size());
+    return r;
+}
+
+// The read of an open file, left in the extent client's cache: the
+// pieces hold on to the cached chunks they point into, so they stay
+// as they were read after the lock is let go.
+int yfs_client::read(inum ino, size_t size, off_t off,
+                     std::vector<extent_client::piece> &pieces,
+                     unsigned long long fh)
+{
+    acquirelock(ino, lock_protocol::SHARED);
+    int r = OK;
+    if (ec->read(ino, off, size, pieces) != extent_protocol::OK)
+    {
+        printf("\tread:ec read error!\n");
+        r = IOERR;
+    }
+    releaselock(ino);
+    if (r == OK)
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < pieces.size(); i++)
+            n += pieces[i].len;
+        read_ahead(fh, ino, off, n);
+    }
+    return r;
+}
+
 int yfs_client::read_l(inum ino, size_t size, off_t off, std::string &data)
 {
     int r = OK;
 
     /*
-     * your code goes here.
-     * note: read using ec->get().
+     * only the requested range is fetched; the extent client
+     * keeps it, and whatever was read ahead, in its cache.
      */
-    std::string file_content;
-    if (ec->get(ino, file_content) != extent_protocol::OK)
+    if (ec->read(ino, off, size, data) != extent_protocol::OK)
     {
-        printf("\tread:ec get error!\n");
+        printf("\tread:ec read error!\n");
         return IOERR;
     }
-    data = file_content.substr(off, size);
 
     return r;
 }
 
+unsigned long long yfs_client::open(inum ino)
+{
+    pthread_mutex_lock(&ra_mutex);
+    unsigned long long fh = next_fh++;
+    ra_state &s = ra[fh];
+    s.next = 0;
+    s.end = 0;
+    s.window = 0;
+    pthread_mutex_unlock(&ra_mutex);
+    return fh;
+}
+
+void yfs_client::release(unsigned long long fh)
+{
+    pthread_mutex_lock(&ra_mutex);
+    ra.erase(fh);
+    pthread_mutex_unlock(&ra_mutex);
+}
+
+// Called after each read of n bytes at off through open file fh.
+// A read that starts where the previous one ended is sequential:
+// once the reader is within half a window of the prefetched end,
+// the window doubles (up to RA_MAX) and the next stretch is fetched
+// in the background. Any other read resets the window.
+void yfs_client::read_ahead(unsigned long long fh, inum ino, off_t off,
+                            size_t n)
+{
+    off_t from = 0, to = 0;
+
+    pthread_mutex_lock(&ra_mutex);
+    std::map<unsigned long long, ra_state>::iterator it = ra.find(fh);
+    if (it == ra.end())
+    {
+        pthread_mutex_unlock(&ra_mutex);
+        return;
+    }
+    ra_state &s = it->second;
+    if (off != s.next || n == 0)
+    {
+        s.window = 0;
+        s.end = 0;
+    }
+    else
+    {
+        if (s.window == 0)
+            s.window = RA_MIN;
+        if (off + (off_t)n + (off_t)s.window / 2 >= s.end)
+        {
+            if (s.end != 0)
+                s.window = std::min(s.window * 2, (size_t)RA_MAX);
+            from = std::max(s.end, off + (off_t)n);
+            to = off + n + s.window;
+            s.end = to;
+        }
+    }
+    s.next = off + n;
+    pthread_mutex_unlock(&ra_mutex);
+
+    if (to > from)
+        ec->prefetch(ino, from, to - from);
+}
+
 int yfs_client::write(inum ino, size_t size, off_t off, const char *data,
                       size_t &bytes_written)
+{
+    return write(ino, off, std::string(data, size), bytes_written);
+}
+
+int yfs_client::write(inum ino, off_t off, const std::string &data,
+                      size_t &bytes_written)
 {
     acquirelock(ino);
-    int r = write_l(ino, size, off, data, bytes_written);
+    int r = write_l(ino, off, data, bytes_written);
     releaselock(ino);
     return r;
 }
 
-int yfs_client::write_l(inum ino, size_t size, off_t off, const char *data,
+int yfs_client::write_l(inum ino, off_t off, const std::string &data,
                         size_t &bytes_written)
 {
     int r = OK;
 
     /*
-     * your code goes here.
-     * note: write using ec->put().
-     * when off > length of original file, fill the holes with '\0'.
+     * only the written range goes to the extent client, which
+     * buffers it while we hold the lock; the server fills any
+     * hole before off with '\0'.
      */
-
-    std::string file_content;
-    if (ec->get(ino, file_content) != extent_protocol::OK)
-    {
-        printf("\twrite:ec get error!\n");
-        return IOERR;
-    }
-
-    if ((unsigned)off > file_content.size())
-    {
-        std::string replace_string = data;
-        replace_string.resize(size);
-        file_content.resize(off, '\0');
-        file_content.replace(off, size, replace_string);
-    }
-    else
-    {
-        file_content.replace(off, size, data, size);
-    }
-    
     acquireBitmap();
-    if (ec->put(ino, file_content) != extent_protocol::OK)
+    if (ec->write(ino, off, data) != extent_protocol::OK)
     {
-        printf("\twrite:ec put error!\n");
+        printf("\twrite:ec write error!\n");
         releaseBitmap();
         return IOERR;
     }
     releaseBitmap();
+    bytes_written = data.size();
 
     return r;
 }
 
+int yfs_client::fsync(inum ino)
+{
+    // nothing is buffered unless we still hold the lock
+    if (!lc->is_cached(ino))
+        return OK;
+
+    int r = OK;
+    acquirelock(ino);
+    if (ec->writeback(ino) != extent_protocol::OK)
+    {
+        printf("\tfsync:ec writeback error!\n");
+        r = IOERR;
+    }
+    releaselock(ino);
+    return r;
+}
+
 int yfs_client::unlink(inum parent, const char *name)
 {
+    bool found = false;
+    inum ino;
+
+    // holding its lock makes other clients drop what they cache of
+    // the inode, since its number may be reused; if it has to be
+    // locked along with parent, look the name up again
+    std::vector<inum> held(1, parent);
     acquirelock(parent);
-    int r = unlink_l(parent, name);
-    releaselock(parent);
+    int r;
+    do
+        r = lookup_l(parent, name, found, ino);
+    while (r == OK && found &&
+           !extendlocks(held, std::vector<inum>(1, ino)));
+    if (r == OK && !found)
+        r = NOENT;
+    if (r == OK)
+        r = unlink_l(parent, name);
+    for (size_t i = 0; i < held.size(); i++)
+        releaselock(held[i]);
     return r;
 }
 
+// The caller holds the locks of parent and of the inode name refers to.
 int yfs_client::unlink_l(inum parent, const char *name)
 {
     int r = OK;
@@ -640,6 +965,7 @@ int yfs_client::unlink_l(inum parent, const char *name)
         return IOERR;
     }
     releaseBitmap();
+    dcache_drop(remove_ino);
 
     if (deleteDirent_l(parent, name) != OK)
     {
@@ -650,66 +976,491 @@ int yfs_client::unlink_l(inum parent, const char *name)
     return r;
 }
 
+int yfs_client::rename(inum src_dir, const char *src_name, inum dst_dir,
+                       const char *dst_name, bool replace)
+{
+    std::vector<inum> held;
+    held.push_back(src_dir);
+    if (dst_dir != src_dir)
+        held.push_back(dst_dir);
+    acquirelocks(held);
+
+    // an inode about to be replaced is locked along with the two
+    // directories; if they have to be taken again, look again
+    bool found = false;
+    inum old;
+    int r;
+    do
+        r = lookup_l(dst_dir, dst_name, found, old);
+    while (r == OK && found && replace &&
+           !extendlocks(held, std::vector<inum>(1, old)));
+    if (r == OK)
+        r = rename_l(src_dir, src_name, dst_dir, dst_name, replace);
+    else
+        printf("\trename:lookup error!\n");
+
+    for (size_t i = 0; i < held.size(); i++)
+        releaselock(held[i]);
+    return r;
+}
+
+// Move src_name in src_dir to dst_name in dst_dir. If replace is set
+// a file already named dst_name is replaced, as in rename(2), and
+// freed afterwards; otherwise, or if it is a directory, EXIST is
+// returned. Between directories on one shard the move, replacement
+// included, is a single extent server RPC. Across shards it is not
+// atomic: the entry is added to (or replaced in) dst_dir before it
+// is removed from src_dir, so it is never missing from both.
+// The caller holds the locks of both directories and, if replace is
+// set, of the inode dst_name names; holding it makes other clients
+// drop what they cache of it, since its number may be reused.
+int yfs_client::rename_l(inum src_dir, const char *src_name, inum dst_dir,
+                         const char *dst_name, bool replace)
+{
+    bool found = false;
+    inum ino, old;
+
+    if (lookup_l(src_dir, src_name, found, ino) != OK)
+    {
+        printf("\trename:lookup error!\n");
+        return IOERR;
+    }
+    if (!found)
+        return NOENT;
+    if (lookup_l(dst_dir, dst_name, found, old) != OK)
+    {
+        printf("\trename:lookup error!\n");
+        return IOERR;
+    }
+    if (found)
+    {
+        if (old == ino)
+            return OK;
+        if (!replace || isdir_l(old))
+            return EXIST;
+    }
+
+    inum replaced = 0;
+    int r = OK;
+    if (ec->same_shard(src_dir, dst_dir))
+    {
+        r = ec->rename(src_dir, src_name, dst_dir, dst_name, found, ino,
+                       replaced);
+        if (r != extent_protocol::OK)
+        {
+            printf("\trename:ec rename error!\n");
+            r = r == extent_protocol::EXIST ? EXIST :
+                r == extent_protocol::NOENT ? NOENT : IOERR;
+        }
+        else
+        {
+            dcache_put(src_dir, src_name, 0);
+            dcache_put(dst_dir, dst_name, ino);
+        }
+    }
+    else
+    {
+        if (found)
+            r = replaceDirent_l(dst_dir, dst_name, ino, replaced);
+        else
+        {
+            dirent dir_pair;
+            dir_pair.name = dst_name;
+            dir_pair.inum = ino;
+            r = addDirent_l(dst_dir, dir_pair);
+        }
+        if (r != OK)
+            printf("\trename:add entry error!\n");
+        else if (deleteDirent_l(src_dir, src_name) != OK)
+        {
+            printf("\trename:deleteDirent error!\n");
+            r = IOERR;
+        }
+    }
+
+    if (replaced != 0)
+    {
+        acquireBitmap();
+        if (ec->remove(replaced) != extent_protocol::OK)
+        {
+            printf("\trename:ec remove error!\n");
+            r = IOERR;
+        }
+        releaseBitmap();
+        dcache_drop(replaced);
+    }
+    return r;
+}
+
 int yfs_client::symlink(inum parent, const char *dir, const char *name, inum &ino)
+{
+    extent_protocol::attr a;
+    return symlink(parent, dir, name, ino, a);
+}
+
+int yfs_client::symlink(inum parent, const char *dir, const char *name, inum &ino,
+                        extent_protocol::attr &a)
 {
     acquirelock(parent);
-    int r = symlink_l(parent, dir, name, ino);
+    int r = symlink_l(parent, dir, name, ino, a);
     releaselock(parent);
     return r;
 }
 
-int yfs_client::symlink_l(inum parent, const char *dir, const char *name, inum &ino)
+int yfs_client::symlink_l(inum parent, const char *dir, const char *name, inum &ino,
+                          extent_protocol::attr &a)
+{
+    int r = create_entry_l(parent, name, extent_protocol::T_SYMLINK, dir, ino, a);
+    if (r != OK)
+        printf("\tsymlink:create entry error!\n");
+    return r;
+}
+
+int yfs_client::readlink(inum ino, std::string &file_path)
+{
+    acquirelock(ino, lock_protocol::SHARED);
+    int r = readlink_l(ino, file_path);
+    releaselock(ino);
+    return r;
+}
+
+int yfs_client::readlink_l(inum ino, std::string &file_path)
 {
     int r = OK;
+    if (ec->get(ino, file_path) != extent_protocol::OK)
+    {
+        printf("\treadlink:ec get error!\n");
+        return IOERR;
+    }
 
-    acquireBitmap();
-    if (ec->create(extent_protocol::T_SYMLINK, ino) != extent_protocol::OK)
+    return r;
+}
+
+// Copy the file or symlink @src into @parent under @name without
+// moving any data: the extent server shares the data blocks of the
+// two inodes and copies them on write (cp --reflink).
+int yfs_client::clone(inum src, inum parent, const char *name, inum &ino_out)
+{
+    if (isdir(src))
     {
-        printf("\tsymlink:ec create error!\n");
-        releaseBitmap();
+        printf("\tclone:%lld is a directory, use snapshot\n", src);
         return IOERR;
     }
+    return snapshot(src, parent, name, ino_out);
+}
 
-    if (ec->put(ino, dir) != extent_protocol::OK)
+// Copy the whole tree rooted at @src into @parent under @name.
+// Files are cloned on the extent server, only directories are
+// rewritten, so the cost is proportional to the metadata.
+// Each inode is copied under its own lock; the snapshot is
+// consistent per inode, not across the tree.
+int yfs_client::snapshot(inum src, inum parent, const char *name, inum &ino_out)
+{
+    inum ino;
+    int r = clonetree(src, ino);
+    if (r != OK)
     {
-        printf("\tsymlink:ec put error!\n");
-        releaseBitmap();
+        printf("\tsnapshot:clone %lld error!\n", src);
+        return r;
+    }
+
+    acquirelock(parent);
+    r = linkclone(parent, name, ino);
+    releaselock(parent);
+    if (r != OK)
+    {
+        freeclone(ino);
+        return r;
+    }
+    ino_out = ino;
+    return OK;
+}
+
+int yfs_client::linkclone(inum parent, const char *name, inum ino)
+{
+    bool found = false;
+    inum existing;
+    if (lookup_l(parent, name, found, existing) != OK)
+    {
+        printf("\tsnapshot:lookup error!\n");
         return IOERR;
     }
-    releaseBitmap();
-    
+
+    if (found)
+    {
+        printf("\tsnapshot:same dir name found!\n");
+        return EXIST;
+    }
+
     dirent dir_pair;
     dir_pair.name = name;
     dir_pair.inum = ino;
 
     if (addDirent_l(parent, dir_pair) != OK)
     {
-        printf("\tsymlink:addDirent error!\n");
+        printf("\tsnapshot:addDirent error!\n");
         return IOERR;
     }
+    return OK;
+}
+
+int yfs_client::clonetree(inum src, inum &ino_out)
+{
+    int r = OK;
+    extent_protocol::attr a;
+    std::list<dirent> entries;
+
+    acquirelock(src, lock_protocol::SHARED);
+    if (ec->getattr(src, a) != extent_protocol::OK)
+    {
+        releaselock(src);
+        return IOERR;
+    }
+
+    if (a.type != extent_protocol::T_DIR)
+    {
+        if (ec->clone(src, ino_out) != extent_protocol::OK)
+            r = IOERR;
+        releaselock(src);
+        return r;
+    }
 
+    r = readdir_l(src, entries);
+    releaselock(src);
+    if (r != OK)
+        return r;
+
+    if (ec->create(extent_protocol::T_DIR, ino_out) != extent_protocol::OK)
+    {
+        printf("\tsnapshot:ec create error!\n");
+        return IOERR;
+    }
+
+    // nobody else knows ino_out yet, so no lock is needed on it
+    std::list<dirent>::iterator it;
+    for (it = entries.begin(); it != entries.end(); it++)
+    {
+        inum copy;
+        if ((r = clonetree(it->inum, copy)) != OK)
+            break;
+        it->inum = copy;
+    }
+    if (r == OK && (r = writedir_l(ino_out, entries)) == OK)
+        return OK;
+
+    // free what was copied before the error; ino_out may list only
+    // some of it, so go by entries
+    for (std::list<dirent>::iterator c = entries.begin(); c != it; c++)
+        freeclone(c->inum);
+    if (ec->remove(ino_out) != extent_protocol::OK)
+        printf("\tsnapshot:ec remove %lld error!\n", ino_out);
     return r;
 }
 
-int yfs_client::readlink(inum ino, std::string &file_path)
+// Free the tree at @ino that clonetree() made. Nothing links to it
+// and nobody else knows it, so no locks are needed.
+void yfs_client::freeclone(inum ino)
 {
-    acquirelock(ino);
-    int r = readlink_l(ino, file_path);
-    releaselock(ino);
+    extent_protocol::attr a;
+    std::list<dirent> entries;
+
+    if (ec->getattr(ino, a) == extent_protocol::OK &&
+        a.type == extent_protocol::T_DIR && readdir_l(ino, entries) == OK)
+    {
+        std::list<dirent>::iterator it;
+        for (it = entries.begin(); it != entries.end(); it++)
+            freeclone(it->inum);
+    }
+    if (ec->remove(ino) != extent_protocol::OK)
+        printf("\tsnapshot:ec remove %lld error!\n", ino);
+}
+
+// Delete everything below directory dir and leave it empty. held
+// lists the locks the caller holds, dir's among them. The tree is
+// walked a level at a time, reading the directories of a level in
+// parallel; then all the inodes found on it are locked at once. If
+// any comes before a lock already held, everything is given up and
+// taken again together and the walk starts over, so the locks held
+// on return are the caller's again but may have been dropped in
+// between. Then files are removed in parallel and the directories
+// bottom up, deepest level first, so that a directory only goes
+// once all its children have. Entries are never unlinked one by
+// one: each directory goes as a whole. A directory left with
+// children that could not be freed is rewritten to list just those,
+// so that after an error no entry names a freed inode.
+int yfs_client::remove_tree_l(inum dir, const std::vector<inum> &held)
+{
+    rm_state st;
+    pthread_mutex_init(&st.m, NULL);
+    st.yfs = this;
+    st.r = OK;
+
+    std::vector<inum> locked(held);
+    std::vector<inum> level;
+    do
+    {
+        st.levels.clear();
+        st.leaves.clear();
+        st.children.clear();
+        level.assign(1, dir);
+        while (!level.empty() && st.r == OK)
+        {
+            size_t nleaves = st.leaves.size();
+            st.found.clear();
+            rm_run(&st, level, &yfs_client::rm_walk);
+            if (st.r != OK)
+                break;
+            std::vector<inum> found(st.found);
+            found.insert(found.end(), st.leaves.begin() + nleaves,
+                         st.leaves.end());
+            if (!extendlocks(locked, found))
+                break;
+            if (!st.found.empty())
+                st.levels.push_back(st.found);
+            level.swap(st.found);
+        }
+    } while (!level.empty() && st.r == OK);
+
+    int r = st.r;
+    if (r == OK)
+    {
+        rm_run(&st, st.leaves, &yfs_client::rm_leaf);
+        for (size_t i = st.levels.size(); i-- > 0;)
+            rm_run(&st, st.levels[i], &yfs_client::rm_dir);
+
+        std::list<dirent> left;
+        rm_left(&st, dir, left);
+        r = writedir_l(dir, left);
+        if (st.r != OK)
+            r = st.r;
+    }
+    // a tree that could not be read is left as it is, only unlocked
+    for (size_t i = 0; i < locked.size(); i++)
+    {
+        if (std::find(held.begin(), held.end(), locked[i]) == held.end())
+            releaselock(locked[i]);
+    }
+    pthread_mutex_destroy(&st.m);
+    if (r != OK)
+        printf("\tremove_tree:error!\n");
     return r;
 }
 
-int yfs_client::readlink_l(inum ino, std::string &file_path)
+void *yfs_client::rm_worker(void *arg)
 {
-    int r = OK;
-    if (ec->get(ino, file_path) != extent_protocol::OK)
+    rm_state *st = (rm_state *)arg;
+    for (;;)
     {
-        printf("\treadlink:ec get error!\n");
-        return IOERR;
+        pthread_mutex_lock(&st->m);
+        if (st->next == st->items->size())
+        {
+            pthread_mutex_unlock(&st->m);
+            return NULL;
+        }
+        inum ino = (*st->items)[st->next++];
+        pthread_mutex_unlock(&st->m);
+        (st->yfs->*st->fn)(st, ino);
     }
+}
 
-    return r;
+// Apply fn to every item on at most RM_FANOUT threads.
+void yfs_client::rm_run(rm_state *st, const std::vector<inum> &items,
+                        void (yfs_client::*fn)(rm_state *, inum))
+{
+    pthread_t th[RM_FANOUT];
+    size_t n = std::min(items.size(), (size_t)RM_FANOUT);
+
+    st->items = &items;
+    st->next = 0;
+    st->fn = fn;
+    if (n <= 1)
+    {
+        rm_worker(st);
+        return;
+    }
+    for (size_t i = 0; i < n; i++)
+        VERIFY(pthread_create(&th[i], NULL, rm_worker, st) == 0);
+    for (size_t i = 0; i < n; i++)
+        pthread_join(th[i], NULL);
 }
 
+void yfs_client::rm_walk(rm_state *st, inum dir)
+{
+    std::list<direntplus> entries;
+    if (readdirplus_l(dir, entries) != OK)
+    {
+        pthread_mutex_lock(&st->m);
+        st->r = IOERR;
+        pthread_mutex_unlock(&st->m);
+        return;
+    }
 
+    std::vector<inum> dirs, leaves;
+    std::list<dirent> names;
+    std::list<direntplus>::iterator it;
+    for (it = entries.begin(); it != entries.end(); it++)
+    {
+        if (it->attr.type == extent_protocol::T_DIR)
+            dirs.push_back(it->inum);
+        else
+            leaves.push_back(it->inum);
+        dirent e;
+        e.name = it->name;
+        e.inum = it->inum;
+        names.push_back(e);
+    }
+
+    pthread_mutex_lock(&st->m);
+    st->children[dir].swap(names);
+    st->found.insert(st->found.end(), dirs.begin(), dirs.end());
+    st->leaves.insert(st->leaves.end(), leaves.begin(), leaves.end());
+    pthread_mutex_unlock(&st->m);
+}
+
+void yfs_client::rm_leaf(rm_state *st, inum ino)
+{
+    int r = ec->remove(ino);
+    dcache_drop(ino);
+    if (r != extent_protocol::OK)
+        rm_fail(st, ino);
+}
 
+// Free directory ino if all its children were; otherwise keep it,
+// listing only the children left.
+void yfs_client::rm_dir(rm_state *st, inum ino)
+{
+    std::list<dirent> left;
+    rm_left(st, ino, left);
+    int r = extent_protocol::IOERR;
+    if (left.empty())
+        r = ec->remove(ino);
+    if (r != extent_protocol::OK)
+    {
+        rm_fail(st, ino);
+        if (writedir_l(ino, left) != OK)
+            printf("\tremove_tree:rewrite %llu error!\n", ino);
+    }
+    dcache_drop(ino);
+}
+
+void yfs_client::rm_fail(rm_state *st, inum ino)
+{
+    pthread_mutex_lock(&st->m);
+    st->kept.insert(ino);
+    st->r = IOERR;
+    pthread_mutex_unlock(&st->m);
+}
+
+// the entries of dir whose inodes are still there
+void yfs_client::rm_left(rm_state *st, inum dir, std::list<dirent> &left)
+{
+    pthread_mutex_lock(&st->m);
+    std::list<dirent> &names = st->children[dir];
+    std::list<dirent>::iterator it;
+    for (it = names.begin(); it != names.end(); it++)
+    {
+        if (st->kept.count(it->inum))
+            left.push_back(*it);
+    }
+    pthread_mutex_unlock(&st->m);
+}
@@ -10,8 +10,10 @@
 //#include "yfs_protocol.h"
 #include "extent_client.h"
 #include <vector>
+#include <map>
+#include <set>
 
-class yfs_client
+class yfs_client : public lock_release_user, public extent_lock_user
 {
   extent_client *ec;
   lock_client_cache *lc;
@@ -53,20 +55,98 @@ public:
     std::string name;
     yfs_client::inum inum;
   };
+  // a directory entry with the attributes of the inode it names
+  struct direntplus
+  {
+    std::string name;
+    yfs_client::inum inum;
+    extent_protocol::attr attr;
+  };
 
 private:
   static std::string filename(inum);
   static inum n2i(std::string);
 
-  void acquirelock(inum);
+  void acquirelock(inum, int mode = lock_protocol::EXCLUSIVE);
+  void acquirelocks(const std::vector<inum> &,
+                    int mode = lock_protocol::EXCLUSIVE);
+  bool extendlocks(std::vector<inum> &, const std::vector<inum> &);
   void releaselock(inum);
   void acquireBitmap();
   void releaseBitmap();
 
+  int writedir_l(inum, const std::list<dirent> &);
+  int attrs_of(std::list<dirent> &, std::list<direntplus> &);
+  int create_entry_l(inum, const char *, uint32_t, const std::string &,
+                     inum &, extent_protocol::attr &);
+  int clonetree(inum, inum &);
+  void freeclone(inum);
+  int linkclone(inum, const char *, inum);
+
+  // access pattern of an open file, for read-ahead
+  struct ra_state
+  {
+    off_t next;    // where a sequential reader continues
+    off_t end;     // end of what has been prefetched
+    size_t window; // bytes to prefetch past the reader
+  };
+  std::map<unsigned long long, ra_state> ra;
+  unsigned long long next_fh;
+  pthread_mutex_t ra_mutex;
+  void read_ahead(unsigned long long, inum, off_t, size_t);
+
+  // dentry cache: name -> inum per directory, 0 for a name known
+  // to be missing. Entries of a directory are only kept while its
+  // lock is cached here and are dropped in dorelease().
+  std::map<inum, std::map<std::string, inum> > dentries;
+  size_t ndentries;
+  pthread_mutex_t dcache_mutex;
+  bool dcache_get(inum, const std::string &, bool &, inum &);
+  void dcache_put(inum, const std::string &, inum);
+  void dcache_drop(inum);
+  void (*invalidate)(inum);
+
+  // state of one remove_tree_l(), shared by its worker threads
+  struct rm_state
+  {
+    pthread_mutex_t m;
+    yfs_client *yfs;
+    void (yfs_client::*fn)(rm_state *, inum);
+    const std::vector<inum> *items;
+    size_t next;
+    std::vector<inum> leaves; // files and symlinks
+    std::vector<std::vector<inum> > levels; // directories by depth
+    std::vector<inum> found;  // directories of the next level
+    std::map<inum, std::list<dirent> > children; // of each directory read
+    std::set<inum> kept;      // inodes that could not be freed
+    int r;
+  };
+  static void *rm_worker(void *);
+  void rm_run(rm_state *, const std::vector<inum> &,
+              void (yfs_client::*)(rm_state *, inum));
+  void rm_walk(rm_state *, inum);
+  void rm_leaf(rm_state *, inum);
+  void rm_dir(rm_state *, inum);
+  void rm_fail(rm_state *, inum);
+  void rm_left(rm_state *, inum, std::list<dirent> &);
+
 public:
   yfs_client();
   yfs_client(std::string, std::string);
 
+  // extents are cached under their locks; flush them on revoke
+  void dorelease(lock_protocol::lockid_t);
+  void dodowngrade(lock_protocol::lockid_t);
+  // and only while the lock is ours under a running lease
+  bool is_cached(extent_protocol::extentid_t eid) { return lc->is_cached(eid); }
+  bool lapsed(extent_protocol::extentid_t eid) { return lc->lapsed(eid); }
+  extent_protocol::fence_t fence(extent_protocol::extentid_t eid) { return lc->fence(eid); }
+  // fn is told of every inode whose cached copy a revoke dropped,
+  // so that caches above yfs (the kernel's) can drop theirs too
+  void set_invalidate(void (*fn)(inum)) { invalidate = fn; }
+  extent_client *get_extent_client() { return ec; }
+  lock_client_cache *get_lock_client() { return lc; }
+
   bool isfile_l(inum);
   bool isdir_l(inum);
   bool issymlink_l(inum);
@@ -79,13 +159,18 @@ public:
   int lookup_l(inum, const char *, bool &, inum &);
   int addDirent_l(inum, dirent);
   int deleteDirent_l(inum, const char *);
-  int create_l(inum, const char *, mode_t, inum &);
+  int replaceDirent_l(inum, const char *, inum, inum &);
+  int create_l(inum, const char *, mode_t, inum &, extent_protocol::attr &);
   int readdir_l(inum, std::list<dirent> &);
-  int write_l(inum, size_t, off_t, const char *, size_t &);
+  int write_l(inum, off_t, const std::string &, size_t &);
   int read_l(inum, size_t, off_t, std::string &);
   int unlink_l(inum, const char *);
-  int mkdir_l(inum, const char *, mode_t, inum &);
-  int symlink_l(inum, const char *, const char *name, inum &);
+  int remove_tree_l(inum, const std::vector<inum> &);
+  int readdirplus_l(inum, std::list<direntplus> &);
+  int rename_l(inum, const char *, inum, const char *, bool);
+  int mkdir_l(inum, const char *, mode_t, inum &, extent_protocol::attr &);
+  int symlink_l(inum, const char *, const char *name, inum &,
+                extent_protocol::attr &);
   int readlink_l(inum, std::string &);
 
   bool isfile(inum);
@@ -101,13 +186,28 @@ public:
   int addDirent(inum, dirent);
   int deleteDirent(inum, const char *);
   int create(inum, const char *, mode_t, inum &);
+  int create(inum, const char *, mode_t, inum &, extent_protocol::attr &);
   int readdir(inum, std::list<dirent> &);
+  int readdirplus(inum, std::list<direntplus> &);
   int write(inum, size_t, off_t, const char *, size_t &);
+  int write(inum, off_t, const std::string &, size_t &);
   int read(inum, size_t, off_t, std::string &);
+  int read(inum, size_t, off_t, std::string &, unsigned long long);
+  int read(inum, size_t, off_t, std::vector<extent_client::piece> &,
+           unsigned long long);
+  unsigned long long open(inum);
+  void release(unsigned long long);
+  int fsync(inum);
   int unlink(inum, const char *);
+  int rename(inum, const char *, inum, const char *, bool);
   int mkdir(inum, const char *, mode_t, inum &);
+  int mkdir(inum, const char *, mode_t, inum &, extent_protocol::attr &);
   int symlink(inum, const char *, const char *name, inum &);
+  int symlink(inum, const char *, const char *name, inum &,
+              extent_protocol::attr &);
   int readlink(inum, std::string &);
+  int clone(inum, inum, const char *, inum &);
+  int snapshot(inum, inum, const char *, inum &);
   /** you may need to add symbolic link related methods here.*/
 };
 
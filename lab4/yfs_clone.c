@@ -0,0 +1,62 @@
+/*
+ * yfs_clone src dst
+ *
+ * Copy the file, or the whole directory tree, src to dst on the
+ * same yfs mount without copying any data: the extent server
+ * shares the blocks and copies them on write.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "yfs_ioctl.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct stat st;
+  struct yfs_clone_args args;
+  char dir[512], name[512];
+  int fd;
+
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s src dst\n", argv[0]);
+    exit(1);
+  }
+
+  if (stat(argv[1], &st) != 0) {
+    fprintf(stderr, "yfs_clone: %s: %s\n", argv[1], strerror(errno));
+    exit(1);
+  }
+
+  /* dirname() and basename() may change their argument */
+  snprintf(dir, sizeof(dir), "%s", argv[2]);
+  snprintf(name, sizeof(name), "%s", argv[2]);
+  memset(&args, 0, sizeof(args));
+  args.src = st.st_ino;
+  if (strlen(basename(name)) >= sizeof(args.name)) {
+    fprintf(stderr, "yfs_clone: %s: name too long\n", argv[2]);
+    exit(1);
+  }
+  strcpy(args.name, basename(name));
+
+  fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    fprintf(stderr, "yfs_clone: %s: %s\n", dir, strerror(errno));
+    exit(1);
+  }
+  if (ioctl(fd, S_ISDIR(st.st_mode) ? YFS_IOC_SNAPSHOT : YFS_IOC_CLONE,
+            &args) != 0) {
+    fprintf(stderr, "yfs_clone: %s -> %s: %s\n", argv[1], argv[2],
+            strerror(errno));
+    exit(1);
+  }
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,21 @@
+// ioctls of a yfs mount, shared by fuse.cc and the tools that use them
+
+#ifndef yfs_ioctl_h
+#define yfs_ioctl_h
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// Issued on a directory of the mount: link a copy of the file (CLONE)
+// or of the whole tree (SNAPSHOT) whose st_ino is src into the
+// directory as name. Data blocks are shared with the original and
+// only copied when one of the two is written, like cp --reflink.
+struct yfs_clone_args {
+  uint64_t src;
+  char name[256];
+};
+
+#define YFS_IOC_CLONE    _IOW('Y', 1, struct yfs_clone_args)
+#define YFS_IOC_SNAPSHOT _IOW('Y', 2, struct yfs_clone_args)
+
+#endif